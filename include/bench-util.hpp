@@ -0,0 +1,93 @@
+#ifndef __BENCH_UTIL_HPP__
+#define __BENCH_UTIL_HPP__
+
+#include <stdint.h>
+#include <chrono>
+#include <exception>
+#include <thread>
+
+#include <opencv2/opencv.hpp>
+
+#include "vpl-encode-module.hpp"
+
+// 等编码完成的最长时间
+#define BENCH_DRAIN_TIMEOUT_MS      30000
+// 测试画面每帧平移的像素数
+#define BENCH_PAN_STEP              4
+// 平移这么多帧后反向，来回摆动，不会跳回起点变成场景切换
+#define BENCH_PAN_FRAMES            32
+// 随机纹理先在缩小这么多倍的图上生成再放大，得到有结构、能做运动搜索的画面
+#define BENCH_TEXTURE_SCALE         8
+
+typedef std::chrono::steady_clock Clock;
+
+inline double ElapsedMs(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+/**
+ * @brief 生成测试场景：平滑的随机纹理，比输出画面大出平移的范围，用BenchFrame取每一帧
+ */
+inline cv::Mat MakeBenchScene(int w, int h)
+{
+    int margin = BENCH_PAN_STEP * BENCH_PAN_FRAMES;
+    cv::Mat texture((h + margin) / BENCH_TEXTURE_SCALE + 1, (w + margin) / BENCH_TEXTURE_SCALE + 1, CV_8UC3);
+    cv::randu(texture, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::Mat scene;
+    cv::resize(texture, scene, cv::Size(w + margin, h + margin), 0, 0, cv::INTER_CUBIC);
+    return scene;
+}
+
+/**
+ * @brief 第index帧：场景中沿对角线平移的一个w x h窗口，不拷贝。
+ * 相邻帧之间是真实的全局运动，编码器的运动搜索和码率都和实际摄像头画面接近，不像随机噪声每帧都是新内容
+ */
+inline cv::Mat BenchFrame(const cv::Mat& scene, int w, int h, int index)
+{
+    int pos = index % (2 * BENCH_PAN_FRAMES);
+    if (pos > BENCH_PAN_FRAMES)
+        pos = 2 * BENCH_PAN_FRAMES - pos;
+    return scene(cv::Rect(pos * BENCH_PAN_STEP, pos * BENCH_PAN_STEP, w, h));
+}
+
+/**
+ * @brief 等模块编完frames帧，超时返回
+ *
+ * @param start 计时起点
+ * @param firstPacketMs 不为NULL且还是负数时，记下第一个包完成时距start的时间
+ * @return false 超过BENCH_DRAIN_TIMEOUT_MS还没编完
+ */
+inline bool WaitEncoded(VplEncodeModule& module, uint64_t frames, Clock::time_point start,
+                        double *firstPacketMs = NULL)
+{
+    for (;;) {
+        uint64_t encoded = module.GetThroughput().encodedFrames;
+        if (firstPacketMs && *firstPacketMs < 0 && encoded > 0)
+            *firstPacketMs = ElapsedMs(start);
+        if (encoded >= frames)
+            return true;
+        if (ElapsedMs(start) >= BENCH_DRAIN_TIMEOUT_MS)
+            return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+/**
+ * @brief 运行一项测量，模块构造等抛出异常时说明当前环境（runtime、codec、硬件）不支持
+ *
+ * @return false 不支持，调用者打印unsupported
+ */
+template <typename F>
+bool TryMeasure(F measure)
+{
+    try {
+        measure();
+        return true;
+    }
+    catch (std::exception&) {
+        return false;
+    }
+}
+
+#endif // __BENCH_UTIL_HPP__
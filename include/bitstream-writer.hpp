@@ -0,0 +1,142 @@
+#ifndef __BITSTREAM_WRITER_HPP__
+#define __BITSTREAM_WRITER_HPP__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <vector>
+
+#include <vpl/mfx.h>
+
+// 合并写的默认批大小
+#define WRITER_BATCH_SIZE           (1 << 20)
+// 合并缓冲区首地址和批大小的对齐字节数
+#define WRITER_ALIGNMENT            4096
+// 写线程队列里最多排队的bit流个数，超过后Submit阻塞，限制内存占用
+#define WRITER_MAX_PENDING          32
+// 数据不足一批时，合并缓冲区里最早的字节最多停留这么久就写盘，不论后面是否还有数据源源不断地来
+#define WRITER_FLUSH_INTERVAL_MS    200
+
+/**
+ * @brief 写线程状态
+ */
+struct BitstreamWriterStatus
+{
+    size_t queueDepth;              // 当前排队等待写盘的bit流个数
+    size_t maxQueueDepth;           // 排队个数的峰值
+    size_t freeBuffers;             // 空闲链表里的缓冲区个数
+    uint64_t bytesWritten;          // 已写盘字节数
+    uint64_t writeCalls;            // fwrite调用次数
+    double lastWriteMs;             // 最近一次fwrite耗时
+    double maxWriteMs;              // fwrite最长耗时
+    double avgWriteMs;              // fwrite平均耗时
+};
+
+/**
+ * @brief 异步写bit流。同步线程把编码完成的bit流缓冲区交给写线程，同时换回一个空闲缓冲区继续编码；
+ * 写线程把多帧数据合并成对齐的大块再写盘，写完的缓冲区回到空闲链表复用。
+ * 磁盘卡顿只会让排队变长，不会直接卡住编码。
+ */
+class BitstreamWriter
+{
+public:
+    /**
+     * @brief 构造并启动写线程
+     *
+     * @param f 输出文件，由调用者打开和关闭，写线程接管后关闭其stdio缓冲
+     * @param batchSize 合并写的批大小，向上取整到WRITER_ALIGNMENT
+     * @param maxPending 最多排队的bit流个数
+     */
+    BitstreamWriter(FILE *f, size_t batchSize = WRITER_BATCH_SIZE, size_t maxPending = WRITER_MAX_PENDING);
+    /**
+     * @brief 写完剩余数据后退出写线程，释放所有缓冲区
+     */
+    ~BitstreamWriter();
+
+    /**
+     * @brief 把bit流当前的数据交给写线程，bs换成一个同样大小的空缓冲区（malloc申请，调用者用free释放）。
+     * 排队已满时阻塞，直到写线程取走一批
+     */
+    void Submit(mfxBitstream &bs);
+    /**
+     * @brief 编码器报缓冲区不足时调用，bs换成不小于size的空缓冲区。
+     * 旧缓冲区和空闲链表里比size小的缓冲区以后用不上，直接释放
+     */
+    void Grow(mfxBitstream &bs, mfxU32 size);
+    /**
+     * @brief 等已提交的数据全部写盘后退出写线程，可重复调用
+     */
+    void Stop();
+
+    BitstreamWriterStatus GetStatus();
+    /**
+     * @brief 设置写盘回调，每次有bit流的最后一个字节写盘后，在写线程上以写完的个数调用。
+     * bit流按Submit的顺序写盘，使用者按同样的顺序对应。需在第一次Submit之前设置
+     */
+    void SetWrittenCallback(std::function<void(size_t frames)> callback);
+
+private:
+    /**
+     * @brief 一个bit流缓冲区
+     */
+    struct Buffer
+    {
+        mfxU8 *data;
+        mfxU32 capacity;
+        mfxU32 offset;
+        mfxU32 length;
+    };
+
+    FILE *file;
+    size_t batchSize;
+    size_t maxPending;
+    mfxU8 *staging = NULL;              // 合并缓冲区，WRITER_ALIGNMENT对齐
+    size_t staged = 0;                  // 合并缓冲区里已有的字节数，只在写线程访问
+    size_t stagedFrames = 0;            // 结尾还在合并缓冲区里的bit流个数，只在写线程访问
+    std::chrono::steady_clock::time_point stagedSince;  // 合并缓冲区由空变为非空的时刻，只在写线程访问
+    std::function<void(size_t)> writtenCallback;
+
+    std::mutex lock;
+    std::condition_variable pendingCond;    // 有新数据或要求退出时通知写线程
+    std::condition_variable spaceCond;      // 写线程取走数据后通知Submit
+    std::deque<Buffer> pending;             // 等待写盘的缓冲区
+    std::vector<Buffer> freeList;           // 空闲缓冲区，后进先出，优先复用刚写完还在缓存里的
+    bool stop = false;
+    std::thread writeThread;
+
+    // 统计，受lock保护
+    size_t maxQueueDepth = 0;
+    uint64_t bytesWritten = 0;
+    uint64_t writeCalls = 0;
+    double lastWriteMs = 0;
+    double maxWriteMs = 0;
+    double totalWriteMs = 0;
+
+    /**
+     * @brief 写线程，批量取出待写缓冲区，合并写盘后回收
+     */
+    void WriteLoop();
+    /**
+     * @brief 把一段数据追加到合并缓冲区，满一批时写盘；超过一批的大帧直接写
+     */
+    void Append(const mfxU8 *data, size_t length);
+    /**
+     * @brief 把合并缓冲区里的数据写盘
+     */
+    void FlushStaging();
+    /**
+     * @brief fwrite并记录耗时
+     */
+    void WriteOut(const mfxU8 *data, size_t length);
+    /**
+     * @brief 从空闲链表取一个不小于size的缓冲区，没有时新申请，需持有lock
+     */
+    Buffer TakeFree(mfxU32 size);
+};
+
+#endif // __BITSTREAM_WRITER_HPP__
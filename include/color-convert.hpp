@@ -0,0 +1,98 @@
+#ifndef __COLOR_CONVERT_HPP__
+#define __COLOR_CONVERT_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// BGR转YUV使用BT.601 limited range。亮度与cv::cvtColor(COLOR_BGR2YUV_I420)一致（误差不超过1）；
+// 色度取2x2块的平均，cvtColor只取块内一个像素，两者不逐点相同。color-convert-bench对照浮点参考实现检查
+
+/**
+ * @brief 颜色转换使用的指令集
+ */
+enum class ColorConvertIsa
+{
+    SCALAR,
+    SSE41,
+    AVX2,
+};
+
+/**
+ * @brief 获取当前使用的指令集，默认为CPU支持的最高档
+ */
+ColorConvertIsa GetColorConvertIsa();
+/**
+ * @brief 指定指令集（测试和benchmark用），超过CPU支持范围时降到支持的最高档
+ *
+ * @return ColorConvertIsa 实际使用的指令集
+ */
+ColorConvertIsa SetColorConvertIsa(ColorConvertIsa isa);
+/**
+ * @brief 指令集名称
+ */
+const char *ColorConvertIsaName(ColorConvertIsa isa);
+
+/**
+ * @brief 3通道BGR转4通道BGRA（即MFX_FOURCC_RGB4的内存布局），A填255
+ *
+ * @param src BGR数据
+ * @param srcStep BGR行跨度（字节）
+ * @param dst 目标surface的B指针
+ * @param dstPitch 目标行跨度（字节）
+ * @param width 图像宽
+ * @param height 图像高
+ */
+void ConvertBGRToRGB4(const uint8_t *src, size_t srcStep, uint8_t *dst, size_t dstPitch, int width, int height);
+
+/**
+ * @brief 3通道BGR转NV12，一次读取BGR同时写出Y平面和交错的UV平面
+ *
+ * @param dstY Y平面
+ * @param pitchY Y行跨度
+ * @param dstUV UV平面
+ * @param pitchUV UV行跨度
+ * @param width 图像宽，奇数时色度平面宽为(width + 1) / 2，最后一列重复
+ * @param height 图像高，奇数时最后一行重复
+ */
+void ConvertBGRToNV12(const uint8_t *src, size_t srcStep,
+                      uint8_t *dstY, size_t pitchY, uint8_t *dstUV, size_t pitchUV,
+                      int width, int height);
+
+/**
+ * @brief 3通道BGR转I420，一次读取BGR同时写出Y、U、V三个平面
+ *
+ * @param pitchUV U和V平面的行跨度
+ * @param width 图像宽，奇数时色度平面宽为(width + 1) / 2，最后一列重复
+ * @param height 图像高，奇数时最后一行重复
+ */
+void ConvertBGRToI420(const uint8_t *src, size_t srcStep,
+                      uint8_t *dstY, size_t pitchY, uint8_t *dstU, uint8_t *dstV, size_t pitchUV,
+                      int width, int height);
+
+/**
+ * @brief 逐行拷贝一个平面，行跨度相同时整块拷贝
+ *
+ * @param widthBytes 每行有效字节数
+ * @param height 行数
+ */
+void CopyPlane(const uint8_t *src, size_t srcPitch, uint8_t *dst, size_t dstPitch, size_t widthBytes, int height);
+
+/**
+ * @brief NV12交错的UV平面拆成I420的U、V平面
+ *
+ * @param width 图像宽（亮度），需为偶数
+ * @param height 图像高（亮度），需为偶数
+ */
+void ConvertNV12ToI420Chroma(const uint8_t *srcUV, size_t srcPitch, uint8_t *dstU, uint8_t *dstV, size_t dstPitch,
+                             int width, int height);
+
+/**
+ * @brief I420的U、V平面合成NV12交错的UV平面
+ *
+ * @param width 图像宽（亮度），需为偶数
+ * @param height 图像高（亮度），需为偶数
+ */
+void ConvertI420ToNV12Chroma(const uint8_t *srcU, size_t pitchU, const uint8_t *srcV, size_t pitchV,
+                             uint8_t *dstUV, size_t dstPitch, int width, int height);
+
+#endif // __COLOR_CONVERT_HPP__
@@ -0,0 +1,160 @@
+#ifndef __ENCODE_PIPELINE_HPP__
+#define __ENCODE_PIPELINE_HPP__
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <vpl/mfx.h>
+
+#include "encoder-session.hpp"
+#include "bitstream-writer.hpp"
+
+/**
+ * @brief 一个编码session的提交和同步统计
+ */
+struct EncodePipelineStatus
+{
+    uint64_t encodedFrames;         // 同步完成的帧数
+    uint64_t encodedBytes;          // 同步完成的字节数
+    uint64_t maxKeyFrameBytes;      // 最大的I帧字节数
+    uint64_t maxInterFrameBytes;    // 最大的P、B帧字节数
+    uint64_t deviceBusy;            // MFX_WRN_DEVICE_BUSY的次数，含使用者经WaitDeviceBusy记下的VPP
+    uint64_t lostFrames;            // 同步时才报缓冲区不足、数据已经丢了的帧数，缓冲区按runtime要求申请时应一直为0
+};
+
+/**
+ * @brief 一个编码session的提交和同步：AsyncDepth个在途任务组成的环和一个同步线程。
+ * 提交时硬件忙就稍等重试，bit流缓冲区不足就扩容后用同一个surface重试；同步线程按提交顺序
+ * 等待编码完成，把bit流交给写线程并换回空缓冲区。
+ *
+ * VplEncodeModule和VplLadderEncodeModule的每路输出各用一个。Encode、Drain只能在同一时刻的一个线程调用
+ * （编码线程或EncoderPool当前的工作线程），各个回调在说明的线程上调用。
+ */
+class EncodePipeline
+{
+public:
+    /**
+     * @brief 接管encoder的bit流缓冲区，每个在途任务一个
+     *
+     * @param encoder 编码session，要比pipeline活得久
+     * @param writer 写线程，要比pipeline活得久
+     */
+    EncodePipeline(EncoderSession& encoder, BitstreamWriter& writer);
+    /**
+     * @brief 停掉同步线程，bit流缓冲区还给encoder（写线程可能换过，都是malloc申请的）
+     */
+    ~EncodePipeline();
+
+    /**
+     * @brief 编码器收下一帧（surface不为NULL）后、交给同步线程之前，在调用Encode的线程上调用
+     */
+    void SetAcceptedCallback(std::function<void()> callback);
+    /**
+     * @brief 同步线程取回一个bit流、交给写线程之前调用
+     */
+    void SetSyncedCallback(std::function<void(const mfxBitstream& bitstream)> callback);
+    /**
+     * @brief 同步线程完成一个任务后调用，这一帧用过的surface可能已经解锁
+     */
+    void SetReleasedCallback(std::function<void()> callback);
+    /**
+     * @brief 启动同步线程，回调要在这之前设置
+     */
+    void Start();
+
+    /**
+     * @brief 取一个空闲任务提交编码，在途任务已满时阻塞，得到同步点后交给同步线程
+     *
+     * @param surface 输入surface，为NULL时取出编码器缓存的帧
+     * @param ctrl 这一帧的编码控制，没有时为NULL
+     * @return mfxStatus EncodeFrameAsync的返回值，MFX_ERR_NOT_ENOUGH_BUFFER说明超过了BITSTREAM_MAX_BUFFER_SIZE
+     */
+    mfxStatus Encode(mfxFrameSurface1 *surface, mfxEncodeCtrl *ctrl = NULL);
+    /**
+     * @brief 送空surface直到编码器返回MFX_ERR_MORE_DATA，缓存的帧都交给同步线程
+     */
+    void Drain();
+    /**
+     * @brief 等同步线程处理完所有在途任务后退出，可重复调用
+     */
+    void Stop();
+    /**
+     * @brief 同一session上的VPP等调用返回MFX_WRN_DEVICE_BUSY时调用：计数并稍等
+     */
+    void WaitDeviceBusy();
+
+    /**
+     * @brief 在途任务个数上限，即AsyncDepth
+     */
+    size_t TaskCount() const { return tasks.size(); }
+    /**
+     * @brief 已提交、同步线程还没处理完的任务数，等于TaskCount()时Encode会阻塞
+     */
+    size_t PendingTasks();
+    EncodePipelineStatus GetStatus() const;
+
+    EncodePipeline(const EncodePipeline&) = delete;
+    EncodePipeline& operator=(const EncodePipeline&) = delete;
+
+private:
+    /**
+     * @brief 一个在途编码任务：输出bit流和对应的同步点
+     */
+    struct Task
+    {
+        mfxBitstream bitstream;
+        mfxSyncPoint syncp;
+    };
+
+    EncoderSession& encoder;
+    BitstreamWriter& writer;
+    std::vector<Task> tasks;                    // AsyncDepth个任务组成的环，按提交顺序使用
+    uint64_t submittedTasks = 0;                // 已提交的任务数，受taskLock保护
+    uint64_t syncedTasks = 0;                   // 已同步完成的任务数，受taskLock保护
+    bool syncStop = false;                      // 通知同步线程退出，受taskLock保护
+    std::mutex taskLock;
+    std::condition_variable taskCond;           // 任务提交或完成时通知
+    std::thread syncThread;
+
+    std::function<void()> acceptedCallback;
+    std::function<void(const mfxBitstream&)> syncedCallback;
+    std::function<void()> releasedCallback;
+
+    std::atomic<uint64_t> encodedFrames{0};
+    std::atomic<uint64_t> encodedBytes{0};
+    std::atomic<uint64_t> maxKeyFrameBytes{0};  // 只由同步线程写
+    std::atomic<uint64_t> maxInterFrameBytes{0};
+    std::atomic<uint64_t> deviceBusy{0};
+    std::atomic<uint64_t> lostFrames{0};
+    std::atomic<mfxU32> requiredBufferSize{0};  // 同步线程发现缓冲区不够时要求的大小，下次Encode时生效
+
+    /**
+     * @brief 取下一个空闲任务，在途任务已满时阻塞
+     */
+    Task *AcquireTask();
+    /**
+     * @brief 把AcquireTask取到的任务交给同步线程
+     */
+    void SubmitTask();
+    /**
+     * @brief 同步线程，按提交顺序等待任务完成，把bit流交给写线程
+     */
+    void SyncLoop();
+    /**
+     * @brief 缓冲区不足时把session的bit流大小翻倍，task的缓冲区跟着换大，只在调用Encode的线程使用
+     *
+     * @return false 已经到BITSTREAM_MAX_BUFFER_SIZE
+     */
+    bool GrowBitstream(Task& task);
+    /**
+     * @brief 等一个任务编码完成，超时（MFX_WRN_IN_EXECUTION）时接着等，不把还在编码的帧当成失败
+     */
+    mfxStatus SyncTask(Task& task);
+};
+
+#endif // __ENCODE_PIPELINE_HPP__
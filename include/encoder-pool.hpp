@@ -0,0 +1,97 @@
+#ifndef __ENCODER_POOL_HPP__
+#define __ENCODER_POOL_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+
+#include "vpl-encode-module.hpp"
+
+// 工作线程每次调度一路流最多编码的帧数，编完后让给其他流，保证公平
+#define ENCODER_POOL_QUANTUM        4
+
+/**
+ * @brief EncoderPool整体状态
+ */
+struct EncoderPoolStatus
+{
+    size_t workers;                 // 工作线程数
+    size_t streams;                 // 注册的流数
+    size_t readyStreams;            // 正在排队等待工作线程的流数
+    uint64_t steps;                 // 调度次数
+    uint64_t encodedFrames;         // 当前注册的流已编码帧数之和
+    uint64_t encodedBytes;          // 当前注册的流输出字节数之和
+    double framesPerSecond;         // pool创建以来的平均总帧率
+};
+
+/**
+ * @brief 多路编码共用的工作线程池。
+ *
+ * 构造VplEncodeModule时传入pool，模块不再创建自己的编码线程；push入队后模块被放进就绪队列，
+ * 空闲的工作线程按轮转顺序取出就绪的流，每次最多编ENCODER_POOL_QUANTUM帧，没编完的重新排到队尾。
+ * 同一路流同一时刻只会被一个工作线程编码，因此每路流的帧序不变。没有空闲surface或在途任务已满的流
+ * 先放下，由它的同步线程完成一帧后重新排队，工作线程不会卡在一路流上。
+ * 适合一台机器上跑很多路低帧率的流，线程数不随路数增长。
+ */
+class EncoderPool
+{
+public:
+    /**
+     * @brief 创建并启动工作线程
+     *
+     * @param workers 工作线程数，为0时取CPU核数
+     */
+    explicit EncoderPool(size_t workers = 0);
+    /**
+     * @brief 停止工作线程，要求所有模块已经析构
+     */
+    ~EncoderPool();
+
+    /**
+     * @brief 获取总体吞吐，可在任意线程调用
+     */
+    EncoderPoolStatus GetStatus();
+    /**
+     * @brief 获取每路流的吞吐，顺序为注册顺序，可在任意线程调用
+     */
+    std::vector<EncodeThroughput> GetStreamThroughput();
+
+private:
+    friend class VplEncodeModule;
+
+    /**
+     * @brief 模块构造完成时调用，加入流列表
+     */
+    void Register(VplEncodeModule *stream);
+    /**
+     * @brief 模块析构时调用，从就绪队列和流列表中移除，并等待正在编码它的工作线程返回
+     */
+    void Unregister(VplEncodeModule *stream);
+    /**
+     * @brief 流有新帧时调用，不在就绪队列中时放到队尾
+     */
+    void Schedule(VplEncodeModule *stream);
+    /**
+     * @brief 工作线程，轮转编码就绪的流
+     */
+    void WorkerLoop();
+
+    std::vector<std::thread> workerThreads;
+    std::mutex lock;
+    std::condition_variable readyCond;          // 有流就绪或要求退出时通知工作线程
+    std::condition_variable idleCond;           // 工作线程放下一路流时通知Unregister
+    std::deque<VplEncodeModule *> readyStreams; // 就绪队列，受lock保护
+    std::vector<VplEncodeModule *> streams;     // 注册的流，受lock保护
+    bool stop = false;
+
+    std::atomic<uint64_t> steps{0};
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+};
+
+#endif // __ENCODER_POOL_HPP__
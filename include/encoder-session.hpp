@@ -0,0 +1,283 @@
+#ifndef __ENCODER_SESSION_HPP__
+#define __ENCODER_SESSION_HPP__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <vpl/mfx.h>
+
+// 输出流缓冲区大小的下限和上限，实际大小由Init后的BufferSizeInKB决定，不够时翻倍
+#define BITSTREAM_MIN_BUFFER_SIZE   (64 * 1024)
+#define BITSTREAM_MAX_BUFFER_SIZE   (256 * 1024 * 1024)
+// 自适应GOP的名义长度（秒），场景切换和请求关键帧之外不插IDR
+#define ADAPTIVE_GOP_SECONDS        10
+// 推流模式下单帧上限和码率缓冲区为平均帧大小的几倍，越小每帧越平，画质波动越大
+#define STREAMING_FRAME_SIZE_RATIO  2
+
+/**
+ * @brief GOP结构
+ */
+enum class GopMode
+{
+    FIXED,      // SetEncodeParam中的GopPicSize、IdrInterval
+    ADAPTIVE,   // 名义上ADAPTIVE_GOP_SECONDS长的GOP，场景切换时由使用者用mfxEncodeCtrl强制IDR
+    STREAMING,  // 推流：只有第一帧是IDR，之后用滚动帧内刷新代替I帧，单帧大小有上限，需要关键帧时由使用者强制IDR
+};
+
+/**
+ * @brief 命名的编码配置
+ */
+enum class EncoderPreset
+{
+    DEFAULT,            // EncoderConfig的默认值，和原来写死在SetEncodeParam中的一样
+    ULTRA_LOW_LATENCY,  // AsyncDepth 1，无B帧，LowPower，最快档，CBR，推流GOP（帧内刷新、单帧限大小）
+    REALTIME,           // AsyncDepth 2，无B帧，均衡档，自适应GOP
+    MAX_THROUGHPUT,     // 深AsyncDepth，B金字塔，lookahead，吞吐优先、延迟最高
+};
+
+/**
+ * @brief 编码配置，由构造函数传入，Init时经MFXVideoENCODE_Query校验，runtime修正过的字段会打印出来。
+ * 0（或MFX_CODINGOPTION_UNKNOWN）表示交给runtime决定
+ */
+struct EncoderConfig
+{
+    bool useHardware = true;                        // 硬编还是软编
+    mfxU32 codecId = MFX_CODEC_HEVC;                // MFX_CODEC_HEVC、MFX_CODEC_AVC等
+    mfxU32 yuvFourCC = MFX_FOURCC_NV12;             // 编码器输入YUV时的格式，MFX_FOURCC_NV12或MFX_FOURCC_I420
+    mfxU16 targetUsage = MFX_TARGETUSAGE_BALANCED;  // 速度和质量的平衡度，1最好，7最快
+    mfxU16 rateControl = MFX_RATECONTROL_VBR;       // 码率控制方法
+    mfxU16 targetKbps = 4000;                       // 目标码率（CBR、VBR）
+    mfxU16 maxKbps = 0;                             // 最大码率（VBR）
+    mfxU16 qp = 26;                                 // MFX_RATECONTROL_CQP时I、P、B帧的QP，MFX_RATECONTROL_ICQ时的质量（1-51）
+    mfxU16 frameRateN = 10;                         // 帧率 = frameRateN / frameRateD，编码和VPP一致
+    mfxU16 frameRateD = 1;
+    mfxU16 asyncDepth = 3;                          // 最多同时在编码的帧数
+    GopMode gopMode = GopMode::FIXED;               // GOP结构，ADAPTIVE、STREAMING时忽略下面三项
+    mfxU16 gopPicSize = 3;                          // GOP长度
+    mfxU16 gopRefDist = 1;                          // I/P帧间距，1为无B帧
+    mfxU16 idrInterval = 0;                         // 每隔几个I帧一个IDR，0为每个I帧都是IDR
+    mfxU16 bRefType = MFX_B_REF_UNKNOWN;            // B帧能否作参考，MFX_B_REF_PYRAMID为B金字塔
+    mfxU16 lookAheadDepth = 0;                      // 码率控制预读的帧数
+    mfxU16 lowPower = MFX_CODINGOPTION_UNKNOWN;     // MFX_CODINGOPTION_ON时用硬件的低功耗编码单元（VDEnc）
+    mfxU16 intraRefreshCycle = 0;                   // STREAMING时帧内刷新扫过整幅画面的帧数，0为一秒的帧数
+    mfxU32 maxFrameSize = 0;                        // 单帧最大字节数，0时STREAMING取平均帧大小的STREAMING_FRAME_SIZE_RATIO倍，其他不限
+
+    /**
+     * @brief 预设配置
+     */
+    static EncoderConfig Preset(EncoderPreset preset);
+    /**
+     * @brief 按名称取预设："default"、"ultra-low-latency"、"realtime"、"max-throughput"，不认识的名称抛异常
+     */
+    static EncoderConfig Preset(const std::string& name);
+    static const char *PresetName(EncoderPreset preset);
+
+    /**
+     * @brief 逐个字段比较，用作SessionKey的一部分；加字段时这里也要加
+     */
+    bool operator<(const EncoderConfig& other) const
+    {
+        const EncoderConfig& o = other;
+        return std::tie(useHardware, codecId, yuvFourCC, targetUsage, rateControl, targetKbps, maxKbps, qp,
+                        frameRateN, frameRateD, asyncDepth, gopMode, gopPicSize, gopRefDist, idrInterval, bRefType,
+                        lookAheadDepth, lowPower, intraRefreshCycle, maxFrameSize)
+               < std::tie(o.useHardware, o.codecId, o.yuvFourCC, o.targetUsage, o.rateControl, o.targetKbps,
+                          o.maxKbps, o.qp, o.frameRateN, o.frameRateD, o.asyncDepth, o.gopMode, o.gopPicSize,
+                          o.gopRefDist, o.idrInterval, o.bRefType, o.lookAheadDepth, o.lowPower,
+                          o.intraRefreshCycle, o.maxFrameSize);
+    }
+};
+
+/**
+ * @brief 决定一个编码session能否复用的参数，相同的key可以共用SessionPool里预先创建的session
+ */
+struct SessionKey
+{
+    int width = 0;                      // 图像宽
+    int height = 0;                     // 图像高
+    mfxU32 fourCC = MFX_FOURCC_RGB4;    // 编码器输入格式
+    bool useVpp = false;                // 是否在编码前用VPP把RGB4转成fourCC，为true时fourCC需为NV12或I420
+    int outWidth = 0;                   // 编码宽，0表示和width相同；和输入不同时由VPP缩放，需要useVpp
+    int outHeight = 0;                  // 编码高，0表示和height相同
+    bool sharedInput = false;           // VPP输入surface由使用者提供（多路输出共用一份上传），不申请VPP输入pool
+    EncoderConfig config;               // 编码配置
+
+    bool operator<(const SessionKey& other) const
+    {
+        if (width != other.width) return width < other.width;
+        if (height != other.height) return height < other.height;
+        if (fourCC != other.fourCC) return fourCC < other.fourCC;
+        if (useVpp != other.useVpp) return useVpp < other.useVpp;
+        if (outWidth != other.outWidth) return outWidth < other.outWidth;
+        if (outHeight != other.outHeight) return outHeight < other.outHeight;
+        if (sharedInput != other.sharedInput) return sharedInput < other.sharedInput;
+        return config < other.config;
+    }
+};
+
+/**
+ * @brief 一个初始化好的编码session和它的全部资源：加速器、编码和VPP参数、输入surface pool、输出bit流缓冲区。
+ * 同一时刻只属于一个VplEncodeModule，可以提前创建好放在SessionPool里
+ */
+class EncoderSession
+{
+public:
+    /**
+     * @brief 创建session，初始化编码器（和VPP）并申请内存，失败时抛异常
+     */
+    static std::unique_ptr<EncoderSession> Open(const SessionKey& key);
+    /**
+     * @brief 关闭session，释放内存
+     */
+    ~EncoderSession();
+    /**
+     * @brief 给下一路流复用前调用，编码器从新序列开始
+     */
+    mfxStatus Reset();
+
+    SessionKey key;
+    mfxSession session = NULL; // 任务
+    mfxVideoParam encodeParam = {0};    // encode 参数
+    mfxVideoParam vppParam = {0};       // vpp 参数
+    mfxU16 nSurfNumVPPIn = 0;           // VPP 推荐输入surface loop大小
+    mfxU16 nSurfNumVPPOut = 0;          // VPP 输出surface loop大小，VPP推荐数加上编码推荐数
+    mfxU8 *vppInBuf = NULL;             // vpp 输入内存，用于存储图像，以下三块都从FrameArena申请，sharedInput时不申请
+    mfxU8 *vppOutBuf = NULL;            // vpp 输出内存，用于存储图像，兼用于encode输入
+    mfxFrameSurface1 *vppInSurfacePool = NULL;  // vpp输入内存池，用于存储SurfacePool信息
+    mfxFrameSurface1 *vppOutSurfacePool = NULL; // vpp输出内存池，用于存储SurfacePool信息，兼用于encode输入
+    mfxU16 nSurfNumEncIn = 0;           // Encode 推荐输入surface loop大小
+    mfxU8 *encOutBuf = NULL;            // Encode 输入内存，用于存储图像
+    mfxFrameSurface1 *encSurfPool = NULL;       // Encode输入内存池，用于存储SurfacePool信息
+    int accel_fd = 0;                   // 加速器 fd
+    void *accelHandle = NULL;           // 加速器 handle
+
+    mfxFrameInfo inputFrameInfo = {0};  // 输入surface（VPP输入或Encode输入）的格式
+    mfxU16 inputSurfNum = 0;            // 输入surface pool大小，sharedInput时是使用者至少要提供的个数
+    bool skipFrameSupported = false;    // 编码器接受mfxEncodeCtrl.SkipFrame，静止画面可以编成跳帧
+    mfxU32 bitstreamBufferSize = 0;     // 当前bit流缓冲区大小，缓冲区不足时翻倍
+    std::vector<mfxBitstream> bitstreams;   // AsyncDepth个输出缓冲区，malloc申请，使用者可以替换成更大的
+    mfxExtCodingOption2 codingOption2 = {};     // encodeParam.ExtParam指向这里，Reset时仍然有效
+    mfxExtBuffer *encodeExtParams[1] = {NULL};
+
+    /**
+     * @brief 按surface->Info的格式，把Data中各平面指针和Pitch指向从base开始的一块连续内存
+     * 
+     * @param surface 已设置好Info的surface
+     * @param base 内存首地址，大小不小于GetSurfaceSize
+     */
+    static void MapSurfaceData(mfxFrameSurface1 *surface, mfxU8 *base);
+    /**
+     * @brief 获取对应格式的surface大小
+     * 
+     * @param FourCC 格式
+     * @param width 图像宽
+     * @param height 图像高
+     * @return mfxU32 
+     */
+    static mfxU32 GetSurfaceSize(mfxU32 FourCC, mfxU32 width, mfxU32 height);
+    /**
+     * @brief 根据不同都FOURCC从FrameArena申请内存空间，并构造surface loop，每个surface页对齐。
+     * sharedInput时使用者用它申请共用的VPP输入pool
+     * 
+     * @param buf 内存空间指针
+     * @param surfpool surface pool指针
+     * @param frame_info 类型
+     * @param surfnum surface loop中的surface数量
+     * @return mfxStatus 
+     */
+    static mfxStatus AllocateExternalSystemMemorySurfacePool(mfxU8 **buf,
+                                                  mfxFrameSurface1 *surfpool,
+                                                  mfxFrameInfo frame_info,
+                                                  mfxU16 surfnum);
+    /**
+     * @brief 释放buffer和内存池
+     * 
+     * @param buf 
+     * @param surfpool 
+     */
+    static void FreeExternalSystemMemorySurfacePool(mfxU8 *buf, mfxFrameSurface1 *surfpool);
+    static void PrintParam(mfxVideoParam param);
+    static mfxU16 FourCCToChromaFormat(mfxU32 fourCC);
+
+    EncoderSession(const EncoderSession&) = delete;
+    EncoderSession& operator=(const EncoderSession&) = delete;
+
+private:
+    EncoderSession() {}
+
+    /**
+     * @brief 按步骤创建session、初始化编码器、申请surface和bit流
+     */
+    void Init(const SessionKey& key);
+    /**
+     * @brief 根据Init后的BufferSizeInKB和图像大小确定bit流缓冲区初始大小
+     */
+    mfxU32 GetBitstreamBufferSize();
+    /**
+     * @brief 初始化加速器
+     * 
+     * @param session 
+     * @param fd 
+     * @return void* 
+     */
+    static void *InitAcceleratorHandle(mfxSession session, int *fd);
+    /**
+     * @brief 按配置设置Encode参数，CodingOption2中的字段由Init单独设置
+     * 
+     * @return mfxVideoParam 
+     */
+    static mfxVideoParam SetEncodeParam(int w, int h, mfxU32 fourCC, const EncoderConfig& config);
+    /**
+     * @brief 按配置填写codingOption2并挂到encodeParam上，没有需要设置的字段时不挂
+     * 
+     * @param skipFrame 是否同时打开跳帧控制
+     */
+    void SetCodingOption2(bool skipFrame);
+    /**
+     * @brief 码控方法是否使用HRD缓冲区（BufferSizeInKB、InitialDelayInKB）
+     */
+    static bool HasHrdBuffer(mfxU16 rateControl);
+    /**
+     * @brief 推流模式下平均每帧的字节数，由码率和帧率算出
+     */
+    static mfxU32 AverageFrameSize(const EncoderConfig& config);
+    /**
+     * @brief 打印Query修正过的字段
+     */
+    static void PrintAdjustedParam(const mfxVideoParam& requested, const mfxVideoParam& corrected,
+                                   const mfxExtCodingOption2& requestedOption2,
+                                   const mfxExtCodingOption2& correctedOption2);
+    /**
+     * @brief surface宽度取整，使每个平面的每一行都从ARENA_ROW_ALIGNMENT字节边界开始
+     * 
+     * @param w 图像宽
+     * @param fourCC surface格式
+     * @return mfxU16 
+     */
+    static mfxU16 AlignSurfaceWidth(int w, mfxU32 fourCC);
+    /**
+     * @brief 设置VPP参数，输入RGB4，输出和编码器输入相同，输出大小和输入不同时VPP同时缩放
+     * 
+     * @param w 输入图像宽
+     * @param h 输入图像高
+     * @param outW 输出（编码）宽
+     * @param outH 输出（编码）高
+     * @param outFourCC VPP输出格式，即编码器输入格式
+     * @param config 帧率和AsyncDepth和编码器一致
+     * @return mfxVideoParam 
+     */
+    static mfxVideoParam SetVPPParam(int w, int h, int outW, int outH, mfxU32 outFourCC, const EncoderConfig& config);
+    /**
+     * @brief 释放加速器
+     * 
+     * @param accelHandle 
+     * @param fd 
+     */
+    static void FreeAcceleratorHandle(void *accelHandle, int fd);
+};
+
+#endif // __ENCODER_SESSION_HPP__
@@ -0,0 +1,170 @@
+#ifndef __FRAME_ARENA_HPP__
+#define __FRAME_ARENA_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+// 行首对齐，SIMD转换和编码器按缓存行读写
+#define ARENA_ROW_ALIGNMENT         64
+// 普通页和大页大小
+#define ARENA_PAGE_SIZE             4096
+#define ARENA_HUGE_PAGE_SIZE        (2 * 1024 * 1024)
+
+/**
+ * @brief 内存页类型
+ */
+enum class ArenaPageMode
+{
+    NORMAL,             // 4KB页
+    TRANSPARENT_HUGE,   // 按2MB对齐映射并madvise(MADV_HUGEPAGE)，由内核透明大页合并
+    HUGETLB,            // MAP_HUGETLB预留的大页，预留不够时退回TRANSPARENT_HUGE
+};
+
+/**
+ * @brief 内存池配置，修改后只影响之后新映射的块
+ */
+struct FrameArenaOptions
+{
+    ArenaPageMode pageMode = ArenaPageMode::TRANSPARENT_HUGE;
+    int numaNode = -1;          // 绑定的NUMA节点，-1不绑定
+    bool prefault = true;       // 映射后立即逐页写一次，缺页发生在创建时而不是第一帧
+};
+
+/**
+ * @brief 内存池占用情况
+ */
+struct FrameArenaStatus
+{
+    size_t mappedBytes;         // 向系统映射的总字节数（含空闲块）
+    size_t usedBytes;           // 正在使用的字节数
+    size_t peakUsedBytes;       // 使用字节数的峰值
+    size_t hugePageBytes;       // 用大页（HUGETLB或透明大页）映射的字节数
+    size_t blocks;              // 映射的块数
+    size_t freeBlocks;          // 空闲待复用的块数
+    uint64_t allocations;       // Allocate次数
+    uint64_t reuses;            // 直接复用空闲块、没有新映射的次数
+    uint64_t hugetlbFallbacks;  // HUGETLB映射失败退回透明大页的次数
+};
+
+/**
+ * @brief 给surface pool和输入帧缓冲区用的页对齐内存池。
+ *
+ * 每个块用mmap单独映射，起始地址按页（大于2MB的块在大页模式下按2MB）对齐，匿名映射的内存本来就是0，
+ * 不需要calloc再清零。释放的块按大小挂在空闲链表上，下次申请同样大小时直接复用，不再缺页；
+ * 只有Trim才把空闲块还给系统。可以在任意线程调用。
+ */
+class FrameArena
+{
+public:
+    /**
+     * @brief 进程内共享的内存池，EncoderSession和VplEncodeModule默认都从这里申请
+     */
+    static FrameArena& Instance();
+
+    explicit FrameArena(const FrameArenaOptions& options = FrameArenaOptions());
+    ~FrameArena();
+
+    /**
+     * @brief 申请一块内存，大小向上取整到页，失败返回NULL
+     */
+    void *Allocate(size_t size);
+    /**
+     * @brief 归还Allocate得到的内存，放入空闲链表等待复用
+     */
+    void Release(void *ptr);
+    /**
+     * @brief 把所有空闲块还给系统
+     */
+    void Trim();
+
+    void SetOptions(const FrameArenaOptions& options);
+    FrameArenaOptions GetOptions();
+    FrameArenaStatus GetStatus();
+
+    /**
+     * @brief 一个surface占多大内存，连续存放多个surface时保证每个都从页边界开始
+     *
+     * @param size GetSurfaceSize的结果
+     */
+    size_t SurfaceStride(size_t size);
+    /**
+     * @brief 行字节数向上取整到ARENA_ROW_ALIGNMENT
+     */
+    static size_t AlignRow(size_t rowBytes);
+
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+
+private:
+    /**
+     * @brief 一块映射的内存
+     */
+    struct Block
+    {
+        size_t size;        // 映射大小
+        bool hugePage;      // 是否用了大页
+        bool used;          // 是否已分配出去
+    };
+
+    std::mutex lock;
+    FrameArenaOptions options;
+    std::map<void*, Block> blocks;                  // 所有映射的块，按地址查找
+    std::multimap<size_t, void*> freeBlocks;        // 空闲块，按大小查找
+    size_t mappedBytes = 0;
+    size_t usedBytes = 0;
+    size_t peakUsedBytes = 0;
+    size_t hugePageBytes = 0;
+    uint64_t allocations = 0;
+    uint64_t reuses = 0;
+    uint64_t hugetlbFallbacks = 0;
+
+    /**
+     * @brief 按options映射一块新内存，依次尝试HUGETLB、透明大页和普通页
+     *
+     * @param hugePage 输出，是否用了大页
+     * @param fallback 输出，HUGETLB是否失败退回
+     */
+    static void *Map(size_t size, const FrameArenaOptions& options, bool& hugePage, bool& fallback);
+    /**
+     * @brief 大页模式下大块按2MB取整，否则按4KB
+     */
+    size_t RoundSize(size_t size) const;
+    /**
+     * @brief 映射2MB对齐的内存，多映射一个大页再把首尾多余部分释放
+     */
+    static void *MapAligned(size_t size, size_t alignment);
+    /**
+     * @brief 把内存绑定到NUMA节点，需在第一次访问前调用
+     */
+    static bool BindNode(void *ptr, size_t size, int node);
+};
+
+/**
+ * @brief 让cv::Mat从FrameArena申请数据，用法：mat.allocator = &allocator; mat.create(...)
+ */
+class ArenaMatAllocator : public cv::MatAllocator
+{
+public:
+    explicit ArenaMatAllocator(FrameArena& arena = FrameArena::Instance()) : arena(arena) {}
+
+#if CV_VERSION_MAJOR >= 4
+    cv::UMatData *allocate(int dims, const int *sizes, int type, void *data, size_t *step,
+                           cv::AccessFlag flags, cv::UMatUsageFlags usageFlags) const override;
+    bool allocate(cv::UMatData *data, cv::AccessFlag accessFlags, cv::UMatUsageFlags usageFlags) const override;
+#else
+    cv::UMatData *allocate(int dims, const int *sizes, int type, void *data, size_t *step,
+                           int flags, cv::UMatUsageFlags usageFlags) const override;
+    bool allocate(cv::UMatData *data, int accessFlags, cv::UMatUsageFlags usageFlags) const override;
+#endif
+    void deallocate(cv::UMatData *data) const override;
+
+private:
+    FrameArena& arena;
+};
+
+#endif // __FRAME_ARENA_HPP__
@@ -0,0 +1,60 @@
+#ifndef __FRAME_BUFFER_POOL_HPP__
+#define __FRAME_BUFFER_POOL_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+/**
+ * @brief 输入帧缓冲池状态
+ */
+struct FrameBufferPoolStatus
+{
+    size_t buffers;             // 预先申请的缓冲区个数
+    size_t freeBuffers;         // 当前没有被引用的缓冲区个数
+    uint64_t acquires;          // 取缓冲区的次数
+    uint64_t misses;            // 全部在用、只能临时申请的次数
+};
+
+/**
+ * @brief 预先按surface大小申请好的输入帧缓冲区，push时取一个填入转换后的图像。
+ *
+ * 缓冲区被取走后，由队列、编码线程或零拷贝surface持有的cv::Mat引用着；这些引用都释放后
+ * （上传到surface之后，或零拷贝surface解锁之后）引用计数回到1，自动视为空闲，不需要显式归还。
+ * 全部在用时临时申请一块，不阻塞调用者。Acquire可以在多个线程调用。
+ */
+class FrameBufferPool
+{
+public:
+    /**
+     * @brief 申请count个rows x cols的缓冲区
+     *
+     * @param allocator 缓冲区的分配器，为NULL时用OpenCV默认分配器，要比pool和取出的Mat活得久
+     */
+    FrameBufferPool(int rows, int cols, int type, size_t count, cv::MatAllocator *allocator = NULL);
+
+    /**
+     * @brief 取一个没有被引用的缓冲区，内容是上一次使用留下的
+     */
+    cv::Mat Acquire();
+    FrameBufferPoolStatus GetStatus();
+
+private:
+    std::mutex lock;
+    std::vector<cv::Mat> buffers;
+    size_t next = 0;            // 下一次从这里开始找，按轮转顺序复用
+    int rows, cols, type;
+    cv::MatAllocator *allocator;
+    uint64_t acquires = 0;
+    uint64_t misses = 0;
+
+    /**
+     * @brief 除了pool自己没有别的Mat引用这块缓冲区
+     */
+    static bool IsFree(const cv::Mat& buffer);
+};
+
+#endif // __FRAME_BUFFER_POOL_HPP__
@@ -0,0 +1,199 @@
+#ifndef __FRAME_RING_HPP__
+#define __FRAME_RING_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <utility>
+#include <vector>
+
+// 缓存行大小，读写索引分开放，避免伪共享
+#define FRAME_RING_CACHE_LINE       64
+
+/**
+ * @brief 定长帧队列接口，push和ReadFrame之间传递图像用
+ *
+ * @tparam T 槽位类型，要求可默认构造、可移动
+ */
+template <typename T>
+class FrameRing
+{
+public:
+    virtual ~FrameRing() {}
+    /**
+     * @brief 放入一项，成功时item被移走
+     *
+     * @return false 队列已满，item不变
+     */
+    virtual bool TryPush(T& item) = 0;
+    /**
+     * @brief 取出最早的一项
+     *
+     * @return false 队列为空
+     */
+    virtual bool TryPop(T& item) = 0;
+    /**
+     * @brief 当前元素个数（并发下为近似值）
+     */
+    virtual size_t Size() const = 0;
+    /**
+     * @brief 容量，构造时向上取整到2的幂
+     */
+    virtual size_t Capacity() const = 0;
+
+protected:
+    static size_t RoundUpPow2(size_t n)
+    {
+        size_t cap = 2;
+        while (cap < n) cap <<= 1;
+        return cap;
+    }
+};
+
+/**
+ * @brief 单生产者单消费者无锁环形队列
+ *
+ * 只允许一个线程TryPush、一个线程TryPop。槽位预先分配，运行时不再申请内存。
+ */
+template <typename T>
+class SpscRing : public FrameRing<T>
+{
+public:
+    explicit SpscRing(size_t capacity)
+        : mask(FrameRing<T>::RoundUpPow2(capacity) - 1), slots(mask + 1) {}
+
+    bool TryPush(T& item) override
+    {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        if (t - headCache > mask) {
+            // 缓存的读索引显示已满，重新读一次真实值
+            headCache = head.load(std::memory_order_acquire);
+            if (t - headCache > mask)
+                return false;
+        }
+        slots[t & mask] = std::move(item);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool TryPop(T& item) override
+    {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if (h == tailCache) {
+            tailCache = tail.load(std::memory_order_acquire);
+            if (h == tailCache)
+                return false;
+        }
+        item = std::move(slots[h & mask]);
+        slots[h & mask] = T();  // 及时释放槽位持有的资源（如Mat引用计数）
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t Size() const override
+    {
+        size_t t = tail.load(std::memory_order_acquire);
+        size_t h = head.load(std::memory_order_acquire);
+        return t > h ? t - h : 0;
+    }
+
+    size_t Capacity() const override { return mask + 1; }
+
+private:
+    const size_t mask;
+    std::vector<T> slots;
+    alignas(FRAME_RING_CACHE_LINE) std::atomic<size_t> head{0};    // 消费者写
+    size_t tailCache = 0;                                           // 消费者缓存的写索引
+    alignas(FRAME_RING_CACHE_LINE) std::atomic<size_t> tail{0};    // 生产者写
+    size_t headCache = 0;                                           // 生产者缓存的读索引
+};
+
+/**
+ * @brief 多生产者无锁环形队列（每个槽位带序号，CAS抢占读写索引）
+ *
+ * 多个采集线程可同时TryPush。出队同样走CAS，因此生产者在队满时也可以
+ * 调TryPop丢弃最老的一帧，不会破坏消费者。
+ */
+template <typename T>
+class MpscRing : public FrameRing<T>
+{
+public:
+    explicit MpscRing(size_t capacity)
+        : mask(FrameRing<T>::RoundUpPow2(capacity) - 1), cells(mask + 1)
+    {
+        for (size_t i = 0; i <= mask; i++)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    bool TryPush(T& item) override
+    {
+        Cell* cell;
+        size_t pos = tail.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &cells[pos & mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0) {
+                return false;   // 已满
+            }
+            else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = std::move(item);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool TryPop(T& item) override
+    {
+        Cell* cell;
+        size_t pos = head.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &cells[pos & mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0) {
+                return false;   // 为空
+            }
+            else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+        item = std::move(cell->data);
+        cell->data = T();
+        cell->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t Size() const override
+    {
+        size_t t = tail.load(std::memory_order_acquire);
+        size_t h = head.load(std::memory_order_acquire);
+        return t > h ? t - h : 0;
+    }
+
+    size_t Capacity() const override { return mask + 1; }
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    const size_t mask;
+    std::vector<Cell> cells;
+    alignas(FRAME_RING_CACHE_LINE) std::atomic<size_t> head{0};
+    alignas(FRAME_RING_CACHE_LINE) std::atomic<size_t> tail{0};
+};
+
+#endif // __FRAME_RING_HPP__
@@ -0,0 +1,90 @@
+#ifndef __LATENCY_HISTOGRAM_HPP__
+#define __LATENCY_HISTOGRAM_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// 每个2的幂区间再等分的份数（2^HISTOGRAM_SUB_BUCKET_BITS），相对误差不超过1/16
+#define HISTOGRAM_SUB_BUCKET_BITS   4
+// 能区分的最大值为2^(HISTOGRAM_MAX_EXPONENT+1)微秒（约38小时），更大的值计入最后一格
+#define HISTOGRAM_MAX_EXPONENT      36
+#define HISTOGRAM_SUB_BUCKETS       (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS           ((HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BUCKET_BITS + 2) * HISTOGRAM_SUB_BUCKETS)
+
+/**
+ * @brief 直方图的统计结果，单位毫秒
+ */
+struct LatencyPercentiles
+{
+    uint64_t count;                 // 记录的次数
+    double lastMs;                  // 最近一次
+    double avgMs;                   // 平均
+    double p50Ms;                   // 中位数
+    double p95Ms;
+    double p99Ms;
+    double maxMs;                   // 最长
+};
+
+/**
+ * @brief HDR风格的对数线性延迟直方图，以微秒记录。小于HISTOGRAM_SUB_BUCKETS的值每微秒一格，
+ * 之后每个2的幂区间等分成HISTOGRAM_SUB_BUCKETS格，格宽随数值增长，相对误差固定。
+ *
+ * Record只有几次relaxed原子加，不加锁，可以一直开着；多个线程同时Record也是安全的，
+ * 各阶段一般只由负责该阶段的线程记录，计数所在的缓存行不会来回争用。
+ * Snapshot可在任意线程调用，和Record并发时各格的计数不是同一时刻的，对监控足够。
+ */
+class LatencyHistogram
+{
+public:
+    /**
+     * @brief 记录一次耗时
+     *
+     * @param us 微秒
+     */
+    void Record(uint64_t us)
+    {
+        counts[BucketIndex(us)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(us, std::memory_order_relaxed);
+        last.store(us, std::memory_order_relaxed);
+        uint64_t seen = max.load(std::memory_order_relaxed);
+        while (us > seen && !max.compare_exchange_weak(seen, us, std::memory_order_relaxed))
+            ;
+    }
+    /**
+     * @brief 按当前计数算出平均、分位数和最大值
+     */
+    LatencyPercentiles Snapshot() const;
+
+    /**
+     * @brief 数值所在的格
+     */
+    static size_t BucketIndex(uint64_t us)
+    {
+        if (us < HISTOGRAM_SUB_BUCKETS)
+            return (size_t)us;
+        int exponent = 63 - __builtin_clzll(us);
+        if (exponent > HISTOGRAM_MAX_EXPONENT)
+            return HISTOGRAM_BUCKETS - 1;
+        size_t sub = (size_t)(us >> (exponent - HISTOGRAM_SUB_BUCKET_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+        return (size_t)(exponent - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+    }
+    /**
+     * @brief 一格的下界（微秒）
+     */
+    static uint64_t BucketLowerBound(size_t index);
+    /**
+     * @brief 一格的宽度（微秒）
+     */
+    static uint64_t BucketWidth(size_t index);
+
+private:
+    std::atomic<uint64_t> counts[HISTOGRAM_BUCKETS] = {};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> last{0};
+    std::atomic<uint64_t> max{0};
+};
+
+#endif // __LATENCY_HISTOGRAM_HPP__
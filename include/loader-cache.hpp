@@ -0,0 +1,91 @@
+#ifndef __LOADER_CACHE_HPP__
+#define __LOADER_CACHE_HPP__
+
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <vpl/mfx.h>
+
+/**
+ * @brief 选择实现的过滤条件，相同条件共用一个loader
+ */
+struct LoaderFilter
+{
+    mfxU32 implType = MFX_IMPL_TYPE_HARDWARE;           // MFX_IMPL_TYPE_HARDWARE或MFX_IMPL_TYPE_SOFTWARE
+    mfxU32 codecId = MFX_CODEC_HEVC;                    // 编码器，MFX_CODEC_*
+    mfxU32 memHandleType = MFX_RESOURCE_SYSTEM_SURFACE; // 输入内存类型，MFX_RESOURCE_*
+    bool needVpp = false;                               // 是否要求实现支持VPP颜色转换
+
+    bool operator<(const LoaderFilter& other) const
+    {
+        if (implType != other.implType) return implType < other.implType;
+        if (codecId != other.codecId) return codecId < other.codecId;
+        if (memHandleType != other.memHandleType) return memHandleType < other.memHandleType;
+        return needVpp < other.needVpp;
+    }
+};
+
+/**
+ * @brief 进程内共享的loader和实现描述缓存。
+ *
+ * MFXLoad、设置过滤条件和枚举实现对每种过滤条件只做一次，之后创建session直接复用，
+ * 不再重新加载runtime和查询能力。loader在进程退出前不释放，所有session要在此之前关闭。
+ */
+class VplLoaderCache
+{
+public:
+    static VplLoaderCache& Instance();
+
+    /**
+     * @brief 提前加载并枚举实现，程序启动时调用可以把开销移出第一路流的创建
+     *
+     * @return mfxStatus 没有满足条件的实现时返回MFX_ERR_NOT_FOUND
+     */
+    mfxStatus Warmup(const LoaderFilter& filter);
+    /**
+     * @brief 用缓存的loader创建session
+     *
+     * @param implIndex 实现序号，对应GetImplementations的下标
+     */
+    mfxStatus CreateSession(const LoaderFilter& filter, mfxSession *session, mfxU32 implIndex = 0);
+    /**
+     * @brief 获取满足条件的实现描述，指针在进程退出前一直有效
+     */
+    std::vector<const mfxImplDescription*> GetImplementations(const LoaderFilter& filter);
+
+    VplLoaderCache(const VplLoaderCache&) = delete;
+    VplLoaderCache& operator=(const VplLoaderCache&) = delete;
+
+private:
+    /**
+     * @brief 一种过滤条件对应的loader和枚举结果
+     */
+    struct Entry
+    {
+        mfxLoader loader = NULL;
+        std::vector<mfxImplDescription*> descriptions;
+    };
+
+    std::mutex lock;
+    std::map<LoaderFilter, Entry> entries;
+
+    VplLoaderCache() {}
+    ~VplLoaderCache();
+
+    /**
+     * @brief 找到或创建过滤条件对应的Entry，需持有lock
+     */
+    Entry *GetEntry(const LoaderFilter& filter);
+    /**
+     * @brief 给loader设置一个U32过滤条件
+     */
+    static mfxStatus SetFilter(mfxLoader loader, const char *name, mfxU32 value);
+    /**
+     * @brief 打印实现的类型、加速方式和路径
+     */
+    static void ShowImplementationInfo(mfxLoader loader, mfxU32 implnum, const mfxImplDescription *idesc);
+};
+
+#endif // __LOADER_CACHE_HPP__
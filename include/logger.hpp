@@ -0,0 +1,163 @@
+#ifndef __LOGGER_HPP__
+#define __LOGGER_HPP__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "frame-ring.hpp"
+
+// 日志级别
+#define LOG_LEVEL_TRACE             0
+#define LOG_LEVEL_DEBUG             1
+#define LOG_LEVEL_INFO              2
+#define LOG_LEVEL_WARN              3
+#define LOG_LEVEL_ERROR             4
+#define LOG_LEVEL_NONE              5
+// 编译时的日志级别，低于它的日志连同参数求值一起去掉，可用-DLOG_LEVEL=LOG_LEVEL_DEBUG打开调试日志
+#ifndef LOG_LEVEL
+#define LOG_LEVEL                   LOG_LEVEL_INFO
+#endif
+// 日志队列的条数，满了以后新日志丢掉并计数，不阻塞调用线程
+#define LOG_RING_SIZE               1024
+// 单条日志的最大字节数，超出的部分截断
+#define LOG_MESSAGE_SIZE            240
+// 后台线程被第一条日志唤醒后再攒这么久，合并成一次写出
+#define LOG_FLUSH_INTERVAL_MS       20
+// 逐帧日志（LOG_EVERY_MS）每个调用点的最短间隔
+#define LOG_FRAME_INTERVAL_MS       1000
+
+/**
+ * @brief 日志统计
+ */
+struct LoggerStatus
+{
+    uint64_t written;               // 已写出的条数
+    uint64_t dropped;               // 队列满时丢掉的条数
+    uint64_t suppressed;            // 被限频省掉的条数
+};
+
+/**
+ * @brief 异步日志。调用线程只在栈上格式化一条日志，放进多生产者无锁队列就返回，不碰stdio锁；
+ * 队列由空变为非空时唤醒后台线程，它再攒LOG_FLUSH_INTERVAL_MS后把队列里的日志合并成一次fwrite写到stdout，
+ * 没有日志时后台线程一直睡眠，不占CPU。
+ * 进程正常退出时写完剩余的日志。不直接使用，用下面的LOG_*宏
+ */
+class Logger
+{
+public:
+    static Logger& Instance();
+
+    /**
+     * @brief 格式化一条日志放进队列，可在任意线程调用
+     *
+     * @param level LOG_LEVEL_*
+     * @param suppressed 这条之前被限频省掉的条数，不为0时附在末尾
+     * @param format printf格式，不用带换行
+     */
+    void Write(int level, uint64_t suppressed, const char *format, ...) __attribute__((format(printf, 4, 5)));
+    /**
+     * @brief 在调用线程写出队列里所有的日志
+     */
+    void Flush();
+    LoggerStatus GetStatus() const;
+
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+private:
+    /**
+     * @brief 队列中的一条日志
+     */
+    struct Entry
+    {
+        int level;
+        int64_t timeUs;                 // 从第一次写日志起的微秒数
+        char text[LOG_MESSAGE_SIZE];
+    };
+
+    MpscRing<Entry> ring{LOG_RING_SIZE};
+    std::mutex outputLock;              // 后台线程和Flush同时写出时保持顺序，调用线程不用
+    std::thread flushThread;
+    std::atomic<uint64_t> written{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> suppressed{0};
+    std::atomic<bool> pending{false};   // 上次写出之后有新日志，只有由false变true的那条日志去唤醒后台线程
+    std::mutex wakeLock;
+    std::condition_variable wakeCond;   // pending变为true时通知后台线程
+
+    Logger();
+    /**
+     * @brief 后台线程，有新日志时被唤醒，攒一小段时间后写出
+     */
+    void FlushLoop();
+
+    friend class LogRateLimiter;
+};
+
+/**
+ * @brief 一个调用点的限频：两次日志之间至少隔intervalMs，期间的日志只计数。
+ * 用在逐帧的日志上，帧率再高输出也有上限
+ */
+class LogRateLimiter
+{
+public:
+    /**
+     * @brief 这一次能否输出
+     *
+     * @param intervalMs 最短间隔
+     * @param skipped 能输出时返回上次输出以来省掉的条数
+     */
+    bool Allow(int64_t intervalMs, uint64_t& skipped);
+
+private:
+    std::atomic<int64_t> nextUs{0};         // 下一次允许输出的时刻
+    std::atomic<uint64_t> pending{0};       // 上次输出以来省掉的条数
+};
+
+#define LOG_WRITE(level, ...) Logger::Instance().Write(level, 0, __VA_ARGS__)
+
+#if LOG_LEVEL <= LOG_LEVEL_TRACE
+#define LOG_TRACE(...) LOG_WRITE(LOG_LEVEL_TRACE, __VA_ARGS__)
+#else
+#define LOG_TRACE(...) do {} while (0)
+#endif
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_WRITE(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while (0)
+#endif
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(...) LOG_WRITE(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do {} while (0)
+#endif
+#if LOG_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(...) LOG_WRITE(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) do {} while (0)
+#endif
+#if LOG_LEVEL <= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) LOG_WRITE(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) do {} while (0)
+#endif
+
+/**
+ * @brief 逐帧日志用的限频版本，每个调用点每intervalMs最多一条，附上省掉的条数。
+ * level是编译时常量，低于LOG_LEVEL时整个分支被优化掉，参数不会求值
+ */
+#define LOG_EVERY_MS(level, intervalMs, ...)                                        \
+    do {                                                                            \
+        if ((level) >= LOG_LEVEL) {                                                 \
+            static LogRateLimiter logLimiter;                                       \
+            uint64_t logSkipped;                                                    \
+            if (logLimiter.Allow(intervalMs, logSkipped))                           \
+                Logger::Instance().Write(level, logSkipped, __VA_ARGS__);           \
+        }                                                                           \
+    } while (0)
+
+#endif // __LOGGER_HPP__
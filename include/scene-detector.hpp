@@ -0,0 +1,72 @@
+#ifndef __SCENE_DETECTOR_HPP__
+#define __SCENE_DETECTOR_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// 缩略图的块大小（像素），每块求和得到缩略图的一个点
+#define SCENE_BLOCK_SIZE            32
+// 块内每隔几行取一行，降采样减少读内存
+#define SCENE_ROW_STEP              4
+// 缩略图亮度直方图的格数
+#define SCENE_HISTOGRAM_BINS        32
+
+/**
+ * @brief 当前帧和参考帧缩略图的差异，单位为每字节的平均绝对差（0~255）
+ */
+struct SceneDiff
+{
+    double meanDiff;        // 所有块的平均差，整体亮度变化、镜头切换时大
+    double maxBlockDiff;    // 差异最大的块，画面中只有一小块在动时也能发现
+    double histogramDiff;   // 缩略图直方图的差异（0~1），镜头切换时大，物体移动时小
+};
+
+/**
+ * @brief 降采样SAD检测画面变化。每帧把图像按SCENE_BLOCK_SIZE分块求和得到缩略图（块内按SCENE_ROW_STEP隔行，
+ * 用_mm_sad_epu8一次累加16/32字节），和参考缩略图逐块比较。块均值把传感器噪声平均掉，
+ * 只读1/SCENE_ROW_STEP的行，1080p一帧约几十微秒。只在一个线程（编码线程）使用
+ */
+class SceneDetector
+{
+public:
+    /**
+     * @brief 计算一帧的缩略图，和参考缩略图比较；没有参考或大小变了时差异取最大值（255、255、1）
+     *
+     * @param data 首行地址，NV12/I420传Y平面
+     * @param pitch 行跨度
+     * @param width 图像宽（像素），不足一块的右边缘不参与比较
+     * @param height 图像高，不足一块的下边缘不参与比较
+     * @param bytesPerPixel Y平面为1，BGRA为4
+     */
+    SceneDiff Analyze(const uint8_t *data, size_t pitch, int width, int height, int bytesPerPixel);
+    /**
+     * @brief 把最近一次Analyze的帧作为参考。只在帧真正编码时调用，缓慢的变化累积到阈值后也会被编码
+     */
+    void UpdateReference();
+    /**
+     * @brief 清除参考，下一帧一定视为变化
+     */
+    void Reset();
+
+private:
+    std::vector<uint32_t> reference;    // 参考帧缩略图
+    std::vector<uint32_t> current;      // 最近一次Analyze的缩略图
+    uint32_t referenceHistogram[SCENE_HISTOGRAM_BINS] = {0};
+    uint32_t currentHistogram[SCENE_HISTOGRAM_BINS] = {0};
+    int blocksX = 0, blocksY = 0;       // current的块数
+    int bytesPerPixel = 0;
+    bool hasReference = false;
+};
+
+/**
+ * @brief 把若干行按固定字节宽度分块求和，累加到sums。按GetColorConvertIsa选择SSE4.1/AVX2实现
+ *
+ * @param row 行首地址
+ * @param blocks 块数
+ * @param blockBytes 每块字节数，需为16的倍数
+ * @param sums 每块的累加结果，长度不小于blocks
+ */
+void AccumulateBlockSums(const uint8_t *row, int blocks, int blockBytes, uint32_t *sums);
+
+#endif // __SCENE_DETECTOR_HPP__
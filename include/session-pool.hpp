@@ -0,0 +1,105 @@
+#ifndef __SESSION_POOL_HPP__
+#define __SESSION_POOL_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <vector>
+
+#include "encoder-session.hpp"
+
+// 每种key默认预热的session个数
+#define SESSION_POOL_DEFAULT_WARM   1
+
+/**
+ * @brief SessionPool状态
+ */
+struct SessionPoolStatus
+{
+    size_t readySessions;           // 已预热、可直接取用的session数
+    size_t pendingReset;            // 已归还、等待后台重置的session数
+    uint64_t hits;                  // Acquire直接取到预热session的次数
+    uint64_t misses;                // Acquire当场创建session的次数
+    uint64_t created;               // 后台新建的session数
+    uint64_t recycled;              // 归还后重置复用的session数
+    double avgCreateMs;             // 后台新建一个session的平均耗时
+};
+
+/**
+ * @brief 预先初始化好的编码session池，按SessionKey分组。
+ *
+ * 后台线程提前完成创建session、Query、Init、QueryIOSurf和申请surface、bit流缓冲区，
+ * 新的流只需从池里取一个；流结束时归还，后台Reset后放回，超过预热个数的直接关闭。
+ * 取和还都只是移动一个指针，不做任何VPL调用。
+ */
+class SessionPool
+{
+public:
+    /**
+     * @brief 启动后台补充线程
+     *
+     * @param defaultWarm 没有调用过Prepare的key第一次被Acquire后保持的预热个数
+     */
+    explicit SessionPool(size_t defaultWarm = SESSION_POOL_DEFAULT_WARM);
+    /**
+     * @brief 停止后台线程，关闭池中所有session，要求取出的session都已归还
+     */
+    ~SessionPool();
+
+    /**
+     * @brief 设置某个key保持的预热个数，后台立即开始补齐
+     */
+    void Prepare(const SessionKey& key, size_t count);
+    /**
+     * @brief 取一个session。有预热好的立即返回，否则在当前线程创建（失败时抛异常），并通知后台补充
+     */
+    std::unique_ptr<EncoderSession> Acquire(const SessionKey& key);
+    /**
+     * @brief 归还session，要求编码器已经排空
+     */
+    void Release(std::unique_ptr<EncoderSession> encoder);
+
+    SessionPoolStatus GetStatus();
+
+private:
+    /**
+     * @brief 一种key的预热session
+     */
+    struct Slot
+    {
+        size_t target = 0;          // 保持的预热个数
+        size_t creating = 0;        // 后台正在创建的个数
+        bool failed = false;        // 创建失败过，不再自动补充
+        std::vector<std::unique_ptr<EncoderSession>> ready;
+    };
+
+    size_t defaultWarm;
+    std::mutex lock;
+    std::condition_variable refillCond;     // 有归还、取走或Prepare时通知后台线程
+    std::map<SessionKey, Slot> slots;
+    std::vector<std::unique_ptr<EncoderSession>> released;  // 等待Reset的session
+    bool stop = false;
+    std::thread refillThread;
+
+    // 统计，受lock保护
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t created = 0;
+    uint64_t recycled = 0;
+    double totalCreateMs = 0;
+
+    /**
+     * @brief 后台线程，先重置归还的session，再给不足预热个数的key创建新session
+     */
+    void RefillLoop();
+    /**
+     * @brief 找一个需要补充的key，需持有lock
+     */
+    bool FindShortSlot(SessionKey& key);
+};
+
+#endif // __SESSION_POOL_HPP__
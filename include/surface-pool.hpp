@@ -0,0 +1,93 @@
+#ifndef __SURFACE_POOL_HPP__
+#define __SURFACE_POOL_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+#include <vpl/mfx.h>
+
+// runtime释放surface没有回调，收不到通知时最长等这么久再检查一次
+#define SURFACE_WAIT_TIMEOUT_MS     5
+
+/**
+ * @brief surface池状态
+ */
+struct SurfacePoolStatus
+{
+    size_t size;                    // surface总数
+    size_t freeSurfaces;            // 空闲链表里的surface数
+    uint64_t acquires;              // 取surface的次数
+    uint64_t exhaustions;           // 取的时候没有空闲surface、需要等待的次数
+    double totalWaitMs;             // 等待空闲surface的总时间
+    double maxWaitMs;               // 单次等待的最长时间
+};
+
+/**
+ * @brief 输入surface的空闲链表，替代逐个检查Data.Locked的线性查找和定时轮询。
+ *
+ * 取出的surface进入使用中列表，被runtime锁住直到编码完成；收到NotifyReleased后才扫描使用中列表，
+ * 把解锁的surface放回空闲链表。空闲链表按释放先后排列，总是先复用最近释放的（还在缓存里），
+ * 最久未用的留在底部。Acquire和TryAcquire只能在一个线程（编码线程）调用，取出的surface要在下一次取之前
+ * 交给runtime（或者不再使用），NotifyReleased可以在任意线程调用。
+ */
+class SurfacePool
+{
+public:
+    /**
+     * @brief 管理一组已经分配好内存的surface，不持有内存
+     */
+    SurfacePool(mfxFrameSurface1 *surfaces, size_t count);
+
+    /**
+     * @brief 取一个空闲surface，没有时等待runtime释放
+     */
+    mfxFrameSurface1 *Acquire();
+    /**
+     * @brief 取一个空闲surface，没有时返回NULL
+     */
+    mfxFrameSurface1 *TryAcquire();
+    /**
+     * @brief 是否有空闲surface，不取出也不等待，和TryAcquire一样只能在编码线程调用
+     */
+    bool HasFree();
+    /**
+     * @brief surface在池中的下标
+     */
+    size_t Index(const mfxFrameSurface1 *surface) const { return surface - surfaces; }
+    size_t Size() const { return count; }
+    mfxFrameSurface1 *Surface(size_t index) { return &surfaces[index]; }
+    /**
+     * @brief 同步线程完成一帧后调用，唤醒等待的Acquire并让它重新检查使用中的surface
+     */
+    void NotifyReleased();
+
+    SurfacePoolStatus GetStatus() const;
+
+private:
+    mfxFrameSurface1 *surfaces;
+    size_t count;
+    std::vector<size_t> freeList;           // 空闲surface下标，末尾是最近释放的
+    std::vector<size_t> busyList;           // 已交给runtime的surface下标，只在编码线程访问
+    uint64_t reclaimedSeq = 0;              // 上次扫描busyList时的releaseSeq
+
+    std::mutex lock;
+    std::condition_variable releasedCond;
+    std::atomic<uint64_t> releaseSeq{0};    // NotifyReleased的次数
+
+    std::atomic<size_t> freeCount{0};
+    std::atomic<uint64_t> acquires{0};
+    std::atomic<uint64_t> exhaustions{0};
+    std::atomic<uint64_t> totalWaitUs{0};
+    std::atomic<uint64_t> maxWaitUs{0};
+
+    /**
+     * @brief 把busyList中已解锁的surface移回空闲链表
+     */
+    void Reclaim();
+};
+
+#endif // __SURFACE_POOL_HPP__
@@ -0,0 +1,14 @@
+#ifndef __VERIFY_HPP__
+#define __VERIFY_HPP__
+
+#include <stdio.h>
+#include <exception>
+
+// 错误检查：条件不满足时直接打印（不经过异步日志，保证抛出前已经输出）并抛异常
+#define VERIFY(x, y)       \
+    if (!(x)) {            \
+        printf("%s\n", y); \
+        throw std::exception();          \
+    }
+
+#endif // __VERIFY_HPP__
@@ -5,19 +5,198 @@
 #include <stdlib.h>
 #include <string.h>
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <chrono>
 
 #include <vpl/mfx.h>
 #include <opencv2/opencv.hpp>
 
+#include "frame-ring.hpp"
+#include "bitstream-writer.hpp"
+#include "encoder-session.hpp"
+#include "encode-pipeline.hpp"
+#include "surface-pool.hpp"
+#include "frame-arena.hpp"
+#include "frame-buffer-pool.hpp"
+#include "scene-detector.hpp"
+#include "latency-histogram.hpp"
+
+// 输入图像队列默认长度
+#define IMAGE_QUEUE_SIZE            8
+// 常驻的输入帧缓冲区个数除了队列容量和零拷贝surface个数之外再多的几个：push正在填的一块和编码线程手上的一块
+#define FRAME_BUFFER_POOL_EXTRA     2
+// 静止画面判定阈值：差异最大的块每字节平均变化不到这么多就算静止，高于传感器噪声、低于有物体移动的块
+#define STATIC_SCENE_THRESHOLD      3.0
+// 场景切换判定：所有块平均变化和直方图差异都超过阈值才算，物体移动只有前者大，开灯关灯只有部分块变化
+#define SCENE_CUT_DIFF_THRESHOLD    20.0
+#define SCENE_CUT_HISTOGRAM_THRESHOLD   0.3
+
+/**
+ * @brief 输入队列满时push的处理方式
+ */
+enum class QueueFullPolicy
+{
+    BLOCK,              // 阻塞调用push的线程，直到编码线程取走一帧
+    DROP_OLDEST,        // 丢掉队列里最老的一帧，放入新帧
+    DROP_NEWEST,        // 直接丢掉新帧
+    DROP_NON_REFERENCE, // 新帧不会被其他帧参考时丢掉，否则阻塞。按GOP结构推算，只支持GopMode::FIXED，
+                        // 其他GOP模式下GopPicSize只是兜底值、IDR随场景切换插入，推算不出，构造时改用BLOCK；
+                        // 强制IDR后从这一帧重新计算GOP位置，有未生效的关键帧请求或静止画面DROP时不丢
+};
+
+/**
+ * @brief BGR图像在哪一步转成编码器需要的YUV，可以在启动时用preprocess-bench比较后选择
+ */
+enum class PreprocessMode
+{
+    NONE,   // 不转YUV：编码器直接输入RGB4，push只把BGR补成BGRA
+    SIMD,   // push线程用SIMD把BGR直接转成NV12/I420
+    VPP,    // push补成BGRA，编码线程交给oneVPL VPP转成NV12/I420，VPP输出不经同步直接排给编码器
+};
+
+/**
+ * @brief 静止画面（和上一个编码帧相比几乎没变）的处理方式
+ */
+enum class StaticSceneMode
+{
+    OFF,    // 不检测，每帧都完整编码
+    SKIP,   // 用mfxEncodeCtrl.SkipFrame编成dummy跳帧，帧数和时间轴不变；编码器不支持时照常编码
+    DROP,   // 不送编码器。输出是裸码流，没有容器时间戳，播放器按帧率播放，丢掉的时长会从时间轴上消失，
+            // 只适合下游按自己的时间戳重新封装，或不在乎回放时长的场合
+};
+
+/**
+ * @brief 静止画面检测的统计
+ */
+struct StaticSceneStatus
+{
+    uint64_t analyzedFrames;        // 检测过的帧数
+    uint64_t staticFrames;          // 判定为静止的帧数，即省掉完整编码的帧数
+    uint64_t skippedFrames;         // 编成跳帧的帧数
+    uint64_t droppedFrames;         // 直接丢掉的帧数
+    double lastDiff;                // 最近一帧差异最大的块每字节的平均变化
+    double analyzeMs;               // 检测的总耗时
+};
+
+/**
+ * @brief 关键帧统计
+ */
+struct GopStatus
+{
+    uint64_t sceneCuts;             // 检测到的场景切换次数（GopMode::ADAPTIVE）
+    uint64_t requestedKeyFrames;    // RequestKeyFrame的次数
+    uint64_t forcedKeyFrames;       // 用mfxEncodeCtrl强制编成IDR的帧数
+    double lastMeanDiff;            // 最近一帧所有块每字节的平均变化
+    double lastHistogramDiff;       // 最近一帧直方图差异（0~1）
+    uint64_t maxKeyFrameBytes;      // 最大的I帧字节数
+    uint64_t maxInterFrameBytes;    // 最大的P、B帧字节数，GopMode::STREAMING时应接近MaxFrameSize以内
+};
+
+/**
+ * @brief 输入队列状态和丢帧计数
+ */
+struct InputQueueStatus
+{
+    size_t depth;                   // 当前排队帧数
+    size_t capacity;                // 队列容量
+    uint64_t pushedFrames;          // 成功入队的帧数
+    uint64_t droppedOldest;         // DROP_OLDEST丢掉的帧数
+    uint64_t droppedNewest;         // DROP_NEWEST丢掉的帧数
+    uint64_t droppedNonReference;   // DROP_NON_REFERENCE丢掉的帧数
+    uint64_t movedFrames;           // push(cv::Mat&&)直接接管、没有转换的帧数
+    uint64_t bufferMisses;          // 输入帧缓冲区全部在用、临时申请的次数
+};
+
+/**
+ * @brief 编码吞吐统计
+ */
+struct EncodeThroughput
+{
+    uint64_t encodedFrames;         // 已完成编码的帧数
+    uint64_t encodedBytes;          // 输出字节数
+    double seconds;                 // 从创建到现在的时间
+    double framesPerSecond;         // 平均编码帧率
+};
+
+/**
+ * @brief 逐帧计时的统计，从push到写盘按阶段拆开，帧按输出bit流的TimeStamp对应
+ */
+struct LatencyStatus
+{
+    uint64_t frames;                // 已写盘并计时的帧数
+    LatencyPercentiles convert;     // push中颜色转换、拷进输入帧缓冲区
+    LatencyPercentiles queueWait;   // 在输入队列里等编码线程
+    LatencyPercentiles upload;      // 拷进（或包装成）surface
+    LatencyPercentiles encode;      // VPP和EncodeFrameAsync调用，含硬件忙时的重试
+    LatencyPercentiles sync;        // 提交后等编码完成，含B帧重排和AsyncDepth排队
+    LatencyPercentiles write;       // 交给写线程到写盘，含合并成批的等待
+    LatencyPercentiles total;       // 从push到写盘
+    mfxU64 lastTimeStamp;           // 最近交给写线程的bit流的TimeStamp
+    mfxI64 lastDecodeTimeStamp;     // 最近交给写线程的bit流的DecodeTimeStamp
+};
+
+/**
+ * @brief 给监控用的整体快照，计数都是从创建起累计的，速率由使用者按两次快照的差计算
+ */
+struct EncoderStats
+{
+    double seconds;                 // 从创建到现在的时间
+    uint64_t encodedFrames;         // 已完成编码的帧数
+    double framesPerSecond;         // 平均编码帧率
+    uint64_t bytesOut;              // 输出bit流字节数
+    size_t queueDepth;              // 当前输入队列排队帧数
+    size_t queueCapacity;           // 输入队列容量
+    uint64_t droppedFrames;         // 输入队列丢掉的帧数（三种丢帧策略之和）
+    uint64_t staticFrames;          // 静止画面省掉完整编码的帧数（跳帧加丢帧）
+    uint64_t surfaceExhaustions;    // 取surface时没有空闲、需要等待的次数
+    uint64_t deviceBusy;            // EncodeFrameAsync、RunFrameVPPAsync返回MFX_WRN_DEVICE_BUSY的次数
+    uint64_t lostFrames;            // 同步时bit流缓冲区不足丢掉的帧数，应一直为0
+    LatencyStatus latency;          // 各阶段延迟的分位数
+};
+
+/**
+ * @brief 不经过cv::Mat的原始帧描述，平面指针指向调用者的内存，push返回后即可复用
+ */
+struct FrameDescriptor
+{
+    mfxU32 fourCC = MFX_FOURCC_NV12;                // MFX_FOURCC_NV12、MFX_FOURCC_I420或MFX_FOURCC_RGB4
+    int width = 0;                                  // 图像宽，YUV时需为偶数
+    int height = 0;                                 // 图像高，YUV时需为偶数
+    const mfxU8 *planes[3] = {NULL, NULL, NULL};    // NV12为Y、UV，I420为Y、U、V，RGB4为BGRA
+    size_t pitches[3] = {0, 0, 0};                  // 各平面的行跨度（字节）
+    mfxU64 timeStamp = MFX_TIMESTAMP_UNKNOWN;       // 采集时间戳，90kHz，见push(const cv::Mat&, mfxU64)
+};
+
+class EncoderPool;
+class SessionPool;
+
 class VplEncodeModule
 {
+    friend class EncoderPool;
+
 public:
     /**
      * @brief 构造函数，初始化和申请内存
      * 
      * @param file_path 输出文件路径
+     * @param multiProducer 是否有多个线程同时调用push，为true时输入队列使用多生产者无锁队列
+     * @param queueCapacity 输入队列长度，向上取整到2的幂，决定最多缓存多少帧
+     * @param queuePolicy 输入队列满时的处理方式
+     * @param preprocess 颜色转换方式，见PreprocessMode
+     * @param pool 为NULL时创建自己的编码线程；否则由EncoderPool的工作线程调度编码，pool要比模块活得久
+     * @param sessionPool 不为NULL时从中取预先初始化好的session，析构时还回去，sessionPool要比模块活得久
+     * @param config 编码配置，可用EncoderConfig::Preset取预设；preprocess为SIMD或VPP时yuvFourCC为编码器的输入格式，
+     * gopMode为ADAPTIVE时编码线程检测到场景切换才强制IDR
      */
-    VplEncodeModule(std::string file_path, int imageWight, int imageHeight);
+    VplEncodeModule(std::string file_path, int imageWight, int imageHeight, bool multiProducer = false,
+                    size_t queueCapacity = IMAGE_QUEUE_SIZE, QueueFullPolicy queuePolicy = QueueFullPolicy::BLOCK,
+                    PreprocessMode preprocess = PreprocessMode::NONE, EncoderPool *pool = NULL,
+                    SessionPool *sessionPool = NULL, const EncoderConfig& config = EncoderConfig());
     /**
      * @brief 析构函数，释放内存
      * 
@@ -28,138 +207,350 @@ public:
      * @brief 向编码队列里增加一帧
      * 
      * @param image 输入图像，要求大小和构造函数中相同，不能为空图
+     * @param timeStamp 采集时间戳，90kHz。写进surface的Data.TimeStamp，由编码器带到输出bit流的
+     * TimeStamp并推出DecodeTimeStamp；为MFX_TIMESTAMP_UNKNOWN时取push时刻（从模块创建起算）。
+     * Data.FrameOrder为push的序号
+     */
+    void push(const cv::Mat& image, mfxU64 timeStamp = MFX_TIMESTAMP_UNKNOWN);
+    /**
+     * @brief 向编码队列里增加一帧，并接管image。格式已经和输入surface一致时（RGB4为不大于surface的BGRA图像，
+     * NV12/I420为按surface布局存放的单通道整块）不转换也不拷贝，直接入队；否则和push(const cv::Mat&)一样转换
+     * 
+     * @param image 输入图像，调用后为空，调用者不能再通过其他Mat改写这块内存
+     * @param timeStamp 采集时间戳，同push(const cv::Mat&, mfxU64)
      */
-    void push(cv::Mat image);
+    void push(cv::Mat&& image, mfxU64 timeStamp = MFX_TIMESTAMP_UNKNOWN);
+    /**
+     * @brief 向编码队列里增加一帧原始数据。格式和编码器输入surface相同时只做一次逐平面拷贝，
+     * NV12和I420之间只重排色度，不经过RGB4；RGB4数据按BGRA图像处理
+     * 
+     * @param frame 帧描述，YUV输入要求构造时preprocess为PreprocessMode::SIMD
+     */
+    void push(const FrameDescriptor& frame);
+
+    /**
+     * @brief 零拷贝输入模式。开启后，行跨度等于surface Pitch（宽度对齐到32后乘4）、
+     * 首地址64字节对齐、且内存覆盖对齐后高度的BGRA图像不再拷贝，surface直接指向Mat的内存，
+     * 直到编码器释放该surface。调用者push之后不能再改写这块内存。
+     * surface为NV12/I420时，对应的是宽为Width、高为Height*3/2、按surface布局存放的单通道Mat
+     * 
+     * @param enable 是否开启
+     */
+    void SetZeroCopyInput(bool enable);
+    /**
+     * @brief 单色输入模式，用于红外、热成像等灰度相机，要求构造时preprocess为PreprocessMode::SIMD。
+     * 开启后不大于surface的单通道图像只拷贝到Y平面，色度固定为128：拷贝输入时每个surface只填一次色度，
+     * 零拷贝时所有surface共用一块填好的色度平面
+     * 
+     * @param enable 是否开启
+     */
+    void SetMonoInput(bool enable);
+    /**
+     * @brief 静止画面检测。开启后编码线程对每帧做降采样SAD，和上一个完整编码的帧相比变化不到threshold时
+     * 按mode跳帧或丢帧，画面缓慢变化累积到阈值后照常编码。编码器不支持跳帧时SKIP等于OFF，不会改成丢帧
+     * 
+     * @param mode 静止帧的处理方式
+     * @param threshold 判定阈值，见STATIC_SCENE_THRESHOLD
+     */
+    void SetStaticSceneSkip(StaticSceneMode mode, double threshold = STATIC_SCENE_THRESHOLD);
+    /**
+     * @brief 下一个从队列取出的帧强制编成IDR，用于新的观看者接入、丢包恢复等，可在任意线程调用。
+     * GopMode::STREAMING时除第一帧外只有这里会产生IDR
+     */
+    void RequestKeyFrame();
+
+    /**
+     * @brief 获取输入队列深度和丢帧计数，可在任意线程调用
+     */
+    InputQueueStatus GetInputQueueStatus() const;
+    /**
+     * @brief 获取写线程的排队深度和写盘耗时，可在任意线程调用
+     */
+    BitstreamWriterStatus GetWriterStatus();
+    /**
+     * @brief 获取已编码帧数和平均帧率，可在任意线程调用
+     */
+    EncodeThroughput GetThroughput() const;
+    /**
+     * @brief 获取所有输入surface池（拷贝、零拷贝、VPP输出）合计的空闲数和耗尽次数，可在任意线程调用
+     */
+    SurfacePoolStatus GetSurfacePoolStatus() const;
+    /**
+     * @brief 获取静止画面检测的帧数和耗时，可在任意线程调用
+     */
+    StaticSceneStatus GetStaticSceneStatus() const;
+    /**
+     * @brief 获取场景切换和强制关键帧的次数，可在任意线程调用
+     */
+    GopStatus GetGopStatus() const;
+    /**
+     * @brief 获取从push到写盘各阶段耗时的平均、分位数和最大值，可在任意线程调用
+     */
+    LatencyStatus GetLatencyStatus() const;
+    /**
+     * @brief 获取吞吐、队列、丢帧、surface、设备忙和延迟的快照，可在任意线程调用，不阻塞编码
+     */
+    EncoderStats GetStats() const;
 
 private:
     int sts = 0; // MFX_ERR_NONE=0, 其他报错为负数 https://spec.oneapi.io/versions/latest/elements/oneVPL/source/API_ref/VPL_enums.html?highlight=mfx_err_none#mfxstatus
-    bool useHardware = true;
-
-    mfxLoader loader = NULL; // loader handle
-    mfxSession session = NULL; // 任务
-    mfxVideoParam encodeParam = {0};    // encode 参数
-    mfxVideoParam vppParam = {0};       // vpp 参数
-    mfxU16 nSurfNumVPPIn = 0;           // VPP 推荐输入surface loop大小
-    mfxU16 nSurfNumVPPOut = 0;          // VPP 推荐输出surface loop大小
-    mfxU8 *vppInBuf = NULL;             // vpp 输入内存，用于存储图像
-    mfxU8 *vppOutBuf = NULL;            // vpp 输出内存，用于存储图像，兼用于encode输入
-    mfxFrameSurface1 *vppInSurfacePool = NULL;  // vpp输入内存池，用于存储SurfacePool信息
-    mfxFrameSurface1 *vppOutSurfacePool = NULL; // vpp输出内存池，用于存储SurfacePool信息，兼用于encode输入
-    mfxU16 nSurfNumEncIn = 0;           // Encode 推荐输入surface loop大小
-    mfxU8 *encOutBuf = NULL;            // Encode 输入内存，用于存储图像
-    mfxFrameSurface1 *encSurfPool = NULL;       // Encode输入内存池，用于存储SurfacePool信息
-    mfxBitstream bitstream;             // Encode输出bit流
-    mfxSyncPoint syncp = {};            // 同步指针，用于同步编码的异步处理流程
-    int accel_fd = 0;                   // 加速器 fd
-    void *accelHandle = NULL;           // 加速器 handle
-
-    bool isStillGoing = true;   // 标识是否继续编码
-    bool noImage = false;       // 是否还有未编码的图像
-    int nIndexVPPInSurf  = -1;  // 当前使用的surface在输入loop中的index
-    int nIndexVPPOutSurf = -1;  // 当前使用的surface在输出loop中的index，当使用VPP时兼为encode输入loop索引
-    int nIndexEncInSurf = -1;   // 当前使用的surface在输入loop中的index，当使用VPP时无用
+
+    std::unique_ptr<EncoderSession> encoder;    // session、surface pool和bit流缓冲区
+    SessionPool *sessionPool = NULL;            // encoder的来源，为NULL时析构直接关闭session，否则还回pool
+
+    std::atomic<bool> isStillGoing{true};   // 标识是否继续编码
     FILE* sink = NULL;          // 输出文件
+    std::unique_ptr<BitstreamWriter> writer;    // 写线程，持有空闲bit流缓冲区
+    std::unique_ptr<EncodePipeline> pipeline;   // 在途任务和同步线程，要比writer先析构
+
+    ArenaMatAllocator frameAllocator;               // 输入帧缓冲区从FrameArena申请，要比下面持有Mat的成员晚析构
+    std::unique_ptr<FrameBufferPool> frameBuffers;  // 循环使用的输入帧缓冲区，push时取一个装转换结果
+    std::atomic<bool> zeroCopyInput{false};         // 是否直接引用调用者的Mat
+    std::atomic<bool> monoInput{false};             // 单通道图像只填Y平面
+    std::vector<bool> neutralSurfaces;              // 拷贝输入的surface色度是否已经填好128，按inputSurfaces下标
+    cv::Mat neutralChroma;                          // 单色零拷贝surface共用的色度平面，第一次用到时申请
+    std::vector<mfxFrameSurface1> wrapSurfPool;     // 零拷贝surface，数据指针指向wrapSurfHold中的Mat
+    std::vector<cv::Mat> wrapSurfHold;              // 零拷贝surface引用的Mat，surface解锁前保持有效
 
-    std::queue<cv::Mat> imageQueue; // 输入图像队列
-    std::mutex imageQueueLock;
+    std::atomic<StaticSceneMode> staticMode{StaticSceneMode::OFF};  // 静止画面的处理方式
+    std::atomic<double> staticThreshold{STATIC_SCENE_THRESHOLD};
+    SceneDetector sceneDetector;                    // 只在编码线程使用
+    mfxEncodeCtrl skipCtrl = {};                    // 跳帧用的编码控制，SkipFrame为1
+    mfxEncodeCtrl idrCtrl = {};                     // 强制IDR用的编码控制
+    mfxEncodeCtrl *frameCtrl = NULL;                // ReadFrame取出的这一帧的编码控制（跳帧、IDR或NULL），只在编码线程使用
+    uint64_t readFrames = 0;                        // ReadFrame取出的帧数，只在编码线程使用
+    std::atomic<uint64_t> analyzedFrames{0};
+    std::atomic<uint64_t> skippedStaticFrames{0};
+    std::atomic<uint64_t> droppedStaticFrames{0};
+    std::atomic<double> lastSceneDiff{0};
+    std::atomic<uint64_t> analyzeUs{0};
+    std::atomic<bool> keyFrameRequested{false};     // RequestKeyFrame设置，ReadFrame取走
+    std::atomic<uint64_t> sceneCuts{0};
+    std::atomic<uint64_t> requestedKeyFrames{0};
+    std::atomic<uint64_t> forcedKeyFrames{0};
+    std::atomic<double> lastMeanDiff{0};
+    std::atomic<double> lastHistogramDiff{0};
 
-    bool start = false;
+    std::unique_ptr<SurfacePool> inputSurfaces;     // 拷贝输入用的surface，使用VPP时为VPP输入
+    std::unique_ptr<SurfacePool> vppOutSurfaces;    // VPP输出兼编码输入，不使用VPP时为空
+    std::unique_ptr<SurfacePool> wrapSurfaces;      // 零拷贝surface，不支持零拷贝时为空
+
+    /**
+     * @brief 输入队列中的一帧：按surface布局存放的图像和它的时间戳
+     */
+    struct InputFrame
+    {
+        cv::Mat image;
+        mfxU64 timeStamp = MFX_TIMESTAMP_UNKNOWN;
+        bool mono = false;      // image只有Y平面，见SetMonoInput
+        uint64_t frameOrder = 0;                            // push的序号，写进surface的Data.FrameOrder
+        uint64_t pushIndex = 0;                             // 入队时的pushedFrames，推算GOP位置用
+        std::chrono::steady_clock::time_point pushTime;     // 进入push的时刻
+        std::chrono::steady_clock::time_point enqueueTime;  // 转换完、入队的时刻
+    };
+    std::atomic<uint64_t> nextFrameOrder{0};        // 下一个push的序号
+    std::unique_ptr<FrameRing<InputFrame>> imageQueue;  // 输入图像队列，定长无锁环形队列
+    QueueFullPolicy queuePolicy;                    // 队列满时的处理方式
+    std::atomic<uint64_t> pushedFrames{0};          // 入队帧数，兼作下一帧的显示序号
+    std::atomic<uint64_t> gopStartIndex{0};         // 编码器当前GOP第一帧的pushIndex，强制IDR时由编码线程更新
+    std::atomic<uint64_t> droppedOldest{0};
+    std::atomic<uint64_t> droppedNewest{0};
+    std::atomic<uint64_t> droppedNonReference{0};
+    std::atomic<uint64_t> movedFrames{0};
+
+    std::thread encodeThread;                   // 编码线程，析构时join
+    std::mutex eventLock;                       // 配合下面两个条件变量使用，入队出队本身不加锁
+    std::condition_variable eventCond;          // 唤醒编码线程：新帧到达、surface释放、退出
+    std::condition_variable spaceCond;          // 唤醒阻塞在push里的生产者：队列有空位
+    std::atomic<bool> encoderWaiting{false};    // 编码线程正在eventCond上等待
+    std::atomic<int> producersWaiting{0};       // 阻塞在spaceCond上的生产者个数
+    bool surfaceReleased = false;               // 同步线程完成了一帧，可能有surface解锁，受eventLock保护
+
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+    /**
+     * @brief 一帧经过各阶段的时刻
+     */
+    struct FrameTiming
+    {
+        bool tracked;           // 找到了对应的帧；对应不上时只占位，保持和写盘顺序一致
+        mfxU64 timeStamp;
+        std::chrono::steady_clock::time_point pushTime, enqueueTime, dequeueTime, uploadTime, submitTime, syncTime;
+    };
+    FrameTiming readTiming = {};                // ReadFrame取出的这一帧，只在编码线程使用
+    std::deque<FrameTiming> encodingTimings;    // 已交给编码器、还没出bit流的帧，受latencyLock保护
+    std::deque<FrameTiming> writingTimings;     // 已交给写线程、还没写盘的帧，和写盘顺序相同，受latencyLock保护
+    std::mutex latencyLock;                     // 只保护线程间的交接，记录耗时不加锁
+    LatencyHistogram convertLatency;            // 各阶段耗时，见LatencyStatus
+    LatencyHistogram queueWaitLatency;
+    LatencyHistogram uploadLatency;
+    LatencyHistogram encodeLatency;
+    LatencyHistogram syncLatency;
+    LatencyHistogram writeLatency;
+    LatencyHistogram totalLatency;
+    std::atomic<mfxU64> lastTimeStamp{MFX_TIMESTAMP_UNKNOWN};
+    std::atomic<mfxI64> lastDecodeTimeStamp{0};
+    bool vppParamPrinted = false;               // 第一帧编码后打印一次实际参数
+
+    // 以下由EncoderPool使用，poolScheduled之外的字段受EncoderPool的锁保护
+    EncoderPool *pool = NULL;                   // 所属的EncoderPool，为NULL时使用encodeThread
+    std::atomic<bool> poolScheduled{false};     // 已在就绪队列中或正被工作线程编码
+    bool poolRunning = false;                   // 正被某个工作线程编码
+    bool poolDetached = false;                  // 析构中，不再调度
 
 private:
     /**
-     * @brief 主循环
+     * @brief 主循环，在encodeThread中运行，没有帧时阻塞等待，退出前编完队列中剩余的帧
      * 
      */
     void EncodeLoop();
     /**
-     * @brief 查看Impl配置
+     * @brief 由EncoderPool工作线程调用，最多编maxFrames帧后返回，不等待新帧，
+     * 也不等待空闲surface和在途任务（见CanEncodeFrame），这时由同步线程完成一帧后重新调度
      * 
-     * @param loader loader handle
-     * @param implnum impl索引编号
+     * @return size_t 实际编码的帧数
+     */
+    size_t EncodeStep(size_t maxFrames);
+    /**
+     * @brief 从输入队列取一帧送入编码器
      */
-    void ShowImplementationInfo(mfxLoader loader, mfxU32 implnum);
+    void EncodeOneFrame();
     /**
-     * @brief 初始化加速器
+     * @brief PreprocessMode::VPP时，从输入队列取一帧经VPP转换后送入编码器
      * 
-     * @param session 
-     * @param fd 
-     * @return void* 
+     * @return mfxStatus VPP或编码的状态
      */
-    void *InitAcceleratorHandle(mfxSession session, int *fd);
+    mfxStatus VppOneFrame();
     /**
-     * @brief 设置Encode参数
+     * @brief 编码线程等待新帧
      * 
-     * @return mfxVideoParam 
+     * @return true 队列中有帧
+     * @return false 要求退出且队列已空
+     */
+    bool WaitForFrame();
+    /**
+     * @brief 入队后调用，编码线程在等待时唤醒它
+     */
+    void NotifyFrameArrived();
+    /**
+     * @brief 出队后调用，有生产者阻塞时唤醒它们
      */
-    mfxVideoParam SetEncodeParam(int w, int h);
+    void NotifySpaceAvailable();
     /**
-     * @brief 设置VPP参数
+     * @brief 队列满时阻塞直到入队成功（BLOCK策略）
+     */
+    void PushBlocking(InputFrame& input);
+    /**
+     * @brief 编码器接收了readTiming这一帧，记下提交时刻，等同步线程按TimeStamp取回
+     */
+    void TrackSubmittedFrame();
+    /**
+     * @brief 同步线程取回bit流对应的帧，交给写线程前调用。每个交给写线程的bit流都要调用，和写盘一一对应
+     */
+    void TrackSyncedFrame(const mfxBitstream& bitstream);
+    /**
+     * @brief 写线程写完frames帧后调用，累计各阶段耗时
+     */
+    void TrackWrittenFrames(size_t frames);
+    /**
+     * @brief 同步线程完成一帧后调用，唤醒等待surface的编码线程；使用EncoderPool且队列中有帧时重新调度
+     */
+    void NotifySurfaceReleased();
+    /**
+     * @brief 编下一帧不会在工作线程上阻塞：在途任务没满，且可能用到的surface池都有空闲。
+     * 没有在途任务时总是返回true，runtime为参考帧等继续锁着的surface不会再有释放通知，只能等待
+     */
+    bool CanEncodeFrame();
+    /**
+     * @brief 将队列中的一张图转surface，能零拷贝时用wrapSurfaces，否则从pool中取一个拷进去
+     * 
+     * 静止帧要编成跳帧时不拷贝，只取一个surface；这一帧的编码控制放在frameCtrl
+     * 
+     * @param pool 输入surface池
+     * @param surface 输出，装好图像的surface
+     * @return mfxStatus MFX_ERR_MORE_DATA表示这一帧是静止帧，已经丢掉
+     */
+    mfxStatus ReadFrame(SurfacePool& pool, mfxFrameSurface1 **surface);
+    /**
+     * @brief 把帧的时间戳和序号写进surface
+     */
+    static void StampSurface(mfxFrameSurface1 *surface, const InputFrame& frame);
+    /**
+     * @brief 用sceneDetector和上一个完整编码的帧比较，只看亮度（Y平面）或BGRA
+     */
+    SceneDiff AnalyzeFrame(const InputFrame& frame);
+    /**
+     * @brief 判断Mat的内存布局能否直接作为surface使用
+     * 
+     * @param image 输入图像
+     * @param info surface格式
+     * @param mono image是否为只有Y平面的单色帧
+     */
+    bool CanWrapFrame(const cv::Mat& image, const mfxFrameInfo& info, bool mono = false);
+    /**
+     * @brief 取一个空闲的零拷贝surface，指向image的内存，并持有image直到surface解锁
      * 
-     * @return mfxVideoParam 
+     * @param image BGRA图像，需满足CanWrapFrame
+     * @return mfxFrameSurface1* 
      */
-    mfxVideoParam SetVPPParam(int w, int h);
+    mfxFrameSurface1 *WrapFrame(cv::Mat& image);
     /**
-     * @brief 根据不同都FOURCC创建不同大小的内存空间，并构造surface loop
+     * @brief 单色帧装进surface：能零拷贝时Y指向image、色度指向neutralChroma，否则只拷贝Y平面
      * 
-     * @param buf 内存空间指针
-     * @param surfpool surface pool指针
-     * @param frame_info 类型
-     * @param surfnum surface loop中的surface数量
-     * @return mfxStatus 
+     * @param pool 输入surface池
+     * @param image 单通道图像
+     * @param surface 输出，装好图像的surface
+     */
+    mfxStatus ReadMonoFrame(SurfacePool& pool, cv::Mat& image, mfxFrameSurface1 **surface);
+    /**
+     * @brief 判断图像是否按单色帧处理
      */
-    mfxStatus AllocateExternalSystemMemorySurfacePool(mfxU8 **buf,
-                                                  mfxFrameSurface1 *surfpool,
-                                                  mfxFrameInfo frame_info,
-                                                  mfxU16 surfnum);
-    
+    bool IsMonoFrame(const cv::Mat& image);
     /**
-     * @brief 获取对应格式的surface大小
+     * @brief 释放已解锁的零拷贝surface持有的Mat，让调用者的内存尽早归还
+     */
+    void ReleaseWrappedFrames();
+    /**
+     * @brief 按queuePolicy把一帧放入输入队列
      * 
-     * @param FourCC 格式
-     * @param width 图像宽
-     * @param height 图像高
-     * @return mfxU32 
+     * @param input 已转换好的帧，入队成功后被移走
+     * @return true 入队成功
+     * @return false 被丢弃
      */
-    mfxU32 GetSurfaceSize(mfxU32 FourCC, mfxU32 width, mfxU32 height);
+    bool EnqueueFrame(InputFrame& input);
     /**
-     * @brief 释放buffer和内存池
+     * @brief 把任意通道数的输入图像转换成输入surface的内存布局
      * 
-     * @param buf 
-     * @param surfpool 
+     * @param image 输入图像（BGR、BGRA或灰度）
+     * @param input 输出，RGB4时为按surface对齐的BGRA图像，NV12/I420时为Y平面加色度平面的单通道整块
      */
-    void FreeExternalSystemMemorySurfacePool(mfxU8 *buf, mfxFrameSurface1 *surfpool);
+    void ConvertFrame(const cv::Mat& image, cv::Mat& input);
     /**
-     * @brief 释放加速器
+     * @brief 把原始帧拷进一个输入帧缓冲区，布局和输入surface相同
      * 
-     * @param accelHandle 
-     * @param fd 
+     * @param frame 帧描述
+     * @param input 输出，同ConvertFrame
      */
-    void FreeAcceleratorHandle(void *accelHandle, int fd);
+    void ConvertDescriptor(const FrameDescriptor& frame, cv::Mat& input);
     /**
-     * @brief 将队列中的一张图转surface
+     * @brief 判断图像能否不经转换直接入队，由ReadFrame拷进surface或被零拷贝引用
      * 
-     * @param surface 
-     * @return mfxStatus 
+     * @param image 输入图像
      */
-    mfxStatus ReadFrame(mfxFrameSurface1* surface);
+    bool MatchesSurfaceLayout(const cv::Mat& image);
     /**
-     * @brief 向文件中写bit流数据
+     * @brief 队列已满且策略为丢新帧时直接计数丢弃，省掉转换
      * 
-     * @param bs bit流
-     * @param f 目标文件
+     * @return true 这一帧被丢弃
      */
-    void WriteEncodedStream(mfxBitstream& bs, FILE* f);
+    bool DropNewestEarly();
     /**
-     * @brief 从pool中找到空闲的surface的id
+     * @brief 按GOP结构判断第order帧是否不被其他帧参考（B帧，或封闭GOP中下一个I帧前的最后一帧），
+     * 位置从最近一次强制IDR算起；无法确定时返回false
      * 
-     * @param SurfacesPool 
-     * @param nPoolSize 
-     * @return int id，如果没找到，返回MFX_ERR_NOT_FOUND
+     * @param order 帧的入队序号（pushIndex）
      */
-    int GetFreeSurfaceIndex(mfxFrameSurface1 *SurfacesPool, mfxU16 nPoolSize);
-
-    void PrintParam(mfxVideoParam param);
-    mfxU16 FourCCToChromaFormat(mfxU32 fourCC);
+    bool IsDisposableFrame(uint64_t order);
 };
 
 
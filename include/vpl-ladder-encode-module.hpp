@@ -0,0 +1,175 @@
+#ifndef __VPL_LADDER_ENCODE_MODULE_HPP__
+#define __VPL_LADDER_ENCODE_MODULE_HPP__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <condition_variable>
+#include <vector>
+#include <chrono>
+
+#include <vpl/mfx.h>
+#include <opencv2/opencv.hpp>
+
+#include "vpl-encode-module.hpp"
+
+/**
+ * @brief 一路输出的编码配置
+ */
+struct Rendition
+{
+    std::string filePath;       // 输出文件路径
+    int width = 0;              // 编码宽，0表示和输入相同
+    int height = 0;             // 编码高，0表示和输入相同
+    EncoderConfig config;       // 码率、GOP等编码配置，yuvFourCC为VPP输出格式（NV12或I420）
+};
+
+/**
+ * @brief 多分辨率输出（ABR阶梯）：一帧只转换、上传一次，由每路输出各自的VPP从同一个输入surface
+ * 缩放并转成NV12/I420，再交给各自的编码器，写到各自的文件。
+ *
+ * 比起每种分辨率创建一个VplEncodeModule，BGR转BGRA和拷进surface只做一次，surface内存也只有一份。
+ * 每路输出一个session、一个EncodePipeline（在途任务和同步线程）和一个写线程；所有输出由同一个编码线程按顺序提交，
+ * 最慢的一路决定整体帧率。各路的写线程只吸收短暂的磁盘卡顿：一路的写盘持续跟不上时，它的写队列和在途任务
+ * 先后占满，共用的编码线程阻塞在这一路的提交上，其他各路也跟着停下。
+ */
+class VplLadderEncodeModule
+{
+public:
+    /**
+     * @brief 构造函数，为每路输出创建session并申请内存
+     *
+     * @param renditions 各路输出，至少一路
+     * @param imageWidth 输入图像宽
+     * @param imageHeight 输入图像高
+     * @param multiProducer 是否有多个线程同时调用push
+     * @param queueCapacity 输入队列长度，队列满时push阻塞
+     * @param sessionPool 不为NULL时从中取预先初始化好的session，析构时还回去，sessionPool要比模块活得久
+     */
+    VplLadderEncodeModule(const std::vector<Rendition>& renditions, int imageWidth, int imageHeight,
+                          bool multiProducer = false, size_t queueCapacity = IMAGE_QUEUE_SIZE,
+                          SessionPool *sessionPool = NULL);
+    /**
+     * @brief 析构函数，编完队列中剩余的帧后释放内存
+     */
+    ~VplLadderEncodeModule();
+
+    /**
+     * @brief 向编码队列里增加一帧，所有输出都会编码这一帧
+     *
+     * @param image 输入图像（BGR、BGRA或灰度），不大于构造函数中的大小
+     * @param timeStamp 采集时间戳，90kHz，各路输出bit流的TimeStamp都是它；为MFX_TIMESTAMP_UNKNOWN时取push时刻
+     */
+    void push(const cv::Mat& image, mfxU64 timeStamp = MFX_TIMESTAMP_UNKNOWN);
+
+    /**
+     * @brief 输出路数
+     */
+    size_t RenditionCount() const { return outputs.size(); }
+    /**
+     * @brief 获取第index路输出的已编码帧数和平均帧率，可在任意线程调用
+     */
+    EncodeThroughput GetThroughput(size_t index) const;
+    /**
+     * @brief 获取第index路输出的帧大小和设备忙次数，可在任意线程调用
+     */
+    EncodePipelineStatus GetEncodeStatus(size_t index) const;
+    /**
+     * @brief 获取第index路输出写线程的排队深度和写盘耗时，可在任意线程调用
+     */
+    BitstreamWriterStatus GetWriterStatus(size_t index);
+    /**
+     * @brief 获取共用输入surface池的空闲数和耗尽次数，可在任意线程调用
+     */
+    SurfacePoolStatus GetSurfacePoolStatus() const;
+
+    VplLadderEncodeModule(const VplLadderEncodeModule&) = delete;
+    VplLadderEncodeModule& operator=(const VplLadderEncodeModule&) = delete;
+
+private:
+    /**
+     * @brief 一路输出：session、VPP输出surface、写线程、在途任务和同步线程
+     */
+    struct Output
+    {
+        std::unique_ptr<EncoderSession> encoder;    // VPP缩放加编码
+        std::unique_ptr<SurfacePool> vppOutSurfaces;    // VPP输出兼编码输入
+        FILE *sink = NULL;                          // 输出文件
+        std::unique_ptr<BitstreamWriter> writer;    // 写线程
+        std::unique_ptr<EncodePipeline> pipeline;   // 在途任务和同步线程，要比writer、encoder先析构
+    };
+
+    /**
+     * @brief 输入队列中的一帧：按输入surface布局存放的BGRA图像
+     */
+    struct InputFrame
+    {
+        cv::Mat image;
+        mfxU64 timeStamp = MFX_TIMESTAMP_UNKNOWN;
+        uint64_t frameOrder = 0;    // push的序号，写进surface的Data.FrameOrder
+    };
+    std::atomic<uint64_t> nextFrameOrder{0};
+
+    SessionPool *sessionPool = NULL;                // session的来源，为NULL时析构直接关闭session，否则还回pool
+    std::vector<std::unique_ptr<Output>> outputs;   // 各路输出，顺序和构造时的renditions相同
+
+    mfxFrameInfo inputFrameInfo = {0};              // 共用输入surface的格式，即各路VPP的输入
+    mfxU8 *inputBuf = NULL;                         // 共用输入surface的内存，从FrameArena申请
+    mfxFrameSurface1 *inputSurfPool = NULL;         // 共用输入surface
+    std::unique_ptr<SurfacePool> inputSurfaces;     // 共用输入surface的空闲链表
+
+    ArenaMatAllocator frameAllocator;               // 输入帧缓冲区从FrameArena申请，要比下面持有Mat的成员晚析构
+    std::unique_ptr<FrameBufferPool> frameBuffers;  // 循环使用的输入帧缓冲区，push时取一个装转换结果
+    std::unique_ptr<FrameRing<InputFrame>> imageQueue;  // 输入图像队列
+
+    std::atomic<bool> isStillGoing{true};           // 标识是否继续编码
+    std::thread encodeThread;                       // 编码线程，析构时join
+    std::mutex eventLock;                           // 配合下面两个条件变量使用，入队出队本身不加锁
+    std::condition_variable eventCond;              // 唤醒编码线程：新帧到达、退出
+    std::condition_variable spaceCond;              // 唤醒阻塞在push里的生产者：队列有空位、退出
+    std::atomic<bool> encoderWaiting{false};        // 编码线程正在eventCond上等待
+    std::atomic<int> producersWaiting{0};           // 阻塞在spaceCond上的生产者个数
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+    /**
+     * @brief 主循环，在encodeThread中运行，退出前编完队列中剩余的帧并排空各路编码器
+     */
+    void EncodeLoop();
+    /**
+     * @brief 编码线程等待新帧
+     *
+     * @return true 队列中有帧
+     * @return false 要求退出且队列已空
+     */
+    bool WaitForFrame();
+    /**
+     * @brief 入队后调用，编码线程在等待时唤醒它
+     */
+    void NotifyFrameArrived();
+    /**
+     * @brief 出队后调用，有生产者阻塞时唤醒它们
+     */
+    void NotifySpaceAvailable();
+    /**
+     * @brief 队列满时阻塞直到入队成功，析构开始后放弃这一帧
+     */
+    void PushBlocking(InputFrame& input);
+    /**
+     * @brief 把一帧上传到共用输入surface，交给每一路的VPP和编码器
+     */
+    void EncodeOneFrame(InputFrame& frame);
+    /**
+     * @brief 一路输出：VPP把共用输入缩放到自己的输出surface，不经同步直接交给编码器
+     */
+    mfxStatus ScaleAndEncode(Output& output, mfxFrameSurface1 *inputSurface);
+    /**
+     * @brief 把输入图像转成按输入surface对齐的BGRA图像
+     */
+    void ConvertFrame(const cv::Mat& image, cv::Mat& input);
+};
+
+#endif // __VPL_LADDER_ENCODE_MODULE_HPP__
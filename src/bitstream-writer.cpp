@@ -0,0 +1,220 @@
+#include "bitstream-writer.hpp"
+#include "logger.hpp"
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <algorithm>
+#include <exception>
+
+BitstreamWriter::BitstreamWriter(FILE *f, size_t batchSize, size_t maxPending)
+    : file(f), maxPending(std::max<size_t>(maxPending, 1))
+{
+    this->batchSize = (std::max<size_t>(batchSize, 1) + WRITER_ALIGNMENT - 1) / WRITER_ALIGNMENT * WRITER_ALIGNMENT;
+    if (posix_memalign((void **)&staging, WRITER_ALIGNMENT, this->batchSize) != 0) {
+        printf("alloc writer staging buffer failed\n");
+        throw std::exception();
+    }
+    // 已经按批合并，stdio再缓冲一次只会多一次拷贝
+    setvbuf(file, NULL, _IONBF, 0);
+    writeThread = std::thread(&BitstreamWriter::WriteLoop, this);
+}
+
+BitstreamWriter::~BitstreamWriter()
+{
+    Stop();
+    for (Buffer &buf : freeList)
+        free(buf.data);
+    for (Buffer &buf : pending)
+        free(buf.data);
+    free(staging);
+}
+
+void BitstreamWriter::Submit(mfxBitstream &bs)
+{
+    if (bs.DataLength == 0)
+        return;
+    Buffer out = { bs.Data, bs.MaxLength, bs.DataOffset, bs.DataLength };
+    Buffer fresh;
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        spaceCond.wait(guard, [this] { return pending.size() < maxPending || stop; });
+        pending.push_back(out);
+        maxQueueDepth = std::max(maxQueueDepth, pending.size());
+        fresh = TakeFree(bs.MaxLength);
+    }
+    pendingCond.notify_one();
+    bs.Data       = fresh.data;
+    bs.MaxLength  = fresh.capacity;
+    bs.DataOffset = 0;
+    bs.DataLength = 0;
+}
+
+void BitstreamWriter::Grow(mfxBitstream &bs, mfxU32 size)
+{
+    Buffer buf;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        freeList.erase(std::remove_if(freeList.begin(), freeList.end(), [size](const Buffer &b) {
+                           if (b.capacity >= size)
+                               return false;
+                           free(b.data);
+                           return true;
+                       }),
+                       freeList.end());
+        buf = TakeFree(size);
+    }
+    free(bs.Data);
+    bs.Data       = buf.data;
+    bs.MaxLength  = buf.capacity;
+    bs.DataOffset = 0;
+    bs.DataLength = 0;
+}
+
+void BitstreamWriter::Stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stop = true;
+    }
+    pendingCond.notify_all();
+    spaceCond.notify_all();
+    if (writeThread.joinable())
+        writeThread.join();
+}
+
+BitstreamWriterStatus BitstreamWriter::GetStatus()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    BitstreamWriterStatus status;
+    status.queueDepth = pending.size();
+    status.maxQueueDepth = maxQueueDepth;
+    status.freeBuffers = freeList.size();
+    status.bytesWritten = bytesWritten;
+    status.writeCalls = writeCalls;
+    status.lastWriteMs = lastWriteMs;
+    status.maxWriteMs = maxWriteMs;
+    status.avgWriteMs = writeCalls ? totalWriteMs / writeCalls : 0;
+    return status;
+}
+
+void BitstreamWriter::SetWrittenCallback(std::function<void(size_t frames)> callback)
+{
+    writtenCallback = callback;
+}
+
+void BitstreamWriter::WriteLoop()
+{
+    std::vector<Buffer> batch;
+    for (;;) {
+        bool stopping;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            auto ready = [this] { return !pending.empty() || stop; };
+            // 合并缓冲区为空时没有期限，一直等；否则最多等到最早的字节满WRITER_FLUSH_INTERVAL_MS
+            if (staged == 0)
+                pendingCond.wait(guard, ready);
+            else
+                pendingCond.wait_until(guard, stagedSince + std::chrono::milliseconds(WRITER_FLUSH_INTERVAL_MS),
+                                       ready);
+            batch.assign(pending.begin(), pending.end());
+            pending.clear();
+            stopping = stop;
+        }
+        spaceCond.notify_all();
+
+        for (Buffer &buf : batch) {
+            Append(buf.data + buf.offset, buf.length);
+            if (staged > 0)
+                stagedFrames++;         // 结尾在合并缓冲区里，等这一批写盘
+            else if (writtenCallback)
+                writtenCallback(1);     // 整帧已经直接写盘
+        }
+
+        if (!batch.empty()) {
+            std::lock_guard<std::mutex> guard(lock);
+            for (Buffer &buf : batch)
+                freeList.push_back({ buf.data, buf.capacity, 0, 0 });
+        }
+        // 不足一批的数据停留到期就写出去，帧来得再密也不会在内存里滞留到攒满一批
+        if (stopping || (staged > 0 && std::chrono::steady_clock::now() - stagedSince
+                                           >= std::chrono::milliseconds(WRITER_FLUSH_INTERVAL_MS)))
+            FlushStaging();
+        batch.clear();
+
+        if (stopping) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (pending.empty())
+                break;
+        }
+    }
+    fflush(file);
+}
+
+void BitstreamWriter::Append(const mfxU8 *data, size_t length)
+{
+    while (length > 0) {
+        if (staged == 0 && length >= batchSize) {
+            // 大帧整批直接写，省一次拷贝，余下的部分再进合并缓冲区
+            size_t direct = length / batchSize * batchSize;
+            WriteOut(data, direct);
+            data += direct;
+            length -= direct;
+            continue;
+        }
+        size_t n = std::min(length, batchSize - staged);
+        if (staged == 0)
+            stagedSince = std::chrono::steady_clock::now();
+        memcpy(staging + staged, data, n);
+        staged += n;
+        data += n;
+        length -= n;
+        if (staged == batchSize)
+            FlushStaging();
+    }
+}
+
+void BitstreamWriter::FlushStaging()
+{
+    if (staged == 0)
+        return;
+    WriteOut(staging, staged);
+    staged = 0;
+    if (stagedFrames && writtenCallback)
+        writtenCallback(stagedFrames);
+    stagedFrames = 0;
+}
+
+void BitstreamWriter::WriteOut(const mfxU8 *data, size_t length)
+{
+    auto start = std::chrono::steady_clock::now();
+    size_t written = fwrite(data, 1, length, file);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (written != length)
+        LOG_EVERY_MS(LOG_LEVEL_ERROR, LOG_FRAME_INTERVAL_MS, "write bitstream failed, %zu of %zu bytes written",
+                     written, length);
+
+    std::lock_guard<std::mutex> guard(lock);
+    bytesWritten += written;
+    writeCalls++;
+    lastWriteMs = ms;
+    maxWriteMs = std::max(maxWriteMs, ms);
+    totalWriteMs += ms;
+}
+
+BitstreamWriter::Buffer BitstreamWriter::TakeFree(mfxU32 size)
+{
+    // 从后往前找，优先用最近回收的
+    for (size_t i = freeList.size(); i-- > 0;) {
+        if (freeList[i].capacity >= size) {
+            Buffer buf = freeList[i];
+            freeList.erase(freeList.begin() + i);
+            return buf;
+        }
+    }
+    Buffer buf = { (mfxU8 *)malloc(size), size, 0, 0 };
+    if (buf.data == NULL) {
+        printf("alloc bitstream buffer failed\n");
+        throw std::exception();
+    }
+    return buf;
+}
@@ -0,0 +1,196 @@
+#include "color-convert.hpp"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+// 每种分辨率重复转换的次数
+#define BENCH_ROUNDS    50
+// 和参考结果允许的最大误差
+#define MAX_ERROR       1
+
+template <typename F>
+static double TimeMs(F func)
+{
+    func(); // 预热
+    auto t1 = std::chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_ROUNDS; i++)
+        func();
+    auto t2 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(t2 - t1).count() / BENCH_ROUNDS;
+}
+
+static int MaxDiff(const cv::Mat& a, const cv::Mat& b)
+{
+    return (int)cv::norm(a, b, cv::NORM_INF);
+}
+
+static uint8_t Clamp(double value)
+{
+    return (uint8_t)std::min(std::max(floor(value + 0.5), 0.0), 255.0);
+}
+
+/**
+ * @brief 浮点BT.601 limited range参考实现，I420布局。
+ * 色度取2x2块的平均（和转换核一致，cvtColor只取一个像素，不能直接比），奇数宽高时最后一列/行重复
+ */
+static void ReferenceI420(const cv::Mat& bgr, std::vector<uint8_t>& y, std::vector<uint8_t>& u,
+                          std::vector<uint8_t>& v)
+{
+    int w = bgr.cols, h = bgr.rows, cw = (w + 1) / 2, ch = (h + 1) / 2;
+    y.resize(w * h);
+    u.resize(cw * ch);
+    v.resize(cw * ch);
+    for (int i = 0; i < h; i++) {
+        for (int x = 0; x < w; x++) {
+            const uint8_t *p = bgr.ptr(i) + x * 3;
+            y[i * w + x] = Clamp(16 + 0.097906 * p[0] + 0.504129 * p[1] + 0.256788 * p[2]);
+        }
+    }
+    for (int i = 0; i < ch; i++) {
+        for (int x = 0; x < cw; x++) {
+            double b = 0, g = 0, r = 0;
+            for (int dy = 0; dy < 2; dy++) {
+                for (int dx = 0; dx < 2; dx++) {
+                    const uint8_t *p = bgr.ptr(std::min(i * 2 + dy, h - 1)) + std::min(x * 2 + dx, w - 1) * 3;
+                    b += p[0] / 4.0;
+                    g += p[1] / 4.0;
+                    r += p[2] / 4.0;
+                }
+            }
+            u[i * cw + x] = Clamp(128 + 0.439216 * b - 0.290993 * g - 0.148223 * r);
+            v[i * cw + x] = Clamp(128 - 0.071427 * b - 0.367788 * g + 0.439216 * r);
+        }
+    }
+}
+
+/**
+ * @brief 比较一个平面，超出MAX_ERROR时打印第一个不一致的位置
+ *
+ * @param step 实际平面中相邻两个样本的间隔（NV12的UV为2）
+ * @return int 最大误差
+ */
+static int ComparePlane(const char *name, const uint8_t *plane, size_t pitch, int step,
+                        const std::vector<uint8_t>& ref, int w, int h)
+{
+    int maxDiff = 0;
+    for (int i = 0; i < h; i++) {
+        for (int x = 0; x < w; x++) {
+            int diff = abs((int)plane[i * pitch + x * step] - (int)ref[i * w + x]);
+            if (diff > MAX_ERROR && maxDiff <= MAX_ERROR)
+                printf("    %s mismatch at (%d, %d): %d vs %d\n", name, x, i, plane[i * pitch + x * step], ref[i * w + x]);
+            maxDiff = std::max(maxDiff, diff);
+        }
+    }
+    return maxDiff;
+}
+
+/**
+ * @brief 用当前指令集转换一幅随机图像，和参考实现比较
+ *
+ * @return false 有超出误差的样本
+ */
+static bool Check(int w, int h)
+{
+    cv::Mat bgr(h, w, CV_8UC3);
+    cv::randu(bgr, cv::Scalar::all(0), cv::Scalar::all(255));
+    int cw = (w + 1) / 2, ch = (h + 1) / 2;
+    std::vector<uint8_t> refY, refU, refV;
+    ReferenceI420(bgr, refY, refU, refV);
+    bool ok = true;
+
+    // RGB4只是重排，应完全一致
+    cv::Mat rgb4(h, w, CV_8UC4), refRGB4;
+    cv::cvtColor(bgr, refRGB4, cv::COLOR_BGR2BGRA);
+    ConvertBGRToRGB4(bgr.data, bgr.step, rgb4.data, rgb4.step, w, h);
+    ok &= MaxDiff(rgb4, refRGB4) == 0;
+
+    std::vector<uint8_t> i420(w * h + cw * ch * 2);
+    uint8_t *y = i420.data(), *u = y + w * h, *v = u + cw * ch;
+    ConvertBGRToI420(bgr.data, bgr.step, y, w, u, v, cw, w, h);
+    ok &= ComparePlane("I420 Y", y, w, 1, refY, w, h) <= MAX_ERROR;
+    ok &= ComparePlane("I420 U", u, cw, 1, refU, cw, ch) <= MAX_ERROR;
+    ok &= ComparePlane("I420 V", v, cw, 1, refV, cw, ch) <= MAX_ERROR;
+
+    size_t pitchUV = cw * 2;
+    std::vector<uint8_t> nv12(w * h + pitchUV * ch);
+    uint8_t *uv = nv12.data() + w * h;
+    ConvertBGRToNV12(bgr.data, bgr.step, nv12.data(), w, uv, pitchUV, w, h);
+    ok &= ComparePlane("NV12 Y", nv12.data(), w, 1, refY, w, h) <= MAX_ERROR;
+    ok &= ComparePlane("NV12 U", uv, pitchUV, 2, refU, cw, ch) <= MAX_ERROR;
+    ok &= ComparePlane("NV12 V", uv + 1, pitchUV, 2, refV, cw, ch) <= MAX_ERROR;
+
+    // 亮度和cvtColor的定义相同，也直接对照一次（cvtColor的I420要求偶数宽高）
+    if (w % 2 == 0 && h % 2 == 0) {
+        cv::Mat refI420;
+        cv::cvtColor(bgr, refI420, cv::COLOR_BGR2YUV_I420);
+        cv::Mat lumaY(h, w, CV_8UC1, y);
+        ok &= MaxDiff(lumaY, refI420.rowRange(0, h)) <= MAX_ERROR;
+    }
+    return ok;
+}
+
+int main()
+{
+    const int sizes[][2] = { { 640, 480 }, { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 } };
+    // 奇数宽高和不足一个SIMD块的宽度，覆盖标量收尾
+    const int checkSizes[][2] = { { 1, 1 }, { 3, 5 }, { 17, 9 }, { 35, 4 }, { 67, 33 }, { 641, 479 },
+                                  { 1920, 1080 }, { 1921, 1081 } };
+    const ColorConvertIsa isas[] = { ColorConvertIsa::SCALAR, ColorConvertIsa::SSE41, ColorConvertIsa::AVX2 };
+
+    // 正确性：每种指令集都和参考实现比较，有误差超出时返回非0
+    bool passed = true;
+    for (ColorConvertIsa isa : isas) {
+        if (SetColorConvertIsa(isa) != isa)
+            continue;
+        for (auto& size : checkSizes) {
+            if (!Check(size[0], size[1])) {
+                printf("check %s %dx%d FAILED\n", ColorConvertIsaName(isa), size[0], size[1]);
+                passed = false;
+            }
+        }
+        printf("check %s done\n", ColorConvertIsaName(isa));
+    }
+    if (!passed)
+        return 1;
+
+    for (auto& size : sizes) {
+        int w = size[0], h = size[1];
+        cv::Mat bgr(h, w, CV_8UC3);
+        cv::randu(bgr, cv::Scalar::all(0), cv::Scalar::all(255));
+        printf("%dx%d\n", w, h);
+
+        // 原流程：cvtColor到临时Mat，再逐行拷贝到surface
+        cv::Mat tmp, surfaceRGB4(h, w, CV_8UC4), refI420;
+        double ms = TimeMs([&] {
+            cv::cvtColor(bgr, tmp, cv::COLOR_BGR2BGRA);
+            for (int i = 0; i < h; i++)
+                memcpy(surfaceRGB4.ptr(i), tmp.ptr(i), w * 4);
+        });
+        printf("  RGB4 cvtColor + memcpy      : %7.3f ms\n", ms);
+        ms = TimeMs([&] { cv::cvtColor(bgr, refI420, cv::COLOR_BGR2YUV_I420); });
+        printf("  I420 cvtColor               : %7.3f ms\n", ms);
+
+        for (ColorConvertIsa isa : isas) {
+            if (SetColorConvertIsa(isa) != isa)
+                continue;
+            const char *name = ColorConvertIsaName(isa);
+
+            ms = TimeMs([&] { ConvertBGRToRGB4(bgr.data, bgr.step, surfaceRGB4.data, surfaceRGB4.step, w, h); });
+            printf("  RGB4 %-7s                : %7.3f ms\n", name, ms);
+
+            cv::Mat i420(h * 3 / 2, w, CV_8UC1);
+            uint8_t *y = i420.data, *u = y + w * h, *v = u + (w / 2) * (h / 2);
+            ms = TimeMs([&] { ConvertBGRToI420(bgr.data, bgr.step, y, w, u, v, w / 2, w, h); });
+            printf("  I420 %-7s                : %7.3f ms\n", name, ms);
+
+            cv::Mat nv12(h * 3 / 2, w, CV_8UC1);
+            ms = TimeMs([&] { ConvertBGRToNV12(bgr.data, bgr.step, nv12.data, w, nv12.data + w * h, w, w, h); });
+            printf("  NV12 %-7s                : %7.3f ms\n", name, ms);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,384 @@
+#include "color-convert.hpp"
+#include <string.h>
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COLOR_CONVERT_X86
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2  __attribute__((target("avx2")))
+#endif
+
+// BT.601 limited range系数，Q15定点。标量和SIMD用同样的整数运算，结果逐位一致
+#define YUV_SHIFT       15
+#define CY_B            3208    // 0.097906
+#define CY_G            16519   // 0.504129
+#define CY_R            8414    // 0.256788
+#define CU_B            14392   // 0.439216
+#define CU_G            (-9535) // -0.290993
+#define CU_R            (-4857) // -0.148223
+#define CV_B            (-2341) // -0.071427
+#define CV_G            (-12051)// -0.367788
+#define CV_R            14392   // 0.439216
+// Y偏移16，四舍五入；UV由2x2共4个像素求和得到，多右移2位，偏移128
+#define Y_OFFSET        ((16 << YUV_SHIFT) + (1 << (YUV_SHIFT - 1)))
+#define UV_OFFSET       ((128 << (YUV_SHIFT + 2)) + (1 << (YUV_SHIFT + 1)))
+
+static ColorConvertIsa DetectIsa()
+{
+#ifdef COLOR_CONVERT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return ColorConvertIsa::AVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return ColorConvertIsa::SSE41;
+#endif
+    return ColorConvertIsa::SCALAR;
+}
+
+static const ColorConvertIsa supportedIsa = DetectIsa();
+static std::atomic<int> currentIsa((int)supportedIsa);
+
+ColorConvertIsa GetColorConvertIsa()
+{
+    return (ColorConvertIsa)currentIsa.load(std::memory_order_relaxed);
+}
+
+ColorConvertIsa SetColorConvertIsa(ColorConvertIsa isa)
+{
+    if ((int)isa > (int)supportedIsa)
+        isa = supportedIsa;
+    currentIsa = (int)isa;
+    return isa;
+}
+
+const char *ColorConvertIsaName(ColorConvertIsa isa)
+{
+    switch (isa) {
+        case ColorConvertIsa::AVX2:
+            return "AVX2";
+        case ColorConvertIsa::SSE41:
+            return "SSE4.1";
+        default:
+            return "scalar";
+    }
+}
+
+/***************************************** 标量实现 *****************************************/
+
+static void RowBGRToRGB4Scalar(const uint8_t *src, uint8_t *dst, int x, int width)
+{
+    for (; x < width; x++) {
+        dst[x * 4 + 0] = src[x * 3 + 0];
+        dst[x * 4 + 1] = src[x * 3 + 1];
+        dst[x * 4 + 2] = src[x * 3 + 2];
+        dst[x * 4 + 3] = 255;
+    }
+}
+
+static inline uint8_t PixelY(const uint8_t *p)
+{
+    return (uint8_t)((CY_B * p[0] + CY_G * p[1] + CY_R * p[2] + Y_OFFSET) >> YUV_SHIFT);
+}
+
+/**
+ * @brief 处理两行中[x, width)的部分，row1为NULL时只写UV和第一行Y（奇数高度的最后一行）
+ *
+ * @param uvStep NV12为2（u、v指向同一UV平面的相邻字节），I420为1
+ */
+static void RowPairBGRToYUVScalar(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+                                  uint8_t *u, uint8_t *v, int uvStep, int x, int width)
+{
+    for (; x < width; x += 2) {
+        int x1 = (x + 1 < width) ? x + 1 : x;
+        const uint8_t *p00 = src0 + x * 3, *p01 = src0 + x1 * 3;
+        const uint8_t *p10 = src1 + x * 3, *p11 = src1 + x1 * 3;
+        y0[x] = PixelY(p00);
+        if (x1 != x)
+            y0[x1] = PixelY(p01);
+        if (y1) {
+            y1[x] = PixelY(p10);
+            if (x1 != x)
+                y1[x1] = PixelY(p11);
+        }
+        int b = p00[0] + p01[0] + p10[0] + p11[0];
+        int g = p00[1] + p01[1] + p10[1] + p11[1];
+        int r = p00[2] + p01[2] + p10[2] + p11[2];
+        u[(x >> 1) * uvStep] = (uint8_t)((CU_B * b + CU_G * g + CU_R * r + UV_OFFSET) >> (YUV_SHIFT + 2));
+        v[(x >> 1) * uvStep] = (uint8_t)((CV_B * b + CV_G * g + CV_R * r + UV_OFFSET) >> (YUV_SHIFT + 2));
+    }
+}
+
+/***************************************** SSE4.1 *****************************************/
+
+#ifdef COLOR_CONVERT_X86
+TARGET_SSE41 static int RowBGRToRGB4SSE41(const uint8_t *src, uint8_t *dst, int width)
+{
+    const __m128i shuf  = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+    int x = 0;
+    // 每次读16字节只用前12字节（4个像素），保证不越过行尾
+    for (; x + 6 <= width; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + x * 3));
+        _mm_storeu_si128((__m128i *)(dst + x * 4), _mm_or_si128(_mm_shuffle_epi8(v, shuf), alpha));
+    }
+    return x;
+}
+
+// 4个像素：两行各4个Y，以及[U0 U1 V0 V1]
+TARGET_SSE41 static inline void GroupBGRToYUVSSE41(const uint8_t *p0, const uint8_t *p1,
+                                                  __m128i &y0, __m128i &y1, __m128i &uv)
+{
+    const __m128i shufLo = _mm_setr_epi8(0, -1, 1, -1, 2, -1, -1, -1, 3, -1, 4, -1, 5, -1, -1, -1);
+    const __m128i shufHi = _mm_setr_epi8(6, -1, 7, -1, 8, -1, -1, -1, 9, -1, 10, -1, 11, -1, -1, -1);
+    const __m128i coefY  = _mm_setr_epi16(CY_B, CY_G, CY_R, 0, CY_B, CY_G, CY_R, 0);
+    const __m128i coefU  = _mm_setr_epi16(CU_B, CU_G, CU_R, 0, CU_B, CU_G, CU_R, 0);
+    const __m128i coefV  = _mm_setr_epi16(CV_B, CV_G, CV_R, 0, CV_B, CV_G, CV_R, 0);
+    const __m128i offY   = _mm_set1_epi32(Y_OFFSET);
+    const __m128i offUV  = _mm_set1_epi32(UV_OFFSET);
+
+    __m128i a   = _mm_loadu_si128((const __m128i *)p0);
+    __m128i b   = _mm_loadu_si128((const __m128i *)p1);
+    __m128i aLo = _mm_shuffle_epi8(a, shufLo); // 16位 [B0 G0 R0 0 B1 G1 R1 0]
+    __m128i aHi = _mm_shuffle_epi8(a, shufHi); // 16位 [B2 G2 R2 0 B3 G3 R3 0]
+    __m128i bLo = _mm_shuffle_epi8(b, shufLo);
+    __m128i bHi = _mm_shuffle_epi8(b, shufHi);
+
+    y0 = _mm_hadd_epi32(_mm_madd_epi16(aLo, coefY), _mm_madd_epi16(aHi, coefY));
+    y0 = _mm_srai_epi32(_mm_add_epi32(y0, offY), YUV_SHIFT);
+    y1 = _mm_hadd_epi32(_mm_madd_epi16(bLo, coefY), _mm_madd_epi16(bHi, coefY));
+    y1 = _mm_srai_epi32(_mm_add_epi32(y1, offY), YUV_SHIFT);
+
+    // 上下两行相加，再左右相邻像素相加，得到两个2x2块的和
+    __m128i sLo  = _mm_add_epi16(aLo, bLo);
+    __m128i sHi  = _mm_add_epi16(aHi, bHi);
+    __m128i quad = _mm_add_epi16(_mm_unpacklo_epi64(sLo, sHi), _mm_unpackhi_epi64(sLo, sHi));
+    uv = _mm_hadd_epi32(_mm_madd_epi16(quad, coefU), _mm_madd_epi16(quad, coefV));
+    uv = _mm_srai_epi32(_mm_add_epi32(uv, offUV), YUV_SHIFT + 2);
+}
+
+TARGET_SSE41 static int RowPairBGRToYUVSSE41(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+                                             uint8_t *u, uint8_t *v, bool interleaved, int width)
+{
+    const __m128i shufNV12 = _mm_setr_epi8(0, 2, 1, 3, 4, 6, 5, 7, 8, 10, 9, 11, 12, 14, 13, 15);
+    const __m128i shufI420 = _mm_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15);
+    int x = 0;
+    for (; x + 18 <= width; x += 16) {
+        __m128i ya[4], yb[4], uv[4];
+        for (int g = 0; g < 4; g++)
+            GroupBGRToYUVSSE41(src0 + (x + g * 4) * 3, src1 + (x + g * 4) * 3, ya[g], yb[g], uv[g]);
+
+        _mm_storeu_si128((__m128i *)(y0 + x),
+                         _mm_packus_epi16(_mm_packs_epi32(ya[0], ya[1]), _mm_packs_epi32(ya[2], ya[3])));
+        if (y1)
+            _mm_storeu_si128((__m128i *)(y1 + x),
+                             _mm_packus_epi16(_mm_packs_epi32(yb[0], yb[1]), _mm_packs_epi32(yb[2], yb[3])));
+
+        // [U0 U1 V0 V1 U2 U3 V2 V3 ...]
+        __m128i c = _mm_packus_epi16(_mm_packs_epi32(uv[0], uv[1]), _mm_packs_epi32(uv[2], uv[3]));
+        if (interleaved) {
+            _mm_storeu_si128((__m128i *)(u + x), _mm_shuffle_epi8(c, shufNV12));
+        }
+        else {
+            c = _mm_shuffle_epi8(c, shufI420);
+            _mm_storel_epi64((__m128i *)(u + x / 2), c);
+            _mm_storel_epi64((__m128i *)(v + x / 2), _mm_srli_si128(c, 8));
+        }
+    }
+    return x;
+}
+
+/***************************************** AVX2 *****************************************/
+
+// AVX2的shuffle只在128位lane内进行，每个lane各装4个像素（两次16字节读取，偏移12字节）
+TARGET_AVX2 static inline __m256i LoadBGR8AVX2(const uint8_t *p)
+{
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+                                   _mm_loadu_si128((const __m128i *)(p + 12)), 1);
+}
+
+TARGET_AVX2 static int RowBGRToRGB4AVX2(const uint8_t *src, uint8_t *dst, int width)
+{
+    const __m256i shuf  = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                           0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m256i alpha = _mm256_set1_epi32((int)0xFF000000);
+    int x = 0;
+    for (; x + 10 <= width; x += 8) {
+        __m256i v = LoadBGR8AVX2(src + x * 3);
+        _mm256_storeu_si256((__m256i *)(dst + x * 4), _mm256_or_si256(_mm256_shuffle_epi8(v, shuf), alpha));
+    }
+    return x;
+}
+
+// 8个像素：两行各8个Y，以及lane0 [U0 U1 V0 V1]、lane1 [U2 U3 V2 V3]
+TARGET_AVX2 static inline void GroupBGRToYUVAVX2(const uint8_t *p0, const uint8_t *p1,
+                                                __m256i &y0, __m256i &y1, __m256i &uv)
+{
+    const __m256i shufLo = _mm256_setr_epi8(0, -1, 1, -1, 2, -1, -1, -1, 3, -1, 4, -1, 5, -1, -1, -1,
+                                            0, -1, 1, -1, 2, -1, -1, -1, 3, -1, 4, -1, 5, -1, -1, -1);
+    const __m256i shufHi = _mm256_setr_epi8(6, -1, 7, -1, 8, -1, -1, -1, 9, -1, 10, -1, 11, -1, -1, -1,
+                                            6, -1, 7, -1, 8, -1, -1, -1, 9, -1, 10, -1, 11, -1, -1, -1);
+    const __m256i coefY  = _mm256_setr_epi16(CY_B, CY_G, CY_R, 0, CY_B, CY_G, CY_R, 0,
+                                             CY_B, CY_G, CY_R, 0, CY_B, CY_G, CY_R, 0);
+    const __m256i coefU  = _mm256_setr_epi16(CU_B, CU_G, CU_R, 0, CU_B, CU_G, CU_R, 0,
+                                             CU_B, CU_G, CU_R, 0, CU_B, CU_G, CU_R, 0);
+    const __m256i coefV  = _mm256_setr_epi16(CV_B, CV_G, CV_R, 0, CV_B, CV_G, CV_R, 0,
+                                             CV_B, CV_G, CV_R, 0, CV_B, CV_G, CV_R, 0);
+    const __m256i offY   = _mm256_set1_epi32(Y_OFFSET);
+    const __m256i offUV  = _mm256_set1_epi32(UV_OFFSET);
+
+    __m256i a   = LoadBGR8AVX2(p0);
+    __m256i b   = LoadBGR8AVX2(p1);
+    __m256i aLo = _mm256_shuffle_epi8(a, shufLo);
+    __m256i aHi = _mm256_shuffle_epi8(a, shufHi);
+    __m256i bLo = _mm256_shuffle_epi8(b, shufLo);
+    __m256i bHi = _mm256_shuffle_epi8(b, shufHi);
+
+    y0 = _mm256_hadd_epi32(_mm256_madd_epi16(aLo, coefY), _mm256_madd_epi16(aHi, coefY));
+    y0 = _mm256_srai_epi32(_mm256_add_epi32(y0, offY), YUV_SHIFT);
+    y1 = _mm256_hadd_epi32(_mm256_madd_epi16(bLo, coefY), _mm256_madd_epi16(bHi, coefY));
+    y1 = _mm256_srai_epi32(_mm256_add_epi32(y1, offY), YUV_SHIFT);
+
+    __m256i sLo  = _mm256_add_epi16(aLo, bLo);
+    __m256i sHi  = _mm256_add_epi16(aHi, bHi);
+    __m256i quad = _mm256_add_epi16(_mm256_unpacklo_epi64(sLo, sHi), _mm256_unpackhi_epi64(sLo, sHi));
+    uv = _mm256_hadd_epi32(_mm256_madd_epi16(quad, coefU), _mm256_madd_epi16(quad, coefV));
+    uv = _mm256_srai_epi32(_mm256_add_epi32(uv, offUV), YUV_SHIFT + 2);
+}
+
+TARGET_AVX2 static int RowPairBGRToYUVAVX2(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+                                           uint8_t *u, uint8_t *v, bool interleaved, int width)
+{
+    const __m256i shufUV = _mm256_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15,
+                                            0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15);
+    int x = 0;
+    for (; x + 34 <= width; x += 32) {
+        __m256i ya[4], yb[4], uv[4];
+        for (int g = 0; g < 4; g++)
+            GroupBGRToYUVAVX2(src0 + (x + g * 8) * 3, src1 + (x + g * 8) * 3, ya[g], yb[g], uv[g]);
+
+        // pack会按lane交错，用permute把64位块排回原顺序
+        __m256i lo = _mm256_permute4x64_epi64(_mm256_packs_epi32(ya[0], ya[1]), 0xD8);
+        __m256i hi = _mm256_permute4x64_epi64(_mm256_packs_epi32(ya[2], ya[3]), 0xD8);
+        _mm256_storeu_si256((__m256i *)(y0 + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8));
+        if (y1) {
+            lo = _mm256_permute4x64_epi64(_mm256_packs_epi32(yb[0], yb[1]), 0xD8);
+            hi = _mm256_permute4x64_epi64(_mm256_packs_epi32(yb[2], yb[3]), 0xD8);
+            _mm256_storeu_si256((__m256i *)(y1 + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8));
+        }
+
+        // 每个lane内先按[U...|V...]排好，两个lane中的U（V）按16位交错即为顺序排列的16个U（V）
+        __m256i c   = _mm256_packus_epi16(_mm256_packs_epi32(uv[0], uv[1]), _mm256_packs_epi32(uv[2], uv[3]));
+        c           = _mm256_shuffle_epi8(c, shufUV);
+        __m128i l0  = _mm256_castsi256_si128(c);
+        __m128i l1  = _mm256_extracti128_si256(c, 1);
+        __m128i uu  = _mm_unpacklo_epi16(l0, l1);
+        __m128i vv  = _mm_unpackhi_epi16(l0, l1);
+        if (interleaved) {
+            _mm_storeu_si128((__m128i *)(u + x), _mm_unpacklo_epi8(uu, vv));
+            _mm_storeu_si128((__m128i *)(u + x + 16), _mm_unpackhi_epi8(uu, vv));
+        }
+        else {
+            _mm_storeu_si128((__m128i *)(u + x / 2), uu);
+            _mm_storeu_si128((__m128i *)(v + x / 2), vv);
+        }
+    }
+    return x;
+}
+#endif // COLOR_CONVERT_X86
+
+/***************************************** 接口 *****************************************/
+
+void ConvertBGRToRGB4(const uint8_t *src, size_t srcStep, uint8_t *dst, size_t dstPitch, int width, int height)
+{
+    ColorConvertIsa isa = GetColorConvertIsa();
+    for (int i = 0; i < height; i++) {
+        const uint8_t *s = src + i * srcStep;
+        uint8_t *d       = dst + i * dstPitch;
+        int x            = 0;
+#ifdef COLOR_CONVERT_X86
+        if (isa == ColorConvertIsa::AVX2)
+            x = RowBGRToRGB4AVX2(s, d, width);
+        else if (isa == ColorConvertIsa::SSE41)
+            x = RowBGRToRGB4SSE41(s, d, width);
+#endif
+        RowBGRToRGB4Scalar(s, d, x, width);
+    }
+}
+
+static void ConvertBGRToYUV420(const uint8_t *src, size_t srcStep, uint8_t *dstY, size_t pitchY,
+                               uint8_t *dstU, uint8_t *dstV, size_t pitchUV, bool interleaved,
+                               int width, int height)
+{
+    ColorConvertIsa isa = GetColorConvertIsa();
+    for (int i = 0; i < height; i += 2) {
+        const uint8_t *s0 = src + i * srcStep;
+        const uint8_t *s1 = (i + 1 < height) ? s0 + srcStep : s0;
+        uint8_t *y0       = dstY + i * pitchY;
+        uint8_t *y1       = (i + 1 < height) ? y0 + pitchY : NULL;
+        uint8_t *u        = dstU + (i >> 1) * pitchUV;
+        uint8_t *v        = dstV + (i >> 1) * pitchUV;
+        int x             = 0;
+#ifdef COLOR_CONVERT_X86
+        // SIMD版本总是写两行Y，最后一行落单时交给标量处理
+        if (y1 && isa == ColorConvertIsa::AVX2)
+            x = RowPairBGRToYUVAVX2(s0, s1, y0, y1, u, v, interleaved, width);
+        else if (y1 && isa == ColorConvertIsa::SSE41)
+            x = RowPairBGRToYUVSSE41(s0, s1, y0, y1, u, v, interleaved, width);
+#endif
+        RowPairBGRToYUVScalar(s0, s1, y0, y1, u, v, interleaved ? 2 : 1, x, width);
+    }
+}
+
+void ConvertBGRToNV12(const uint8_t *src, size_t srcStep,
+                      uint8_t *dstY, size_t pitchY, uint8_t *dstUV, size_t pitchUV,
+                      int width, int height)
+{
+    ConvertBGRToYUV420(src, srcStep, dstY, pitchY, dstUV, dstUV + 1, pitchUV, true, width, height);
+}
+
+void ConvertBGRToI420(const uint8_t *src, size_t srcStep,
+                      uint8_t *dstY, size_t pitchY, uint8_t *dstU, uint8_t *dstV, size_t pitchUV,
+                      int width, int height)
+{
+    ConvertBGRToYUV420(src, srcStep, dstY, pitchY, dstU, dstV, pitchUV, false, width, height);
+}
+
+void CopyPlane(const uint8_t *src, size_t srcPitch, uint8_t *dst, size_t dstPitch, size_t widthBytes, int height)
+{
+    if (srcPitch == dstPitch && srcPitch == widthBytes) {
+        memcpy(dst, src, widthBytes * height);
+        return;
+    }
+    for (int i = 0; i < height; i++)
+        memcpy(dst + i * dstPitch, src + i * srcPitch, widthBytes);
+}
+
+// 色度只有亮度的一半，简单循环由编译器向量化就够了
+void ConvertNV12ToI420Chroma(const uint8_t *srcUV, size_t srcPitch, uint8_t *dstU, uint8_t *dstV, size_t dstPitch,
+                             int width, int height)
+{
+    for (int i = 0; i < height / 2; i++) {
+        const uint8_t *s = srcUV + i * srcPitch;
+        uint8_t *u       = dstU + i * dstPitch;
+        uint8_t *v       = dstV + i * dstPitch;
+        for (int x = 0; x < width / 2; x++) {
+            u[x] = s[2 * x];
+            v[x] = s[2 * x + 1];
+        }
+    }
+}
+
+void ConvertI420ToNV12Chroma(const uint8_t *srcU, size_t pitchU, const uint8_t *srcV, size_t pitchV,
+                             uint8_t *dstUV, size_t dstPitch, int width, int height)
+{
+    for (int i = 0; i < height / 2; i++) {
+        const uint8_t *u = srcU + i * pitchU;
+        const uint8_t *v = srcV + i * pitchV;
+        uint8_t *d       = dstUV + i * dstPitch;
+        for (int x = 0; x < width / 2; x++) {
+            d[2 * x]     = u[x];
+            d[2 * x + 1] = v[x];
+        }
+    }
+}
@@ -0,0 +1,204 @@
+#include "encode-pipeline.hpp"
+#include "logger.hpp"
+#include <algorithm>
+#include <chrono>
+
+// 同步一个任务最长等待的时间
+#define SYNC_TIMEOUT_MS     (100 * 1000)
+
+EncodePipeline::EncodePipeline(EncoderSession& encoder, BitstreamWriter& writer)
+    : encoder(encoder), writer(writer)
+{
+    // 每个在途任务一个bit流，最多同时有AsyncDepth帧在编码
+    tasks.resize(encoder.bitstreams.size());
+    for (size_t i = 0; i < tasks.size(); i++) {
+        tasks[i].bitstream = encoder.bitstreams[i];
+        tasks[i].syncp     = NULL;
+    }
+}
+
+EncodePipeline::~EncodePipeline()
+{
+    Stop();
+    for (size_t i = 0; i < tasks.size(); i++)
+        encoder.bitstreams[i] = tasks[i].bitstream;
+}
+
+void EncodePipeline::SetAcceptedCallback(std::function<void()> callback)
+{
+    acceptedCallback = std::move(callback);
+}
+
+void EncodePipeline::SetSyncedCallback(std::function<void(const mfxBitstream&)> callback)
+{
+    syncedCallback = std::move(callback);
+}
+
+void EncodePipeline::SetReleasedCallback(std::function<void()> callback)
+{
+    releasedCallback = std::move(callback);
+}
+
+void EncodePipeline::Start()
+{
+    syncThread = std::thread(&EncodePipeline::SyncLoop, this);
+}
+
+mfxStatus EncodePipeline::Encode(mfxFrameSurface1 *surface, mfxEncodeCtrl *ctrl)
+{
+    Task *task = AcquireTask();
+    mfxU32 required = requiredBufferSize.load(std::memory_order_relaxed);
+    if (required > encoder.bitstreamBufferSize)
+        encoder.bitstreamBufferSize = required;
+    // 别的任务扩过容，这个任务也跟着扩，避免再撞一次缓冲区不足
+    if (task->bitstream.MaxLength < encoder.bitstreamBufferSize)
+        writer.Grow(task->bitstream, encoder.bitstreamBufferSize);
+    mfxStatus status;
+    for (;;) {
+        status = MFXVideoENCODE_EncodeFrameAsync(encoder.session, ctrl, surface, &task->bitstream, &task->syncp);
+        if (status == MFX_WRN_DEVICE_BUSY) {
+            // For non-CPU implementations, wait a few milliseconds then try again
+            WaitDeviceBusy();
+            continue;
+        }
+        // 帧比缓冲区大，这一帧没有被编码器接收，扩容后用同一个surface重新提交
+        if (status == MFX_ERR_NOT_ENOUGH_BUFFER && GrowBitstream(*task))
+            continue;
+        break;
+    }
+    // MFX_ERR_MORE_DATA时编码器也收下了这一帧，只是要攒几帧才出bit流
+    if (surface && (status == MFX_ERR_NONE || status == MFX_ERR_MORE_DATA) && acceptedCallback)
+        acceptedCallback();
+    if (status == MFX_ERR_NONE && task->syncp)
+        SubmitTask();
+    return status;
+}
+
+void EncodePipeline::Drain()
+{
+    while (Encode(NULL) == MFX_ERR_NONE)
+        ;
+}
+
+void EncodePipeline::WaitDeviceBusy()
+{
+    deviceBusy.fetch_add(1, std::memory_order_relaxed);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+bool EncodePipeline::GrowBitstream(Task& task)
+{
+    if (encoder.bitstreamBufferSize >= BITSTREAM_MAX_BUFFER_SIZE)
+        return false;
+    encoder.bitstreamBufferSize = std::min<mfxU32>(encoder.bitstreamBufferSize * 2, BITSTREAM_MAX_BUFFER_SIZE);
+    LOG_INFO("bitstream buffer grows to %u", encoder.bitstreamBufferSize);
+    writer.Grow(task.bitstream, encoder.bitstreamBufferSize);
+    return true;
+}
+
+EncodePipeline::Task *EncodePipeline::AcquireTask()
+{
+    std::unique_lock<std::mutex> lock(taskLock);
+    // 在途任务数达到AsyncDepth时，等同步线程取走最早的一个
+    taskCond.wait(lock, [this] { return submittedTasks - syncedTasks < tasks.size(); });
+    return &tasks[submittedTasks % tasks.size()];
+}
+
+void EncodePipeline::SubmitTask()
+{
+    {
+        std::lock_guard<std::mutex> lock(taskLock);
+        submittedTasks++;
+    }
+    taskCond.notify_all();
+}
+
+void EncodePipeline::SyncLoop()
+{
+    for (;;) {
+        Task *task;
+        {
+            std::unique_lock<std::mutex> lock(taskLock);
+            taskCond.wait(lock, [this] { return syncedTasks < submittedTasks || syncStop; });
+            if (syncedTasks == submittedTasks)
+                break; // 要求退出且没有在途任务
+            task = &tasks[syncedTasks % tasks.size()];
+        }
+
+        // Encode output is not available on CPU until sync operation completes
+        // 按提交顺序同步，输出顺序和编码顺序一致
+        mfxStatus status = SyncTask(*task);
+        if (status == MFX_ERR_NONE) {
+            encodedFrames++;
+            encodedBytes += task->bitstream.DataLength;
+            std::atomic<uint64_t>& maxBytes = (task->bitstream.FrameType & MFX_FRAMETYPE_I) ? maxKeyFrameBytes
+                                                                                             : maxInterFrameBytes;
+            if (task->bitstream.DataLength > maxBytes)
+                maxBytes = task->bitstream.DataLength;
+            if (syncedCallback)
+                syncedCallback(task->bitstream);
+            writer.Submit(task->bitstream); // 交给写线程，换回一个空缓冲区
+        }
+        else if (status == MFX_ERR_NOT_ENOUGH_BUFFER) {
+            // 提交时runtime按BufferSizeInKB检查过，正常到不了这里；编好的数据已经写不下，之后的帧用大一倍的缓冲区
+            lostFrames++;
+            mfxU32 size = std::min<mfxU32>(task->bitstream.MaxLength * 2, BITSTREAM_MAX_BUFFER_SIZE);
+            mfxU32 required = requiredBufferSize.load(std::memory_order_relaxed);
+            while (size > required && !requiredBufferSize.compare_exchange_weak(required, size))
+                ;
+            LOG_ERROR("bitstream buffer %u too small at sync, frame lost, grows to %u", task->bitstream.MaxLength, size);
+            task->bitstream.DataLength = 0;
+        }
+        else {
+            LOG_EVERY_MS(LOG_LEVEL_ERROR, LOG_FRAME_INTERVAL_MS, "MFXVideoCORE_SyncOperation error %d", status);
+            task->bitstream.DataLength = 0;
+        }
+        task->syncp = NULL;
+
+        {
+            std::lock_guard<std::mutex> lock(taskLock);
+            syncedTasks++;
+        }
+        taskCond.notify_all();
+        if (releasedCallback)
+            releasedCallback();
+    }
+}
+
+mfxStatus EncodePipeline::SyncTask(Task& task)
+{
+    mfxStatus status;
+    do {
+        status = MFXVideoCORE_SyncOperation(encoder.session, task.syncp, SYNC_TIMEOUT_MS);
+    } while (status == MFX_WRN_IN_EXECUTION);
+    return status;
+}
+
+size_t EncodePipeline::PendingTasks()
+{
+    std::lock_guard<std::mutex> lock(taskLock);
+    return submittedTasks - syncedTasks;
+}
+
+void EncodePipeline::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(taskLock);
+        syncStop = true;
+    }
+    taskCond.notify_all();
+    if (syncThread.joinable())
+        syncThread.join();
+}
+
+EncodePipelineStatus EncodePipeline::GetStatus() const
+{
+    EncodePipelineStatus status;
+    status.encodedFrames = encodedFrames;
+    status.encodedBytes = encodedBytes;
+    status.maxKeyFrameBytes = maxKeyFrameBytes;
+    status.maxInterFrameBytes = maxInterFrameBytes;
+    status.deviceBusy = deviceBusy.load(std::memory_order_relaxed);
+    status.lostFrames = lostFrames;
+    return status;
+}
@@ -0,0 +1,114 @@
+#include "encoder-pool.hpp"
+#include <algorithm>
+
+EncoderPool::EncoderPool(size_t workers)
+{
+    if (workers == 0)
+        workers = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    for (size_t i = 0; i < workers; i++)
+        workerThreads.emplace_back(&EncoderPool::WorkerLoop, this);
+}
+
+EncoderPool::~EncoderPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stop = true;
+    }
+    readyCond.notify_all();
+    for (std::thread &worker : workerThreads)
+        worker.join();
+}
+
+void EncoderPool::Register(VplEncodeModule *stream)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    streams.push_back(stream);
+}
+
+void EncoderPool::Unregister(VplEncodeModule *stream)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    stream->poolDetached = true;
+    readyStreams.erase(std::remove(readyStreams.begin(), readyStreams.end(), stream), readyStreams.end());
+    idleCond.wait(guard, [stream] { return !stream->poolRunning; });
+    streams.erase(std::remove(streams.begin(), streams.end(), stream), streams.end());
+}
+
+void EncoderPool::Schedule(VplEncodeModule *stream)
+{
+    // 已在就绪队列中或正在编码，工作线程放手前会再检查一次输入队列
+    if (stream->poolScheduled.exchange(true))
+        return;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (stream->poolDetached)
+            return;
+        readyStreams.push_back(stream);
+    }
+    readyCond.notify_one();
+}
+
+void EncoderPool::WorkerLoop()
+{
+    for (;;) {
+        VplEncodeModule *stream;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            readyCond.wait(guard, [this] { return !readyStreams.empty() || stop; });
+            if (stop)
+                break;
+            stream = readyStreams.front();
+            readyStreams.pop_front();
+            stream->poolRunning = true;
+        }
+
+        stream->EncodeStep(ENCODER_POOL_QUANTUM);
+        steps++;
+
+        bool requeue;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stream->poolRunning = false;
+            // 先清标志再看队列，和push里"先入队再Schedule"配对，不会漏掉放手前后到达的帧
+            stream->poolScheduled.store(false);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            // 因为没有空闲surface或任务停下时不排队，同步线程完成一帧后会重新Schedule
+            requeue = !stream->poolDetached && stream->imageQueue->Size() > 0 && stream->CanEncodeFrame()
+                      && !stream->poolScheduled.exchange(true);
+            if (requeue)
+                readyStreams.push_back(stream); // 排到队尾，轮到其他流
+        }
+        idleCond.notify_all();
+        if (requeue)
+            readyCond.notify_one();
+    }
+}
+
+EncoderPoolStatus EncoderPool::GetStatus()
+{
+    EncoderPoolStatus status = {0};
+    std::lock_guard<std::mutex> guard(lock);
+    status.workers = workerThreads.size();
+    status.streams = streams.size();
+    status.readyStreams = readyStreams.size();
+    status.steps = steps;
+    for (VplEncodeModule *stream : streams) {
+        EncodeThroughput throughput = stream->GetThroughput();
+        status.encodedFrames += throughput.encodedFrames;
+        status.encodedBytes += throughput.encodedBytes;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    status.framesPerSecond = seconds > 0 ? status.encodedFrames / seconds : 0;
+    return status;
+}
+
+std::vector<EncodeThroughput> EncoderPool::GetStreamThroughput()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<EncodeThroughput> result;
+    result.reserve(streams.size());
+    for (VplEncodeModule *stream : streams)
+        result.push_back(stream->GetThroughput());
+    return result;
+}
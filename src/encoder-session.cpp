@@ -0,0 +1,677 @@
+#include "encoder-session.hpp"
+#include "loader-cache.hpp"
+#include "frame-arena.hpp"
+#include "logger.hpp"
+#include "verify.hpp"
+#include <unistd.h>
+#include <string.h>
+#include <algorithm>
+#include <exception>
+
+// 取整到16和32
+#define ALIGN16(value)              (((value + 15) >> 4) << 4)
+#define ALIGN32(X)                  (((mfxU32)((X) + 31)) & (~(mfxU32)31))
+
+EncoderConfig EncoderConfig::Preset(EncoderPreset preset)
+{
+    EncoderConfig config;
+    switch (preset) {
+    case EncoderPreset::ULTRA_LOW_LATENCY:
+        // 一帧进一帧出：不排队、不重排，低功耗单元延迟最小，CBR让每帧大小平稳
+        config.asyncDepth = 1;
+        config.gopRefDist = 1;
+        config.targetUsage = MFX_TARGETUSAGE_BEST_SPEED;
+        config.rateControl = MFX_RATECONTROL_CBR;
+        config.lowPower = MFX_CODINGOPTION_ON;
+        config.gopMode = GopMode::STREAMING;
+        break;
+    case EncoderPreset::REALTIME:
+        config.asyncDepth = 2;
+        config.gopRefDist = 1;
+        config.gopMode = GopMode::ADAPTIVE;
+        config.targetUsage = MFX_TARGETUSAGE_BALANCED;
+        config.rateControl = MFX_RATECONTROL_VBR;
+        break;
+    case EncoderPreset::MAX_THROUGHPUT:
+        // 多帧并行喂满硬件，B金字塔和lookahead换压缩率，延迟是AsyncDepth加lookahead帧
+        config.asyncDepth = 6;
+        config.gopPicSize = 32;
+        config.gopRefDist = 4;
+        config.bRefType = MFX_B_REF_PYRAMID;
+        config.lookAheadDepth = 40;
+        config.targetUsage = MFX_TARGETUSAGE_BEST_SPEED;
+        config.rateControl = MFX_RATECONTROL_VBR;
+        break;
+    case EncoderPreset::DEFAULT:
+        break;
+    }
+    return config;
+}
+
+EncoderConfig EncoderConfig::Preset(const std::string& name)
+{
+    const EncoderPreset presets[] = { EncoderPreset::DEFAULT, EncoderPreset::ULTRA_LOW_LATENCY,
+                                      EncoderPreset::REALTIME, EncoderPreset::MAX_THROUGHPUT };
+    for (EncoderPreset preset : presets)
+        if (name == PresetName(preset))
+            return Preset(preset);
+    printf("unknown encoder preset %s\n", name.c_str());
+    throw std::exception();
+}
+
+const char *EncoderConfig::PresetName(EncoderPreset preset)
+{
+    switch (preset) {
+    case EncoderPreset::ULTRA_LOW_LATENCY: return "ultra-low-latency";
+    case EncoderPreset::REALTIME: return "realtime";
+    case EncoderPreset::MAX_THROUGHPUT: return "max-throughput";
+    default: return "default";
+    }
+}
+
+std::unique_ptr<EncoderSession> EncoderSession::Open(const SessionKey& key)
+{
+    std::unique_ptr<EncoderSession> encoder(new EncoderSession());
+    encoder->Init(key);    // 失败时抛异常，已申请的资源由析构函数释放
+    return encoder;
+}
+
+void EncoderSession::Init(const SessionKey& key)
+{
+    this->key = key;
+    mfxStatus sts;
+
+    // 1.取共享的loader，MFXLoad、过滤条件和实现枚举在进程内只做一次，见VplLoaderCache
+    LoaderFilter filter;
+    filter.implType = key.config.useHardware ? MFX_IMPL_TYPE_HARDWARE : MFX_IMPL_TYPE_SOFTWARE;   // 编码方式：sw hw
+    filter.codecId = key.config.codecId;                    // CODEC类型：MFX_CODEC_*，具体可以看CodecFormatFourCC
+    filter.memHandleType = MFX_RESOURCE_SYSTEM_SURFACE;     // MemHandleType类型：MFX_RESOURCE*，具体可以看mfxResourceType
+    filter.needVpp = key.useVpp;
+
+    // 3.创建session
+    // 一个loader可以创建多个session，一个session可以具有多条处理流，一个程序可以创建多个loader
+    // 多loader和多处理流 https://spec.oneapi.io/versions/latest/elements/oneVPL/source/programming_guide/VPL_prg_session.html#examples-of-dispatcher-s-usage
+    // 多session https://spec.oneapi.io/versions/latest/elements/oneVPL/source/programming_guide/VPL_prg_session.html#multiple-sessions
+    sts = VplLoaderCache::Instance().CreateSession(filter, &session);
+	VERIFY(MFX_ERR_NONE == sts, "Cannot create session -- no implementations meet selection criteria");
+    // 3.1 创建一下加速器 Convenience function to initialize available accelerator(s)
+    accelHandle = InitAcceleratorHandle(session, &accel_fd);
+    // 4.初始化编码器和VPP
+    // 4.1.设置参数 
+    int outWidth  = key.outWidth ? key.outWidth : key.width;
+    int outHeight = key.outHeight ? key.outHeight : key.height;
+    VERIFY(key.useVpp || (outWidth == key.width && outHeight == key.height), "scaling needs VPP");
+    VERIFY(key.useVpp || !key.sharedInput, "shared input needs VPP");
+    encodeParam = SetEncodeParam(outWidth, outHeight, key.fourCC, key.config);
+    vppParam = SetVPPParam(key.width, key.height, outWidth, outHeight, key.fourCC, key.config);
+    // 4.2.用Query校验配置，填补和矫正不合理参数
+    // 先带上跳帧控制（静止画面编成dummy帧），编码器不支持时去掉重新Query
+    mfxVideoParam requested = encodeParam;
+    SetCodingOption2(true);
+    mfxExtCodingOption2 requestedOption2 = codingOption2;
+    sts = MFXVideoENCODE_Query(session, &encodeParam, &encodeParam);
+    skipFrameSupported = sts >= MFX_ERR_NONE && codingOption2.SkipFrame == MFX_SKIPFRAME_INSERT_DUMMY;
+    if (!skipFrameSupported) {
+        encodeParam = requested;
+        SetCodingOption2(false);
+        requestedOption2 = codingOption2;
+        sts = MFXVideoENCODE_Query(session, &encodeParam, &encodeParam);
+    }
+    LOG_INFO("skip frame %s", skipFrameSupported ? "supported" : "not supported");
+    PrintParam(encodeParam);
+    LOG_DEBUG("encode query sts %d", sts);
+    VERIFY(sts >= MFX_ERR_NONE, "Encode query failed, config not supported");
+    if (sts > MFX_ERR_NONE)
+        PrintAdjustedParam(requested, encodeParam, requestedOption2, codingOption2);   // MFX_WRN_INCOMPATIBLE_VIDEO_PARAM：runtime改了部分字段
+    if (encodeParam.mfx.RateControlMethod != MFX_RATECONTROL_CQP
+        && encodeParam.mfx.RateControlMethod != MFX_RATECONTROL_ICQ) {
+        // 实际送给编码器的码率，和配置不一致时一眼能看出来
+        mfxU32 multiplier = std::max<mfxU16>(encodeParam.mfx.BRCParamMultiplier, 1);
+        LOG_INFO("encode target %u kbps (config %u kbps), buffer %u KB", encodeParam.mfx.TargetKbps * multiplier,
+                 key.config.targetKbps, encodeParam.mfx.BufferSizeInKB * multiplier);
+    }
+    // 4.3.创建编码器
+    sts = MFXVideoENCODE_Init(session, &encodeParam);
+    LOG_DEBUG("encode init sts %d", sts);
+    VERIFY(sts >= MFX_ERR_NONE, "Encode init failed");
+    vppParam.AsyncDepth = encodeParam.AsyncDepth;
+    // 4.4.创建vpp
+    if (key.useVpp) {
+        sts = MFXVideoVPP_Init(session, &vppParam);
+        VERIFY(MFX_ERR_NONE == sts, "VPP init failed");
+    }
+
+    // 5.申请内存
+    // 5.1.申请Encode内存 Query number required surfaces for encoder
+    mfxFrameAllocRequest encRequest = {0};
+    sts = MFXVideoENCODE_QueryIOSurf(session, &encodeParam, &encRequest);
+    VERIFY(MFX_ERR_NONE == sts, "QueryIOSurf failed");
+    nSurfNumEncIn = encRequest.NumFrameSuggested;
+    // 5.1.1.申请输出流大小 Prepare output bitstream
+    // 每个在途任务一个bit流，最多同时有AsyncDepth帧在编码
+    bitstreamBufferSize = GetBitstreamBufferSize();
+    LOG_DEBUG("bitstream buffer size %u", bitstreamBufferSize);
+    bitstreams.resize(std::max<mfxU16>(encodeParam.AsyncDepth, 1));
+    for (mfxBitstream &bs : bitstreams) {
+        bs           = { 0 };
+        bs.MaxLength = bitstreamBufferSize;
+        bs.Data      = (mfxU8 *)malloc(bs.MaxLength * sizeof(mfxU8));
+        VERIFY(bs.Data != NULL, "calloc bitstream failed");
+    }
+
+    if (key.useVpp) {
+        // 5.2.申请VPP内存
+        // 5.2.1.创建IO队列 Query number of required surfaces for VPP
+        mfxFrameAllocRequest VPPRequest[2]  = {};
+        sts = MFXVideoVPP_QueryIOSurf(session, &vppParam, VPPRequest);
+        VERIFY(MFX_ERR_NONE == sts, "Error in QueryIOSurf");
+        // 5.2.2.获取IN和OUT的推荐数量
+        // VPP输出兼作编码输入，要同时够VPP往前跑和编码器持有，VPP和编码才能流水起来
+        nSurfNumVPPIn  = VPPRequest[0].NumFrameSuggested; // vpp in
+        nSurfNumVPPOut = VPPRequest[1].NumFrameSuggested + nSurfNumEncIn; // vpp out
+        // 5.2.3.申请In内存大小，多路输出共用输入时由使用者申请
+        if (!key.sharedInput) {
+            vppInSurfacePool = (mfxFrameSurface1 *)calloc(sizeof(mfxFrameSurface1), nSurfNumVPPIn);
+            sts = AllocateExternalSystemMemorySurfacePool(&vppInBuf,
+                                                          vppInSurfacePool,
+                                                          vppParam.vpp.In,
+                                                          nSurfNumVPPIn);
+            VERIFY(MFX_ERR_NONE == sts, "Error in external surface allocation for VPP in\n");
+        }
+        inputFrameInfo = vppParam.vpp.In;
+        inputSurfNum = nSurfNumVPPIn;
+        // 5.2.4.申请Out内存大小
+        vppOutSurfacePool = (mfxFrameSurface1 *)calloc(sizeof(mfxFrameSurface1), nSurfNumVPPOut);
+        sts               = AllocateExternalSystemMemorySurfacePool(&vppOutBuf,
+                                                      vppOutSurfacePool,
+                                                      vppParam.vpp.Out,
+                                                      nSurfNumVPPOut);
+        VERIFY(MFX_ERR_NONE == sts, "Error in external surface allocation for VPP out\n");
+    }
+    else {
+        // 5.3.申请编码输入surface pool，使用VPP时直接用VPP的输出代替 External (application) allocation of encode surfaces
+        encSurfPool = (mfxFrameSurface1 *)calloc(sizeof(mfxFrameSurface1), nSurfNumEncIn);
+        sts = AllocateExternalSystemMemorySurfacePool(&encOutBuf,
+                                                      encSurfPool,
+                                                      encodeParam.mfx.FrameInfo,
+                                                      nSurfNumEncIn);
+        VERIFY(MFX_ERR_NONE == sts, "Error in external surface allocation\n");
+        inputFrameInfo = encodeParam.mfx.FrameInfo;
+        inputSurfNum = nSurfNumEncIn;
+    }
+}
+
+EncoderSession::~EncoderSession()
+{
+    if (session) {
+        MFXVideoENCODE_Close(session);
+        if (key.useVpp)
+            MFXVideoVPP_Close(session);
+        MFXClose(session);
+    }
+
+    if (vppInBuf || vppInSurfacePool) {
+        FreeExternalSystemMemorySurfacePool(vppInBuf, vppInSurfacePool);
+    }
+
+    if (vppOutBuf || vppOutSurfacePool) {
+        FreeExternalSystemMemorySurfacePool(vppOutBuf, vppOutSurfacePool);
+    }
+
+    if (encOutBuf || encSurfPool) {
+        FreeExternalSystemMemorySurfacePool(encOutBuf, encSurfPool);
+    }
+
+    for (mfxBitstream &bs : bitstreams) {
+        if (bs.Data)
+            free(bs.Data);
+    }
+
+    FreeAcceleratorHandle(accelHandle, accel_fd);
+}
+
+mfxStatus EncoderSession::Reset()
+{
+    // 上一路流已经送过空surface排空，这里只需让编码器从新序列开始
+    mfxStatus sts = MFXVideoENCODE_Reset(session, &encodeParam);
+    if (sts == MFX_ERR_NONE && key.useVpp)
+        sts = MFXVideoVPP_Reset(session, &vppParam);
+    for (mfxBitstream &bs : bitstreams) {
+        bs.DataOffset = 0;
+        bs.DataLength = 0;
+    }
+    return sts;
+}
+
+mfxVideoParam EncoderSession::SetEncodeParam(int w, int h, mfxU32 fourCC, const EncoderConfig& config)
+{
+    // 参数约束 https://spec.oneapi.io/versions/latest/elements/oneVPL/source/appendix/VPL_apnds_a.html#encode-constraint-table
+    mfxVideoParam encodeParam = {0}; // 参数解释 https://spec.oneapi.io/versions/latest/elements/oneVPL/source/API_ref/VPL_structs_cross_component.html?highlight=mfxvideoparam#mfxvideoparam
+    encodeParam.mfx.CodecId = config.codecId;  // 编码器
+    if (config.codecId == MFX_CODEC_HEVC) {
+        encodeParam.mfx.CodecProfile = MFX_PROFILE_HEVC_MAIN;   // 使用默认配置参数
+        encodeParam.mfx.CodecLevel = MFX_LEVEL_HEVC_4;  // 使用的编码器级别
+    }
+    encodeParam.mfx.TargetUsage = config.targetUsage; // 速度和质量的平衡度
+    encodeParam.mfx.LowPower = config.lowPower;
+    encodeParam.mfx.RateControlMethod = config.rateControl; //MFX_RATECONTROL_CQP; // 可变比特率控制算法
+    if (config.rateControl == MFX_RATECONTROL_CQP) {
+        // CQP和码率字段共用同一块union
+        encodeParam.mfx.QPI = config.qp;
+        encodeParam.mfx.QPP = config.qp;
+        encodeParam.mfx.QPB = config.qp;
+    }
+    else if (config.rateControl == MFX_RATECONTROL_ICQ) {
+        // ICQQuality和TargetKbps共用同一块union，只能在ICQ时写
+        encodeParam.mfx.ICQQuality = config.qp; // 范围1-51,1为最佳
+    }
+    else if (config.rateControl == MFX_RATECONTROL_AVBR) {
+        // Accuracy、Convergence分别和InitialDelayInKB、MaxKbps共用union
+        encodeParam.mfx.TargetKbps = config.targetKbps;
+        encodeParam.mfx.Accuracy = 5;       // 码率误差，千分之几
+        encodeParam.mfx.Convergence = 1;    // 收敛周期，单位100帧
+    }
+    else {
+        encodeParam.mfx.TargetKbps = config.targetKbps; //4000; // kbps
+        encodeParam.mfx.MaxKbps = config.maxKbps; //30000;
+        // BufferSizeInKB、InitialDelayInKB为0，由runtime按码率和level决定；bit流缓冲区按Init后的实际值申请
+    }
+    encodeParam.mfx.GopPicSize = config.gopPicSize;
+    encodeParam.mfx.GopRefDist = config.gopRefDist;
+    encodeParam.mfx.GopOptFlag = MFX_GOP_CLOSED;
+    encodeParam.mfx.IdrInterval= config.idrInterval;
+    if (config.gopMode == GopMode::ADAPTIVE) {
+        // 长GOP只作兜底，每个I帧都是IDR；场景切换由VplEncodeModule检测后逐帧强制IDR
+        mfxU32 fps = std::max<mfxU32>(config.frameRateN / std::max<mfxU32>(config.frameRateD, 1), 1);
+        encodeParam.mfx.GopPicSize = (mfxU16)std::min<mfxU32>(fps * ADAPTIVE_GOP_SECONDS, 0xFFFF);
+        encodeParam.mfx.IdrInterval = 0;
+    }
+    else if (config.gopMode == GopMode::STREAMING) {
+        // 无限长GOP、无B帧，只有第一帧是IDR；帧内刷新见SetCodingOption2
+        encodeParam.mfx.GopPicSize = 0xFFFF;
+        encodeParam.mfx.GopRefDist = 1;
+        encodeParam.mfx.IdrInterval = 0;
+        if (HasHrdBuffer(config.rateControl)) {
+            // 码率缓冲区只容得下几帧，码控不能攒码率给个别大帧，解码端的抖动缓冲也可以相应缩小
+            mfxU32 bufferKB = std::max<mfxU32>(AverageFrameSize(config) * STREAMING_FRAME_SIZE_RATIO / 1000, 1);
+            encodeParam.mfx.BufferSizeInKB = (mfxU16)std::min<mfxU32>(bufferKB, 0xFFFF);
+            encodeParam.mfx.InitialDelayInKB = (mfxU16)std::max<mfxU32>(encodeParam.mfx.BufferSizeInKB / 2, 1);
+        }
+    }
+    encodeParam.mfx.FrameInfo.FrameRateExtN = config.frameRateN; // 帧率设置 帧率 = FrameRateExtN / FrameRateExtD
+    encodeParam.mfx.FrameInfo.FrameRateExtD = config.frameRateD;
+    encodeParam.mfx.FrameInfo.FourCC = fourCC; //MFX_FOURCC_I010; //MFX_FOURCC_P010; //MFX_FOURCC_NV16;//MFX_FOURCC_I422; //MFX_FOURCC_I420; //MFX_FOURCC_IYUV; //MFX_FOURCC_NV12; //MFX_FOURCC_RGB4; 
+    encodeParam.mfx.FrameInfo.ChromaFormat = FourCCToChromaFormat(encodeParam.mfx.FrameInfo.FourCC); // 颜色采样方法
+    encodeParam.mfx.FrameInfo.CropX = 0;
+    encodeParam.mfx.FrameInfo.CropY = 0;
+    encodeParam.mfx.FrameInfo.CropW = w;  // 原图宽（是ROI，可以比原图小，指定方法{X，Y，W，H})
+    encodeParam.mfx.FrameInfo.CropH = h; // 原图高
+    encodeParam.mfx.FrameInfo.Width = AlignSurfaceWidth(w, fourCC); // 目标宽 必须为16的倍数
+    encodeParam.mfx.FrameInfo.Height = ALIGN32(h);   // 目标高 对逐行帧，必须为16的倍数，否则为32的倍数
+    encodeParam.mfx.FrameInfo.PicStruct = MFX_PICSTRUCT_PROGRESSIVE; // 像素格式 MFX_PICSTRUCT_PROGRESSIVE逐行扫描
+    encodeParam.mfx.FrameInfo.AspectRatioW = 0;
+    encodeParam.mfx.FrameInfo.AspectRatioH = 0;
+    // encodeParam.mfx.FrameInfo.BitDepthLuma = 8; // 使用多少位表示亮度
+    // encodeParam.mfx.FrameInfo.BitDepthChroma = 24; // 使用多少位表示色度
+    encodeParam.AsyncDepth = config.asyncDepth;
+    encodeParam.IOPattern = MFX_IOPATTERN_IN_SYSTEM_MEMORY; // 函数的输入和输出存储器访问类型
+
+    return encodeParam;
+}
+
+void EncoderSession::SetCodingOption2(bool skipFrame)
+{
+    codingOption2 = {};
+    codingOption2.Header.BufferId = MFX_EXTBUFF_CODING_OPTION2;
+    codingOption2.Header.BufferSz = sizeof(codingOption2);
+    codingOption2.SkipFrame = skipFrame ? MFX_SKIPFRAME_INSERT_DUMMY : 0;
+    codingOption2.BRefType = key.config.bRefType;
+    codingOption2.LookAheadDepth = key.config.lookAheadDepth;
+    codingOption2.MaxFrameSize = key.config.maxFrameSize;
+    if (key.config.gopMode == GopMode::STREAMING) {
+        // 每帧把一列宏块编成帧内块，intraRefreshCycle帧扫完一遍，代替周期性的I帧
+        mfxU32 fps = std::max<mfxU32>(key.config.frameRateN / std::max<mfxU32>(key.config.frameRateD, 1), 1);
+        codingOption2.IntRefType = MFX_REFRESH_VERTICAL;
+        codingOption2.IntRefCycleSize = key.config.intraRefreshCycle ? key.config.intraRefreshCycle
+                                                                     : (mfxU16)std::min<mfxU32>(fps, 0xFFFF);
+        if (!codingOption2.MaxFrameSize && HasHrdBuffer(key.config.rateControl))
+            codingOption2.MaxFrameSize = AverageFrameSize(key.config) * STREAMING_FRAME_SIZE_RATIO;
+    }
+    bool needed = skipFrame || key.config.bRefType || key.config.lookAheadDepth || codingOption2.MaxFrameSize
+        || codingOption2.IntRefType;
+
+    // ExtParam指向成员，Reset时encodeParam仍然有效
+    encodeExtParams[0] = &codingOption2.Header;
+    encodeParam.ExtParam = needed ? encodeExtParams : NULL;
+    encodeParam.NumExtParam = needed ? 1 : 0;
+}
+
+bool EncoderSession::HasHrdBuffer(mfxU16 rateControl)
+{
+    // 其他码控方法的BufferSizeInKB、InitialDelayInKB位置放的是QP、质量或精度
+    return rateControl == MFX_RATECONTROL_CBR || rateControl == MFX_RATECONTROL_VBR;
+}
+
+mfxU32 EncoderSession::AverageFrameSize(const EncoderConfig& config)
+{
+    // kbps是1000比特每秒
+    uint64_t bytesPerSecond = (uint64_t)config.targetKbps * 1000 / 8;
+    return (mfxU32)(bytesPerSecond * std::max<mfxU32>(config.frameRateD, 1) / std::max<mfxU32>(config.frameRateN, 1));
+}
+
+void EncoderSession::PrintAdjustedParam(const mfxVideoParam& requested, const mfxVideoParam& corrected,
+                                        const mfxExtCodingOption2& requestedOption2,
+                                        const mfxExtCodingOption2& correctedOption2)
+{
+    const mfxInfoMFX& a = requested.mfx;
+    const mfxInfoMFX& b = corrected.mfx;
+    // 请求为0的字段本来就交给runtime决定，不算修正
+#define PRINT_ADJUSTED(name, x, y) \
+    if ((x) != 0 && (x) != (y)) LOG_WARN("config %s adjusted: %d -> %d", name, (int)(x), (int)(y));
+    PRINT_ADJUSTED("AsyncDepth", requested.AsyncDepth, corrected.AsyncDepth);
+    PRINT_ADJUSTED("TargetUsage", a.TargetUsage, b.TargetUsage);
+    PRINT_ADJUSTED("LowPower", a.LowPower, b.LowPower);
+    PRINT_ADJUSTED("RateControlMethod", a.RateControlMethod, b.RateControlMethod);
+    PRINT_ADJUSTED("TargetKbps", a.TargetKbps, b.TargetKbps);
+    PRINT_ADJUSTED("MaxKbps", a.MaxKbps, b.MaxKbps);
+    PRINT_ADJUSTED("GopPicSize", a.GopPicSize, b.GopPicSize);
+    PRINT_ADJUSTED("GopRefDist", a.GopRefDist, b.GopRefDist);
+    PRINT_ADJUSTED("IdrInterval", a.IdrInterval, b.IdrInterval);
+    PRINT_ADJUSTED("FrameRateExtN", a.FrameInfo.FrameRateExtN, b.FrameInfo.FrameRateExtN);
+    PRINT_ADJUSTED("FrameRateExtD", a.FrameInfo.FrameRateExtD, b.FrameInfo.FrameRateExtD);
+    PRINT_ADJUSTED("BufferSizeInKB", a.BufferSizeInKB, b.BufferSizeInKB);
+    PRINT_ADJUSTED("BRefType", requestedOption2.BRefType, correctedOption2.BRefType);
+    PRINT_ADJUSTED("LookAheadDepth", requestedOption2.LookAheadDepth, correctedOption2.LookAheadDepth);
+    PRINT_ADJUSTED("IntRefType", requestedOption2.IntRefType, correctedOption2.IntRefType);
+    PRINT_ADJUSTED("IntRefCycleSize", requestedOption2.IntRefCycleSize, correctedOption2.IntRefCycleSize);
+    PRINT_ADJUSTED("MaxFrameSize", requestedOption2.MaxFrameSize, correctedOption2.MaxFrameSize);
+#undef PRINT_ADJUSTED
+}
+
+mfxVideoParam EncoderSession::SetVPPParam(int w, int h, int outW, int outH, mfxU32 outFourCC,
+                                          const EncoderConfig& config)
+{
+    mfxVideoParam vppParam = {0}; // 必须用0初始化，防止有些参数出现未知值
+    vppParam.IOPattern = MFX_IOPATTERN_IN_SYSTEM_MEMORY | MFX_IOPATTERN_OUT_SYSTEM_MEMORY;
+    vppParam.vpp.In.FourCC = MFX_FOURCC_RGB4;
+    vppParam.vpp.In.ChromaFormat  = FourCCToChromaFormat(vppParam.vpp.In.FourCC);
+    vppParam.vpp.In.CropX         = 0;
+    vppParam.vpp.In.CropY         = 0;
+    vppParam.vpp.In.CropW         = w;
+    vppParam.vpp.In.CropH         = h;
+    vppParam.vpp.In.PicStruct     = MFX_PICSTRUCT_PROGRESSIVE;
+    vppParam.vpp.In.FrameRateExtN = config.frameRateN;
+    vppParam.vpp.In.FrameRateExtD = config.frameRateD;
+    vppParam.vpp.In.Width = AlignSurfaceWidth(w, MFX_FOURCC_RGB4);
+    vppParam.vpp.In.Height = ALIGN32(h);
+
+    // 输出直接作为编码器输入，格式和大小要和SetEncodeParam一致，大小和输入不同时VPP缩放
+    vppParam.vpp.Out.FourCC = outFourCC;
+    vppParam.vpp.Out.ChromaFormat  = FourCCToChromaFormat(vppParam.vpp.Out.FourCC);
+    vppParam.vpp.Out.CropX         = 0;
+    vppParam.vpp.Out.CropY         = 0;
+    vppParam.vpp.Out.CropW         = outW;
+    vppParam.vpp.Out.CropH         = outH;
+    vppParam.vpp.Out.PicStruct     = MFX_PICSTRUCT_PROGRESSIVE;
+    vppParam.vpp.Out.FrameRateExtN = config.frameRateN;
+    vppParam.vpp.Out.FrameRateExtD = config.frameRateD;
+    vppParam.vpp.Out.Width = AlignSurfaceWidth(outW, outFourCC);
+    vppParam.vpp.Out.Height = ALIGN32(outH);
+
+    return vppParam;
+}
+
+void EncoderSession::PrintParam(mfxVideoParam param)
+{
+    // 每个字段一条调试日志，默认编译级别下整个函数是空的
+    LOG_DEBUG("mfxVideoParam.AllocId: %d", param.AllocId);
+    LOG_DEBUG("mfxVideoParam.AsyncDepth: %d", param.AsyncDepth);
+    LOG_DEBUG("mfxVideoParam.Protected: %d", param.Protected);
+    LOG_DEBUG("mfxVideoParam.NumExtParam: %d", param.NumExtParam);
+    LOG_DEBUG("mfxVideoParam.IOPattern: %d", param.IOPattern);
+    
+    LOG_DEBUG("mfxVideoParam.mfx.CodecId: %d", param.mfx.CodecId);
+    LOG_DEBUG("mfxVideoParam.mfx.CodecProfile: %d", param.mfx.CodecProfile);
+    LOG_DEBUG("mfxVideoParam.mfx.CodecLevel: %d", param.mfx.CodecLevel);
+    LOG_DEBUG("mfxVideoParam.mfx.TargetUsage: %d", param.mfx.TargetUsage);
+    LOG_DEBUG("mfxVideoParam.mfx.RateControlMethod: %d", param.mfx.RateControlMethod);
+    LOG_DEBUG("mfxVideoParam.mfx.TargetKbps: %d", param.mfx.TargetKbps);
+    
+    LOG_DEBUG("mfxVideoParam.mfx.LowPower: %d", param.mfx.LowPower);
+    LOG_DEBUG("mfxVideoParam.mfx.BRCParamMultiplier: %d", param.mfx.BRCParamMultiplier);
+    LOG_DEBUG("mfxVideoParam.mfx.GopPicSize: %d", param.mfx.GopPicSize);
+    LOG_DEBUG("mfxVideoParam.mfx.GopRefDist: %d", param.mfx.GopRefDist);
+    LOG_DEBUG("mfxVideoParam.mfx.GopOptFlag: %d", param.mfx.GopOptFlag);
+    LOG_DEBUG("mfxVideoParam.mfx.IdrInterval: %d", param.mfx.IdrInterval);
+    LOG_DEBUG("mfxVideoParam.mfx.InitialDelayInKB: %d", param.mfx.InitialDelayInKB);
+    LOG_DEBUG("mfxVideoParam.mfx.QPI: %d", param.mfx.QPI);
+    LOG_DEBUG("mfxVideoParam.mfx.Accuracy: %d", param.mfx.Accuracy);
+    LOG_DEBUG("mfxVideoParam.mfx.BufferSizeInKB: %d", param.mfx.BufferSizeInKB);
+    LOG_DEBUG("mfxVideoParam.mfx.QPP: %d", param.mfx.QPP);
+    LOG_DEBUG("mfxVideoParam.mfx.ICQQuality: %d", param.mfx.ICQQuality);
+    LOG_DEBUG("mfxVideoParam.mfx.MaxKbps: %d", param.mfx.MaxKbps);
+    LOG_DEBUG("mfxVideoParam.mfx.QPB: %d", param.mfx.QPB);
+    LOG_DEBUG("mfxVideoParam.mfx.Convergence: %d", param.mfx.Convergence);
+    LOG_DEBUG("mfxVideoParam.mfx.NumSlice: %d", param.mfx.NumSlice);
+    LOG_DEBUG("mfxVideoParam.mfx.NumRefFrame: %d", param.mfx.NumRefFrame);
+    LOG_DEBUG("mfxVideoParam.mfx.EncodedOrder: %d", param.mfx.EncodedOrder);
+    LOG_DEBUG("mfxVideoParam.mfx.DecodedOrder: %d", param.mfx.DecodedOrder);
+    LOG_DEBUG("mfxVideoParam.mfx.ExtendedPicStruct: %d", param.mfx.ExtendedPicStruct);
+    LOG_DEBUG("mfxVideoParam.mfx.TimeStampCalc: %d", param.mfx.TimeStampCalc);
+    LOG_DEBUG("mfxVideoParam.mfx.SliceGroupsPresent: %d", param.mfx.SliceGroupsPresent);
+    LOG_DEBUG("mfxVideoParam.mfx.MaxDecFrameBuffering: %d", param.mfx.MaxDecFrameBuffering);
+    LOG_DEBUG("mfxVideoParam.mfx.EnableReallocRequest: %d", param.mfx.EnableReallocRequest);
+    LOG_DEBUG("mfxVideoParam.mfx.FilmGrain: %d", param.mfx.FilmGrain);
+    LOG_DEBUG("mfxVideoParam.mfx.IgnoreLevelConstrain: %d", param.mfx.IgnoreLevelConstrain);
+    LOG_DEBUG("mfxVideoParam.mfx.SkipOutput: %d", param.mfx.SkipOutput);
+    LOG_DEBUG("mfxVideoParam.mfx.Interleaved: %d", param.mfx.Interleaved);
+    LOG_DEBUG("mfxVideoParam.mfx.Quality: %d", param.mfx.Quality);
+    LOG_DEBUG("mfxVideoParam.mfx.RestartInterval: %d", param.mfx.RestartInterval);
+    
+    LOG_DEBUG("mfxVideoParam.mfx.FrameInfo.FourCC: %d", param.mfx.FrameInfo.FourCC);
+    LOG_DEBUG("mfxVideoParam.mfx.FrameInfo.ChromaFormat: %d", param.mfx.FrameInfo.ChromaFormat);
+    LOG_DEBUG("mfxVideoParam.mfx.FrameInfo.CropX: %d", param.mfx.FrameInfo.CropX);
+    LOG_DEBUG("mfxVideoParam.mfx.FrameInfo.CropY: %d", param.mfx.FrameInfo.CropY);
+    LOG_DEBUG("mfxVideoParam.mfx.FrameInfo.CropW: %d", param.mfx.FrameInfo.CropW);
+    LOG_DEBUG("mfxVideoParam.mfx.FrameInfo.CropH: %d", param.mfx.FrameInfo.CropH);
+    LOG_DEBUG("mfxVideoParam.mfx.FrameInfo.Width: %d", param.mfx.FrameInfo.Width);
+    LOG_DEBUG("mfxVideoParam.mfx.FrameInfo.Height: %d", param.mfx.FrameInfo.Height);
+    LOG_DEBUG("mfxVideoParam.mfx.FrameInfo.FrameRateExtN: %d", param.mfx.FrameInfo.FrameRateExtN);
+    LOG_DEBUG("mfxVideoParam.mfx.FrameInfo.FrameRateExtD: %d", param.mfx.FrameInfo.FrameRateExtD);
+    LOG_DEBUG("mfxVideoParam.mfx.FrameInfo.AspectRatioW: %d", param.mfx.FrameInfo.AspectRatioW);
+    LOG_DEBUG("mfxVideoParam.mfx.FrameInfo.AspectRatioH: %d", param.mfx.FrameInfo.AspectRatioH);
+    LOG_DEBUG("mfxVideoParam.mfx.FrameInfo.ChannelId: %d", param.mfx.FrameInfo.ChannelId);
+    LOG_DEBUG("mfxVideoParam.mfx.FrameInfo.BitDepthLuma: %d", param.mfx.FrameInfo.BitDepthLuma);
+    LOG_DEBUG("mfxVideoParam.mfx.FrameInfo.BitDepthChroma: %d", param.mfx.FrameInfo.BitDepthChroma);
+    LOG_DEBUG("mfxVideoParam.mfx.FrameInfo.Shift: %d", param.mfx.FrameInfo.Shift);
+    LOG_DEBUG("mfxVideoParam.mfx.FrameInfo.FrameId: TemporalId %d, PriorityId %d, ViewId %d",
+              param.mfx.FrameInfo.FrameId.TemporalId, param.mfx.FrameInfo.FrameId.PriorityId,
+              param.mfx.FrameInfo.FrameId.ViewId);
+    // BufferSize和Width、Height等共用union，只对P8这类非图像的缓冲区有意义，这里不打印
+    LOG_DEBUG("mfxVideoParam.mfx.FrameInfo.PicStruct: %d", param.mfx.FrameInfo.PicStruct);
+    
+}
+
+mfxU32 EncoderSession::GetBitstreamBufferSize()
+{
+    // Init后runtime可能调整了参数，以实际值为准
+    mfxVideoParam param = {0};
+    mfxStatus sts = MFXVideoENCODE_GetVideoParam(session, &param);
+    VERIFY(MFX_ERR_NONE == sts, "GetVideoParam failed");
+
+    // runtime提交时要求MaxLength不小于BufferSizeInKB（码控的HRD缓冲区，CQP时是runtime估的单帧上限），
+    // 比它小的缓冲区每次提交都会被拒，所以直接按它申请，一帧也不会超过它；
+    // runtime没给出时按原始YUV 4:2:0的大小，不够时EncodePipeline再扩
+    mfxU64 hrdSize = (mfxU64)param.mfx.BufferSizeInKB * std::max<mfxU16>(param.mfx.BRCParamMultiplier, 1) * 1000;
+    mfxU64 rawSize = (mfxU64)param.mfx.FrameInfo.Width * param.mfx.FrameInfo.Height * 3 / 2;
+    mfxU64 size = hrdSize ? hrdSize : rawSize;
+    size = std::max<mfxU64>(size, BITSTREAM_MIN_BUFFER_SIZE);
+    size = std::min<mfxU64>(size, BITSTREAM_MAX_BUFFER_SIZE);
+    return (mfxU32)size;
+}
+
+void* EncoderSession::InitAcceleratorHandle(mfxSession session, int *fd) {
+    mfxIMPL impl;
+    mfxStatus sts = MFXQueryIMPL(session, &impl);
+    if (sts != MFX_ERR_NONE)
+        return NULL;
+
+#ifdef LIBVA_SUPPORT
+    if ((impl & MFX_IMPL_VIA_VAAPI) == MFX_IMPL_VIA_VAAPI) {
+        if (!fd)
+            return NULL;
+        VADisplay va_dpy = NULL;
+        // initialize VAAPI context and set session handle (req in Linux)
+        *fd = open("/dev/dri/renderD128", O_RDWR);
+        if (*fd >= 0) {
+            va_dpy = vaGetDisplayDRM(*fd);
+            if (va_dpy) {
+                int major_version = 0, minor_version = 0;
+                if (VA_STATUS_SUCCESS == vaInitialize(va_dpy, &major_version, &minor_version)) {
+                    MFXVideoCORE_SetHandle(session,
+                                           static_cast<mfxHandleType>(MFX_HANDLE_VA_DISPLAY),
+                                           va_dpy);
+                }
+            }
+        }
+        return va_dpy;
+    }
+#endif
+
+    return NULL;
+}
+
+mfxStatus EncoderSession::AllocateExternalSystemMemorySurfacePool(mfxU8 **buf,
+                                                  mfxFrameSurface1 *surfpool,
+                                                  mfxFrameInfo frame_info,
+                                                  mfxU16 surfnum) {
+    // initialize surface pool (I420, RGB4 format)
+    mfxU32 surfaceSize = GetSurfaceSize(frame_info.FourCC, frame_info.Width, frame_info.Height);
+    if (!surfaceSize)
+        return MFX_ERR_MEMORY_ALLOC;
+
+    // 每个surface从页边界开始，整个pool从FrameArena申请，不用calloc清零
+    size_t surfaceStride    = FrameArena::Instance().SurfaceStride(surfaceSize);
+    size_t framePoolBufSize = surfaceStride * surfnum;
+    *buf                    = reinterpret_cast<mfxU8 *>(FrameArena::Instance().Allocate(framePoolBufSize));
+    if (!*buf)
+        return MFX_ERR_MEMORY_ALLOC;
+
+    for (mfxU32 i = 0; i < surfnum; i++) {
+        surfpool[i]       = { 0 };
+        surfpool[i].Info  = frame_info;
+        size_t buf_offset = static_cast<size_t>(i) * surfaceStride;
+        MapSurfaceData(&surfpool[i], *buf + buf_offset);
+    }
+
+    return MFX_ERR_NONE;
+}
+
+void EncoderSession::MapSurfaceData(mfxFrameSurface1 *surface, mfxU8 *base) {
+    mfxFrameInfo &info = surface->Info;
+    mfxFrameData &data = surface->Data;
+    mfxU16 surfW;
+    mfxU16 surfH = info.Height;
+
+    switch (info.FourCC) {
+    case MFX_FOURCC_RGB4:
+        data.B     = base;
+        data.G     = data.B + 1;
+        data.R     = data.B + 2;
+        data.A     = data.B + 3;
+        data.Pitch = info.Width * 4;
+        break;
+    case MFX_FOURCC_NV12:
+        // UV交错存放在同一个平面
+        data.Y     = base;
+        data.UV    = base + (info.Width * surfH);
+        data.U     = data.UV;
+        data.V     = data.UV + 1;
+        data.Pitch = info.Width;
+        break;
+    default:
+        surfW      = (info.FourCC == MFX_FOURCC_P010) ? info.Width * 2 : info.Width;
+        data.Y     = base;
+        data.U     = base + (surfW * surfH);
+        data.V     = data.U + ((surfW / 2) * (surfH / 2));
+        data.Pitch = surfW;
+        break;
+    }
+}
+
+mfxU16 EncoderSession::AlignSurfaceWidth(int w, mfxU32 fourCC) {
+    // Pitch等于Width（RGB4为4倍），I420的色度行是Width的一半
+    mfxU32 alignment = 32;
+    if (fourCC == MFX_FOURCC_NV12)
+        alignment = ARENA_ROW_ALIGNMENT;
+    else if (fourCC == MFX_FOURCC_I420)
+        alignment = ARENA_ROW_ALIGNMENT * 2;
+    return static_cast<mfxU16>((w + alignment - 1) / alignment * alignment);
+}
+
+mfxU32 EncoderSession::GetSurfaceSize(mfxU32 FourCC, mfxU32 width, mfxU32 height) {
+    mfxU32 nbytes = 0;
+
+    switch (FourCC) {
+        case MFX_FOURCC_I420:
+        case MFX_FOURCC_NV12:
+            nbytes = width * height + (width >> 1) * (height >> 1) + (width >> 1) * (height >> 1);
+            break;
+        case MFX_FOURCC_I010:
+        case MFX_FOURCC_P010:
+            nbytes = width * height + (width >> 1) * (height >> 1) + (width >> 1) * (height >> 1);
+            nbytes *= 2;
+            break;
+        case MFX_FOURCC_RGB4:
+            nbytes = width * height * 4;
+            break;
+        default:
+            break;
+    }
+
+    return nbytes;
+}
+
+void EncoderSession::FreeExternalSystemMemorySurfacePool(mfxU8 *buf, mfxFrameSurface1 *surfpool) {
+    if (buf)
+        FrameArena::Instance().Release(buf);
+
+    if (surfpool)
+        free(surfpool);
+}
+
+void EncoderSession::FreeAcceleratorHandle(void *accelHandle, int fd) {
+#ifdef LIBVA_SUPPORT
+    if (accelHandle) {
+        vaTerminate((VADisplay)accelHandle);
+    }
+    if (fd) {
+        close(fd);
+    }
+#endif
+}
+
+mfxU16 EncoderSession::FourCCToChromaFormat(mfxU32 fourCC)
+{
+    switch(fourCC)
+    {
+    case MFX_FOURCC_NV12:
+    case MFX_FOURCC_P010:
+    case MFX_FOURCC_P016:
+        return MFX_CHROMAFORMAT_YUV420;
+    case MFX_FOURCC_NV16:
+    case MFX_FOURCC_P210:
+    case MFX_FOURCC_Y210:
+    case MFX_FOURCC_Y216:
+    case MFX_FOURCC_YUY2:
+    case MFX_FOURCC_UYVY:
+        return MFX_CHROMAFORMAT_YUV422;
+    case MFX_FOURCC_Y410:
+    case MFX_FOURCC_A2RGB10:
+    case MFX_FOURCC_AYUV:
+    case MFX_FOURCC_RGB4:
+        return MFX_CHROMAFORMAT_YUV444;
+    }
+
+    return MFX_CHROMAFORMAT_YUV420;
+}
@@ -0,0 +1,282 @@
+#include "frame-arena.hpp"
+#include "logger.hpp"
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <algorithm>
+
+// set_mempolicy/mbind的绑定策略，避免依赖libnuma
+#ifndef MPOL_BIND
+#define MPOL_BIND                   2
+#endif
+// 大于这个大小的surface才按2MB对齐，否则每个surface浪费的尾部太多
+#define ARENA_HUGE_SURFACE_SIZE     (8 * ARENA_HUGE_PAGE_SIZE)
+
+static size_t AlignUp(size_t value, size_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+FrameArena& FrameArena::Instance()
+{
+    // 不析构：静态对象的析构顺序不定，其他静态对象析构时可能还在归还内存
+    static FrameArena *arena = new FrameArena();
+    return *arena;
+}
+
+FrameArena::FrameArena(const FrameArenaOptions& options)
+    : options(options)
+{
+}
+
+FrameArena::~FrameArena()
+{
+    for (auto& item : blocks)
+        munmap(item.first, item.second.size);
+}
+
+void *FrameArena::Allocate(size_t size)
+{
+    if (size == 0)
+        return NULL;
+
+    FrameArenaOptions current;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        size = RoundSize(size);
+        allocations++;
+        auto found = freeBlocks.find(size);
+        if (found != freeBlocks.end()) {
+            void *ptr = found->second;
+            freeBlocks.erase(found);
+            blocks[ptr].used = true;
+            usedBytes += size;
+            peakUsedBytes = std::max(peakUsedBytes, usedBytes);
+            reuses++;
+            return ptr;
+        }
+        current = options;
+    }
+
+    // 映射和预缺页可能要几毫秒，放在锁外
+    bool hugePage = false, fallback = false;
+    void *ptr = Map(size, current, hugePage, fallback);
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (fallback)
+        hugetlbFallbacks++;
+    if (!ptr)
+        return NULL;
+    Block block = {size, hugePage, true};
+    blocks[ptr] = block;
+    mappedBytes += size;
+    if (hugePage)
+        hugePageBytes += size;
+    usedBytes += size;
+    peakUsedBytes = std::max(peakUsedBytes, usedBytes);
+    return ptr;
+}
+
+void FrameArena::Release(void *ptr)
+{
+    if (!ptr)
+        return;
+    std::lock_guard<std::mutex> guard(lock);
+    auto found = blocks.find(ptr);
+    if (found == blocks.end() || !found->second.used) {
+        LOG_ERROR("release unknown arena block %p", ptr);
+        return;
+    }
+    found->second.used = false;
+    usedBytes -= found->second.size;
+    freeBlocks.insert(std::make_pair(found->second.size, ptr));
+}
+
+void FrameArena::Trim()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto& item : freeBlocks) {
+        Block& block = blocks[item.second];
+        mappedBytes -= block.size;
+        if (block.hugePage)
+            hugePageBytes -= block.size;
+        munmap(item.second, block.size);
+        blocks.erase(item.second);
+    }
+    freeBlocks.clear();
+}
+
+void FrameArena::SetOptions(const FrameArenaOptions& options)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    this->options = options;
+}
+
+FrameArenaOptions FrameArena::GetOptions()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return options;
+}
+
+FrameArenaStatus FrameArena::GetStatus()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    FrameArenaStatus status;
+    status.mappedBytes = mappedBytes;
+    status.usedBytes = usedBytes;
+    status.peakUsedBytes = peakUsedBytes;
+    status.hugePageBytes = hugePageBytes;
+    status.blocks = blocks.size();
+    status.freeBlocks = freeBlocks.size();
+    status.allocations = allocations;
+    status.reuses = reuses;
+    status.hugetlbFallbacks = hugetlbFallbacks;
+    return status;
+}
+
+size_t FrameArena::SurfaceStride(size_t size)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (options.pageMode != ArenaPageMode::NORMAL && size >= ARENA_HUGE_SURFACE_SIZE)
+        return AlignUp(size, ARENA_HUGE_PAGE_SIZE);
+    return AlignUp(size, ARENA_PAGE_SIZE);
+}
+
+size_t FrameArena::AlignRow(size_t rowBytes)
+{
+    return AlignUp(rowBytes, ARENA_ROW_ALIGNMENT);
+}
+
+size_t FrameArena::RoundSize(size_t size) const
+{
+    if (options.pageMode != ArenaPageMode::NORMAL && size >= ARENA_HUGE_PAGE_SIZE)
+        return AlignUp(size, ARENA_HUGE_PAGE_SIZE);
+    return AlignUp(size, ARENA_PAGE_SIZE);
+}
+
+void *FrameArena::Map(size_t size, const FrameArenaOptions& options, bool& hugePage, bool& fallback)
+{
+    void *ptr = NULL;
+    bool huge = options.pageMode != ArenaPageMode::NORMAL && size % ARENA_HUGE_PAGE_SIZE == 0;
+
+    // 1.预留的大页，没有配置vm.nr_hugepages或者用完了会失败
+    if (huge && options.pageMode == ArenaPageMode::HUGETLB) {
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ptr == MAP_FAILED) {
+            ptr = NULL;
+            fallback = true;
+        }
+        else {
+            hugePage = true;
+        }
+    }
+    // 2.透明大页：地址按2MB对齐内核才能用大页映射
+    if (!ptr && huge) {
+        ptr = MapAligned(size, ARENA_HUGE_PAGE_SIZE);
+#ifdef MADV_HUGEPAGE
+        if (ptr && madvise(ptr, size, MADV_HUGEPAGE) == 0)
+            hugePage = true;
+#endif
+    }
+    // 3.普通页
+    if (!ptr) {
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED) {
+            LOG_ERROR("mmap %zu bytes failed", size);
+            return NULL;
+        }
+    }
+
+    if (options.numaNode >= 0 && !BindNode(ptr, size, options.numaNode))
+        LOG_WARN("bind arena block to numa node %d failed", options.numaNode);
+    // 匿名映射已经是0，这里只为提前触发缺页
+    if (options.prefault) {
+        size_t page = hugePage ? ARENA_HUGE_PAGE_SIZE : ARENA_PAGE_SIZE;
+        for (size_t offset = 0; offset < size; offset += page)
+            static_cast<volatile char*>(ptr)[offset] = 0;
+    }
+    return ptr;
+}
+
+void *FrameArena::MapAligned(size_t size, size_t alignment)
+{
+    size_t mapSize = size + alignment;
+    void *raw = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+        return NULL;
+    uintptr_t start = reinterpret_cast<uintptr_t>(raw);
+    uintptr_t aligned = AlignUp(start, alignment);
+    if (aligned > start)
+        munmap(raw, aligned - start);
+    size_t tail = start + mapSize - (aligned + size);
+    if (tail > 0)
+        munmap(reinterpret_cast<void*>(aligned + size), tail);
+    return reinterpret_cast<void*>(aligned);
+}
+
+bool FrameArena::BindNode(void *ptr, size_t size, int node)
+{
+#ifdef SYS_mbind
+    const size_t bits = 8 * sizeof(unsigned long);
+    unsigned long mask[16] = {0};
+    if (node < 0 || (size_t)node >= bits * 16)
+        return false;
+    mask[node / bits] |= 1UL << (node % bits);
+    return syscall(SYS_mbind, ptr, size, MPOL_BIND, mask, bits * 16, 0) == 0;
+#else
+    return false;
+#endif
+}
+
+#if CV_VERSION_MAJOR >= 4
+cv::UMatData *ArenaMatAllocator::allocate(int dims, const int *sizes, int type, void *data, size_t *step,
+                                          cv::AccessFlag flags, cv::UMatUsageFlags usageFlags) const
+#else
+cv::UMatData *ArenaMatAllocator::allocate(int dims, const int *sizes, int type, void *data, size_t *step,
+                                          int flags, cv::UMatUsageFlags usageFlags) const
+#endif
+{
+    // 和OpenCV默认分配器一样计算连续存放的step
+    size_t total = CV_ELEM_SIZE(type);
+    for (int i = dims - 1; i >= 0; i--) {
+        if (step) {
+            if (data && step[i] != CV_AUTOSTEP)
+                total = step[i];
+            else
+                step[i] = total;
+        }
+        total *= sizes[i];
+    }
+
+    cv::uchar *ptr = static_cast<cv::uchar*>(data);
+    if (!ptr) {
+        ptr = static_cast<cv::uchar*>(arena.Allocate(total));
+        if (!ptr)   // 映射失败时退回OpenCV默认分配器
+            return cv::Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usageFlags);
+    }
+    cv::UMatData *u = new cv::UMatData(this);
+    u->data = u->origdata = ptr;
+    u->size = total;
+    if (data)
+        u->flags |= cv::UMatData::USER_ALLOCATED;
+    return u;
+}
+
+#if CV_VERSION_MAJOR >= 4
+bool ArenaMatAllocator::allocate(cv::UMatData *data, cv::AccessFlag, cv::UMatUsageFlags) const
+#else
+bool ArenaMatAllocator::allocate(cv::UMatData *data, int, cv::UMatUsageFlags) const
+#endif
+{
+    return data != NULL;
+}
+
+void ArenaMatAllocator::deallocate(cv::UMatData *u) const
+{
+    if (!u)
+        return;
+    if (!(u->flags & cv::UMatData::USER_ALLOCATED))
+        arena.Release(u->origdata);
+    delete u;
+}
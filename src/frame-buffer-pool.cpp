@@ -0,0 +1,51 @@
+#include "frame-buffer-pool.hpp"
+
+FrameBufferPool::FrameBufferPool(int rows, int cols, int type, size_t count, cv::MatAllocator *allocator)
+    : rows(rows), cols(cols), type(type), allocator(allocator)
+{
+    buffers.resize(count);
+    for (cv::Mat& buffer : buffers) {
+        buffer.allocator = allocator;
+        buffer.create(rows, cols, type);
+    }
+}
+
+cv::Mat FrameBufferPool::Acquire()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        acquires++;
+        for (size_t i = 0; i < buffers.size(); i++) {
+            size_t index = (next + i) % buffers.size();
+            if (IsFree(buffers[index])) {
+                next = index + 1;
+                return buffers[index];  // 引用计数加一，调用者的Mat释放后回到空闲
+            }
+        }
+        misses++;
+    }
+
+    cv::Mat buffer;
+    buffer.allocator = allocator;
+    buffer.create(rows, cols, type);
+    return buffer;
+}
+
+FrameBufferPoolStatus FrameBufferPool::GetStatus()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    FrameBufferPoolStatus status;
+    status.buffers = buffers.size();
+    status.freeBuffers = 0;
+    for (const cv::Mat& buffer : buffers)
+        status.freeBuffers += IsFree(buffer);
+    status.acquires = acquires;
+    status.misses = misses;
+    return status;
+}
+
+bool FrameBufferPool::IsFree(const cv::Mat& buffer)
+{
+    // 引用计数在其他线程原子递减，这里用原子加0读取
+    return buffer.u && CV_XADD(&buffer.u->refcount, 0) == 1;
+}
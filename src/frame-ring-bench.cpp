@@ -0,0 +1,108 @@
+#include "frame-ring.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// 每个生产者推入的帧数
+#define BENCH_FRAMES_PER_PRODUCER   2000000
+// 环形队列长度，取大一些，只测入队出队本身的开销
+#define BENCH_QUEUE_SIZE            1024
+
+// 模拟cv::Mat：拷贝/移动时只动引用计数
+typedef std::shared_ptr<unsigned char> Frame;
+
+/**
+ * @brief 原实现：std::queue + mutex
+ */
+class LockedQueue
+{
+public:
+    bool TryPush(Frame& item)
+    {
+        std::lock_guard<std::mutex> lock(queueLock);
+        queue.push(item);
+        item.reset();
+        return true;
+    }
+    bool TryPop(Frame& item)
+    {
+        std::lock_guard<std::mutex> lock(queueLock);
+        if (queue.empty())
+            return false;
+        item = queue.front();
+        queue.pop();
+        return true;
+    }
+
+private:
+    std::queue<Frame> queue;
+    std::mutex queueLock;
+};
+
+template <typename Queue>
+double RunBench(Queue& queue, int producers)
+{
+    Frame payload(new unsigned char[64], std::default_delete<unsigned char[]>());
+    const long total = (long)BENCH_FRAMES_PER_PRODUCER * producers;
+
+    auto t1 = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.emplace_back([&queue, &payload] {
+            for (long i = 0; i < BENCH_FRAMES_PER_PRODUCER; i++) {
+                Frame frame = payload;
+                while (!queue.TryPush(frame))
+                    std::this_thread::yield();
+            }
+        });
+    }
+    Frame frame;
+    for (long received = 0; received < total;) {
+        if (queue.TryPop(frame)) {
+            frame.reset();
+            received++;
+        }
+        else {
+            std::this_thread::yield();
+        }
+    }
+    for (auto& t : threads)
+        t.join();
+    auto t2 = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<double, std::nano>(t2 - t1).count() / total;
+}
+
+int main(int argc, char* argv[])
+{
+    int producers = 4;
+    if (argc > 1)
+        producers = atoi(argv[1]);
+
+    {
+        LockedQueue q;
+        printf("std::queue + mutex, 1 producer : %8.1f ns/frame\n", RunBench(q, 1));
+    }
+    {
+        SpscRing<Frame> q(BENCH_QUEUE_SIZE);
+        printf("SpscRing,           1 producer : %8.1f ns/frame\n", RunBench(q, 1));
+    }
+    {
+        MpscRing<Frame> q(BENCH_QUEUE_SIZE);
+        printf("MpscRing,           1 producer : %8.1f ns/frame\n", RunBench(q, 1));
+    }
+    {
+        LockedQueue q;
+        printf("std::queue + mutex, %d producer : %8.1f ns/frame\n", producers, RunBench(q, producers));
+    }
+    {
+        MpscRing<Frame> q(BENCH_QUEUE_SIZE);
+        printf("MpscRing,           %d producer : %8.1f ns/frame\n", producers, RunBench(q, producers));
+    }
+    return 0;
+}
@@ -0,0 +1,52 @@
+#include "latency-histogram.hpp"
+#include <algorithm>
+
+uint64_t LatencyHistogram::BucketLowerBound(size_t index)
+{
+    if (index < HISTOGRAM_SUB_BUCKETS)
+        return index;
+    int exponent = (int)(index / HISTOGRAM_SUB_BUCKETS) + HISTOGRAM_SUB_BUCKET_BITS - 1;
+    uint64_t sub = index % HISTOGRAM_SUB_BUCKETS;
+    return (HISTOGRAM_SUB_BUCKETS + sub) << (exponent - HISTOGRAM_SUB_BUCKET_BITS);
+}
+
+uint64_t LatencyHistogram::BucketWidth(size_t index)
+{
+    if (index < HISTOGRAM_SUB_BUCKETS)
+        return 1;
+    int exponent = (int)(index / HISTOGRAM_SUB_BUCKETS) + HISTOGRAM_SUB_BUCKET_BITS - 1;
+    return (uint64_t)1 << (exponent - HISTOGRAM_SUB_BUCKET_BITS);
+}
+
+LatencyPercentiles LatencyHistogram::Snapshot() const
+{
+    uint64_t snapshot[HISTOGRAM_BUCKETS];
+    uint64_t count = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        snapshot[i] = counts[i].load(std::memory_order_relaxed);
+        count += snapshot[i];
+    }
+
+    LatencyPercentiles result = {};
+    result.count = count;
+    result.lastMs = last.load(std::memory_order_relaxed) / 1000.0;
+    result.maxMs = max.load(std::memory_order_relaxed) / 1000.0;
+    if (count == 0)
+        return result;
+    result.avgMs = (double)sum.load(std::memory_order_relaxed) / total.load(std::memory_order_relaxed) / 1000.0;
+
+    // 一次遍历依次找到三个分位数，取所在格的中点，不超过记录到的最大值
+    const double quantiles[] = { 0.50, 0.95, 0.99 };
+    double *outputs[] = { &result.p50Ms, &result.p95Ms, &result.p99Ms };
+    size_t q = 0;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS && q < 3; i++) {
+        seen += snapshot[i];
+        while (q < 3 && seen > 0 && seen >= (uint64_t)(quantiles[q] * count + 0.5)) {
+            double mid = BucketLowerBound(i) + (BucketWidth(i) - 1) / 2.0;
+            *outputs[q] = std::min(mid / 1000.0, result.maxMs);
+            q++;
+        }
+    }
+    return result;
+}
@@ -0,0 +1,154 @@
+#include "loader-cache.hpp"
+#include "logger.hpp"
+#include <stdio.h>
+
+VplLoaderCache& VplLoaderCache::Instance()
+{
+    static VplLoaderCache cache;
+    return cache;
+}
+
+VplLoaderCache::~VplLoaderCache()
+{
+    for (auto& item : entries) {
+        for (mfxImplDescription *idesc : item.second.descriptions)
+            MFXDispReleaseImplDescription(item.second.loader, idesc);
+        MFXUnload(item.second.loader);
+    }
+}
+
+mfxStatus VplLoaderCache::Warmup(const LoaderFilter& filter)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    Entry *entry = GetEntry(filter);
+    if (!entry)
+        return MFX_ERR_NOT_INITIALIZED;
+    return entry->descriptions.empty() ? MFX_ERR_NOT_FOUND : MFX_ERR_NONE;
+}
+
+mfxStatus VplLoaderCache::CreateSession(const LoaderFilter& filter, mfxSession *session, mfxU32 implIndex)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    Entry *entry = GetEntry(filter);
+    if (!entry)
+        return MFX_ERR_NOT_INITIALIZED;
+    if (implIndex >= entry->descriptions.size())
+        return MFX_ERR_NOT_FOUND;
+    return MFXCreateSession(entry->loader, implIndex, session);
+}
+
+std::vector<const mfxImplDescription*> VplLoaderCache::GetImplementations(const LoaderFilter& filter)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    Entry *entry = GetEntry(filter);
+    if (!entry)
+        return {};
+    return std::vector<const mfxImplDescription*>(entry->descriptions.begin(), entry->descriptions.end());
+}
+
+VplLoaderCache::Entry *VplLoaderCache::GetEntry(const LoaderFilter& filter)
+{
+    auto found = entries.find(filter);
+    if (found != entries.end())
+        return &found->second;
+
+    // 1.先load
+    mfxLoader loader = MFXLoad();
+    if (!loader) {
+        LOG_ERROR("MFXLoad failed -- is implementation in path?");
+        return NULL;
+    }
+
+    // 2.设置vpl配置参数（每个config需要单独配置，用同一个mfxConfig配置多次参数会相互覆盖）
+    // 条件怎么填看mfxImplDescription或 https://spec.oneapi.io/versions/latest/elements/oneVPL/source/programming_guide/VPL_prg_session.html#onevpl-dispatcher-configuration-properties
+    mfxStatus sts = SetFilter(loader, "mfxImplDescription.Impl", filter.implType);
+    if (sts == MFX_ERR_NONE)
+        sts = SetFilter(loader, "mfxImplDescription.mfxEncoderDescription.encoder.CodecID", filter.codecId);
+    if (sts == MFX_ERR_NONE)
+        sts = SetFilter(loader, "mfxImplDescription.mfxEncoderDescription.encoder.encprofile.Profile.encmemdesc.MemHandleType",
+                        filter.memHandleType);
+    // Implementation must provide VPP color conversion
+    if (sts == MFX_ERR_NONE && filter.needVpp)
+        sts = SetFilter(loader, "mfxImplDescription.mfxVPPDescription.filter.FilterFourCC", MFX_EXTBUFF_VPP_COLOR_CONVERSION);
+    if (sts != MFX_ERR_NONE) {
+        LOG_ERROR("MFXSetConfigFilterProperty failed %d", sts);
+        MFXUnload(loader);
+        return NULL;
+    }
+
+    // 3.枚举一次满足条件的实现，描述一直保留到进程退出
+    Entry& entry = entries[filter];
+    entry.loader = loader;
+    for (mfxU32 i = 0;; i++) {
+        mfxImplDescription *idesc = nullptr;
+        sts = MFXEnumImplementations(loader, i, MFX_IMPLCAPS_IMPLDESCSTRUCTURE, (mfxHDL*)&idesc);
+        if (sts != MFX_ERR_NONE || !idesc)
+            break;
+        ShowImplementationInfo(loader, i, idesc);
+        entry.descriptions.push_back(idesc);
+    }
+    if (entry.descriptions.empty())
+        LOG_ERROR("no implementations meet selection criteria");
+    return &entry;
+}
+
+mfxStatus VplLoaderCache::SetFilter(mfxLoader loader, const char *name, mfxU32 value)
+{
+    mfxConfig config = MFXCreateConfig(loader);
+    if (!config)
+        return MFX_ERR_NULL_PTR;
+    mfxVariant variant = {0};
+    variant.Type = MFX_VARIANT_TYPE_U32;
+    variant.Data.U32 = value;
+    return MFXSetConfigFilterProperty(config, (const mfxU8*)name, variant);
+}
+
+// 查看Impl最终配置
+void VplLoaderCache::ShowImplementationInfo(mfxLoader loader, mfxU32 implnum, const mfxImplDescription *idesc)
+{
+    const char *accel;
+    switch (idesc->AccelerationMode) {
+    case MFX_ACCEL_MODE_NA:
+        accel = "NA";
+        break;
+    case MFX_ACCEL_MODE_VIA_D3D9:
+        accel = "D3D9";
+        break;
+    case MFX_ACCEL_MODE_VIA_D3D11:
+        accel = "D3D11";
+        break;
+    case MFX_ACCEL_MODE_VIA_VAAPI:
+        accel = "VAAPI";
+        break;
+    case MFX_ACCEL_MODE_VIA_VAAPI_DRM_MODESET:
+        accel = "VAAPI_DRM_MODESET";
+        break;
+    case MFX_ACCEL_MODE_VIA_VAAPI_GLX:
+        accel = "VAAPI_GLX";
+        break;
+    case MFX_ACCEL_MODE_VIA_VAAPI_X11:
+        accel = "VAAPI_X11";
+        break;
+    case MFX_ACCEL_MODE_VIA_VAAPI_WAYLAND:
+        accel = "VAAPI_WAYLAND";
+        break;
+    case MFX_ACCEL_MODE_VIA_HDDLUNITE:
+        accel = "HDDLUNITE";
+        break;
+    default:
+        accel = "unknown";
+        break;
+    }
+    LOG_INFO("Implementation %u: ApiVersion %hu.%hu, type %s, AccelerationMode via %s", implnum,
+             idesc->ApiVersion.Major, idesc->ApiVersion.Minor,
+             (idesc->Impl == MFX_IMPL_TYPE_SOFTWARE) ? "SW" : "HW", accel);
+
+    // Show implementation path, added in 2.4 API
+    mfxHDL implPath = nullptr;
+    mfxStatus sts = MFXEnumImplementations(loader, implnum, MFX_IMPLCAPS_IMPLPATH, &implPath);
+    if (!implPath || (sts != MFX_ERR_NONE))
+        return;
+
+    LOG_INFO("Implementation %u path: %s", implnum, reinterpret_cast<mfxChar*>(implPath));
+    MFXDispReleaseImplDescription(loader, implPath);
+}
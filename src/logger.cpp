@@ -0,0 +1,121 @@
+#include "logger.hpp"
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <new>
+#include <string>
+
+typedef std::chrono::steady_clock Clock;
+
+static int64_t NowUs()
+{
+    static const Clock::time_point start = Clock::now();    // 第一次写日志的时刻
+    return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+}
+
+static void FlushAtExit()
+{
+    Logger::Instance().Flush();
+}
+
+Logger& Logger::Instance()
+{
+    // 不析构：其他静态对象析构时可能还在写日志；退出时由atexit写完剩余的日志。
+    // 队列索引按缓存行对齐，放在对齐的静态存储里，不依赖C++17的对齐new
+    alignas(Logger) static char storage[sizeof(Logger)];
+    static Logger *logger = new (storage) Logger();
+    return *logger;
+}
+
+Logger::Logger()
+{
+    flushThread = std::thread(&Logger::FlushLoop, this);
+    flushThread.detach();
+    atexit(FlushAtExit);
+}
+
+void Logger::Write(int level, uint64_t suppressed, const char *format, ...)
+{
+    Entry entry;
+    entry.level = level;
+    entry.timeUs = NowUs();
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(entry.text, sizeof(entry.text), format, args);
+    va_end(args);
+    if (suppressed && n >= 0 && (size_t)n < sizeof(entry.text))
+        snprintf(entry.text + n, sizeof(entry.text) - n, " (%llu suppressed)", (unsigned long long)suppressed);
+    if (!ring.TryPush(entry)) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    // 和FlushLoop里"先清pending再取队列"配对：要么后台线程取到这条，要么这里看到pending为false去唤醒
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (pending.load(std::memory_order_relaxed) || pending.exchange(true))
+        return;
+    {
+        std::lock_guard<std::mutex> guard(wakeLock);
+    }
+    wakeCond.notify_one();
+}
+
+void Logger::Flush()
+{
+    static const char levels[] = { 'T', 'D', 'I', 'W', 'E' };
+    std::lock_guard<std::mutex> guard(outputLock);
+    std::string out;
+    Entry entry;
+    uint64_t count = 0;
+    while (ring.TryPop(entry)) {
+        char prefix[48];
+        snprintf(prefix, sizeof(prefix), "[%c %lld.%06lld] ", levels[entry.level % LOG_LEVEL_NONE],
+                 (long long)(entry.timeUs / 1000000), (long long)(entry.timeUs % 1000000));
+        out += prefix;
+        out += entry.text;
+        out += '\n';
+        count++;
+    }
+    if (out.empty())
+        return;
+    fwrite(out.data(), 1, out.size(), stdout);
+    fflush(stdout);
+    written.fetch_add(count, std::memory_order_relaxed);
+}
+
+LoggerStatus Logger::GetStatus() const
+{
+    LoggerStatus status;
+    status.written = written.load(std::memory_order_relaxed);
+    status.dropped = dropped.load(std::memory_order_relaxed);
+    status.suppressed = suppressed.load(std::memory_order_relaxed);
+    return status;
+}
+
+void Logger::FlushLoop()
+{
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> guard(wakeLock);
+            wakeCond.wait(guard, [this] { return pending.load(); });
+        }
+        // 第一条日志到了之后再等一会，把这段时间的日志合并成一次写出
+        std::this_thread::sleep_for(std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS));
+        pending.store(false);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        Flush();
+    }
+}
+
+bool LogRateLimiter::Allow(int64_t intervalMs, uint64_t& skipped)
+{
+    int64_t now = NowUs();
+    int64_t next = nextUs.load(std::memory_order_relaxed);
+    if (now < next || !nextUs.compare_exchange_strong(next, now + intervalMs * 1000, std::memory_order_relaxed)) {
+        pending.fetch_add(1, std::memory_order_relaxed);
+        Logger::Instance().suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    skipped = pending.exchange(0, std::memory_order_relaxed);
+    return true;
+}
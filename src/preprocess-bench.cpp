@@ -0,0 +1,53 @@
+#include "bench-util.hpp"
+#include <stdio.h>
+
+// 每种方式送入的帧数
+#define BENCH_FRAMES        300
+
+/**
+ * @brief 用一种颜色转换方式编码BENCH_FRAMES帧
+ *
+ * @param pushMs 平均每帧push耗时（调用线程上的转换开销）
+ * @param fps 从第一帧push到全部编码完成的帧率
+ * @return false 当前环境不支持这种方式
+ */
+static bool Measure(PreprocessMode mode, const cv::Mat& scene, int w, int h, double& pushMs, double& fps)
+{
+    return TryMeasure([&] {
+        VplEncodeModule module("preprocess-bench.h265", w, h, false, IMAGE_QUEUE_SIZE, QueueFullPolicy::BLOCK, mode);
+        double pushTotal = 0;
+        auto start = Clock::now();
+        for (int i = 0; i < BENCH_FRAMES; i++) {
+            cv::Mat image = BenchFrame(scene, w, h, i);
+            auto t = Clock::now();
+            module.push(image);
+            pushTotal += ElapsedMs(t);
+        }
+        WaitEncoded(module, BENCH_FRAMES, start);
+        pushMs = pushTotal / BENCH_FRAMES;
+        fps = module.GetThroughput().encodedFrames * 1000.0 / ElapsedMs(start);
+    });
+}
+
+int main(int argc, char* argv[])
+{
+    int w = 1920, h = 1080;
+    if (argc > 2) {
+        w = atoi(argv[1]);
+        h = atoi(argv[2]);
+    }
+    cv::Mat scene = MakeBenchScene(w, h);
+
+    const PreprocessMode modes[] = { PreprocessMode::NONE, PreprocessMode::SIMD, PreprocessMode::VPP };
+    const char *names[] = { "none", "simd", "vpp" };
+    printf("%dx%d, %d frames\n", w, h, BENCH_FRAMES);
+    printf("%-8s %14s %10s\n", "mode", "push(ms)", "fps");
+    for (int i = 0; i < 3; i++) {
+        double pushMs, fps;
+        if (Measure(modes[i], scene, w, h, pushMs, fps))
+            printf("%-8s %14.3f %10.1f\n", names[i], pushMs, fps);
+        else
+            printf("%-8s %14s %10s\n", names[i], "unsupported", "-");
+    }
+    return 0;
+}
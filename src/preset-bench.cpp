@@ -0,0 +1,59 @@
+#include "bench-util.hpp"
+#include <stdio.h>
+
+// 每个预设送入的帧数
+#define BENCH_FRAMES        300
+
+/**
+ * @brief 用一个预设在软件runtime上编码BENCH_FRAMES帧
+ *
+ * @param firstPacketMs 从第一次push到第一个包完成的耗时，反映AsyncDepth、B帧重排和lookahead带来的延迟
+ * @param fps 从第一帧push到全部编码完成的帧率
+ * @param kbytes 输出总字节数（KB）
+ * @return false 当前环境不支持这个预设
+ */
+static bool Measure(EncoderPreset preset, const cv::Mat& scene, int w, int h, double& firstPacketMs, double& fps,
+                    double& kbytes)
+{
+    return TryMeasure([&] {
+        EncoderConfig config = EncoderConfig::Preset(preset);
+        config.useHardware = false;
+        std::string path = std::string("preset-bench-") + EncoderConfig::PresetName(preset) + ".h265";
+        VplEncodeModule module(path, w, h, false, IMAGE_QUEUE_SIZE, QueueFullPolicy::BLOCK, PreprocessMode::SIMD,
+                               NULL, NULL, config);
+        firstPacketMs = -1;
+        auto start = Clock::now();
+        for (int i = 0; i < BENCH_FRAMES; i++) {
+            module.push(BenchFrame(scene, w, h, i));
+            if (firstPacketMs < 0 && module.GetThroughput().encodedFrames > 0)
+                firstPacketMs = ElapsedMs(start);
+        }
+        WaitEncoded(module, BENCH_FRAMES, start, &firstPacketMs);
+        EncodeThroughput throughput = module.GetThroughput();
+        fps = throughput.encodedFrames * 1000.0 / ElapsedMs(start);
+        kbytes = throughput.encodedBytes / 1024.0;
+    });
+}
+
+int main(int argc, char* argv[])
+{
+    int w = 1920, h = 1080;
+    if (argc > 2) {
+        w = atoi(argv[1]);
+        h = atoi(argv[2]);
+    }
+    cv::Mat scene = MakeBenchScene(w, h);
+
+    const EncoderPreset presets[] = { EncoderPreset::DEFAULT, EncoderPreset::ULTRA_LOW_LATENCY,
+                                      EncoderPreset::REALTIME, EncoderPreset::MAX_THROUGHPUT };
+    printf("%dx%d, %d frames, software runtime\n", w, h, BENCH_FRAMES);
+    printf("%-18s %18s %10s %12s\n", "preset", "first packet(ms)", "fps", "size(KB)");
+    for (EncoderPreset preset : presets) {
+        double firstPacketMs, fps, kbytes;
+        if (Measure(preset, scene, w, h, firstPacketMs, fps, kbytes))
+            printf("%-18s %18.2f %10.1f %12.1f\n", EncoderConfig::PresetName(preset), firstPacketMs, fps, kbytes);
+        else
+            printf("%-18s %18s %10s %12s\n", EncoderConfig::PresetName(preset), "unsupported", "-", "-");
+    }
+    return 0;
+}
@@ -0,0 +1,123 @@
+#include "scene-detector.hpp"
+#include "color-convert.hpp"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCENE_DETECTOR_X86
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2  __attribute__((target("avx2")))
+#endif
+
+static void AccumulateBlockSumsScalar(const uint8_t *row, int blocks, int blockBytes, uint32_t *sums)
+{
+    for (int b = 0; b < blocks; b++) {
+        const uint8_t *p = row + (size_t)b * blockBytes;
+        uint32_t sum = 0;
+        for (int i = 0; i < blockBytes; i++)
+            sum += p[i];
+        sums[b] += sum;
+    }
+}
+
+#ifdef SCENE_DETECTOR_X86
+// 和0做SAD就是8字节求和，每16字节得到两个64位部分和
+TARGET_SSE41 static void AccumulateBlockSumsSSE41(const uint8_t *row, int blocks, int blockBytes, uint32_t *sums)
+{
+    const __m128i zero = _mm_setzero_si128();
+    for (int b = 0; b < blocks; b++) {
+        const uint8_t *p = row + (size_t)b * blockBytes;
+        __m128i acc = zero;
+        for (int i = 0; i < blockBytes; i += 16)
+            acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(p + i)), zero));
+        sums[b] += (uint32_t)(_mm_cvtsi128_si32(acc) + _mm_extract_epi32(acc, 2));
+    }
+}
+
+TARGET_AVX2 static void AccumulateBlockSumsAVX2(const uint8_t *row, int blocks, int blockBytes, uint32_t *sums)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    for (int b = 0; b < blocks; b++) {
+        const uint8_t *p = row + (size_t)b * blockBytes;
+        __m256i acc = zero;
+        for (int i = 0; i < blockBytes; i += 32)
+            acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)(p + i)), zero));
+        __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        sums[b] += (uint32_t)(_mm_cvtsi128_si32(half) + _mm_extract_epi32(half, 2));
+    }
+}
+#endif
+
+void AccumulateBlockSums(const uint8_t *row, int blocks, int blockBytes, uint32_t *sums)
+{
+#ifdef SCENE_DETECTOR_X86
+    ColorConvertIsa isa = GetColorConvertIsa();
+    if (isa == ColorConvertIsa::AVX2 && blockBytes % 32 == 0) {
+        AccumulateBlockSumsAVX2(row, blocks, blockBytes, sums);
+        return;
+    }
+    if (isa != ColorConvertIsa::SCALAR) {
+        AccumulateBlockSumsSSE41(row, blocks, blockBytes, sums);
+        return;
+    }
+#endif
+    AccumulateBlockSumsScalar(row, blocks, blockBytes, sums);
+}
+
+SceneDiff SceneDetector::Analyze(const uint8_t *data, size_t pitch, int width, int height, int bytesPerPixel)
+{
+    int bx = width / SCENE_BLOCK_SIZE;
+    int by = height / SCENE_BLOCK_SIZE;
+    if (bx != blocksX || by != blocksY || bytesPerPixel != this->bytesPerPixel) {
+        blocksX = bx;
+        blocksY = by;
+        this->bytesPerPixel = bytesPerPixel;
+        hasReference = false;   // 大小变了，旧的参考不能比
+    }
+    current.assign((size_t)bx * by, 0);
+
+    int blockBytes = SCENE_BLOCK_SIZE * bytesPerPixel;
+    for (int y = 0; y < by; y++) {
+        uint32_t *sums = &current[(size_t)y * bx];
+        for (int r = 0; r < SCENE_BLOCK_SIZE; r += SCENE_ROW_STEP)
+            AccumulateBlockSums(data + (size_t)(y * SCENE_BLOCK_SIZE + r) * pitch, bx, blockBytes, sums);
+    }
+
+    // 每块参与求和的字节数，块和除以它就是块均值（0~255）
+    uint32_t samples = (uint32_t)blockBytes * (SCENE_BLOCK_SIZE / SCENE_ROW_STEP);
+    memset(currentHistogram, 0, sizeof(currentHistogram));
+    for (uint32_t sum : current)
+        currentHistogram[sum / samples * SCENE_HISTOGRAM_BINS / 256]++;
+
+    SceneDiff diff = {255, 255, 1};
+    if (!hasReference || current.empty())
+        return diff;
+    uint64_t total = 0;
+    uint32_t maxBlock = 0;
+    for (size_t i = 0; i < current.size(); i++) {
+        uint32_t d = (uint32_t)abs((int)current[i] - (int)reference[i]);
+        total += d;
+        maxBlock = std::max(maxBlock, d);
+    }
+    uint32_t histTotal = 0;
+    for (int i = 0; i < SCENE_HISTOGRAM_BINS; i++)
+        histTotal += (uint32_t)abs((int)currentHistogram[i] - (int)referenceHistogram[i]);
+    diff.meanDiff = total / ((double)samples * current.size());
+    diff.maxBlockDiff = (double)maxBlock / samples;
+    diff.histogramDiff = histTotal / (2.0 * current.size());
+    return diff;
+}
+
+void SceneDetector::UpdateReference()
+{
+    reference = current;
+    memcpy(referenceHistogram, currentHistogram, sizeof(referenceHistogram));
+    hasReference = !current.empty();
+}
+
+void SceneDetector::Reset()
+{
+    hasReference = false;
+}
@@ -0,0 +1,159 @@
+#include "session-pool.hpp"
+#include "logger.hpp"
+#include <chrono>
+#include <exception>
+
+SessionPool::SessionPool(size_t defaultWarm)
+    : defaultWarm(defaultWarm)
+{
+    refillThread = std::thread(&SessionPool::RefillLoop, this);
+}
+
+SessionPool::~SessionPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stop = true;
+    }
+    refillCond.notify_all();
+    if (refillThread.joinable())
+        refillThread.join();
+}
+
+void SessionPool::Prepare(const SessionKey& key, size_t count)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        Slot& slot = slots[key];
+        slot.target = count;
+        slot.failed = false;
+    }
+    refillCond.notify_one();
+}
+
+std::unique_ptr<EncoderSession> SessionPool::Acquire(const SessionKey& key)
+{
+    std::unique_ptr<EncoderSession> encoder;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        Slot& slot = slots[key];
+        if (slot.target == 0 && !slot.failed)
+            slot.target = defaultWarm;
+        if (!slot.ready.empty()) {
+            encoder = std::move(slot.ready.back());
+            slot.ready.pop_back();
+            hits++;
+        }
+        else {
+            misses++;
+        }
+    }
+    refillCond.notify_one();
+
+    // 没有预热好的，只能当场创建
+    if (!encoder)
+        encoder = EncoderSession::Open(key);
+    return encoder;
+}
+
+void SessionPool::Release(std::unique_ptr<EncoderSession> encoder)
+{
+    if (!encoder)
+        return;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        released.push_back(std::move(encoder));
+    }
+    refillCond.notify_one();
+}
+
+SessionPoolStatus SessionPool::GetStatus()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    SessionPoolStatus status = {0};
+    for (auto& item : slots)
+        status.readySessions += item.second.ready.size();
+    status.pendingReset = released.size();
+    status.hits = hits;
+    status.misses = misses;
+    status.created = created;
+    status.recycled = recycled;
+    status.avgCreateMs = created ? totalCreateMs / created : 0;
+    return status;
+}
+
+void SessionPool::RefillLoop()
+{
+    for (;;) {
+        std::unique_ptr<EncoderSession> recycle;
+        SessionKey key;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            refillCond.wait(guard, [this, &key] { return stop || !released.empty() || FindShortSlot(key); });
+            if (stop)
+                break;
+            if (!released.empty()) {
+                recycle = std::move(released.back());
+                released.pop_back();
+            }
+            else {
+                slots[key].creating++;
+            }
+        }
+
+        // VPL调用都在锁外做，Acquire和Release不会被阻塞
+        if (recycle) {
+            mfxStatus sts = recycle->Reset();
+            std::unique_ptr<EncoderSession> drop;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                Slot& slot = slots[recycle->key];
+                if (sts == MFX_ERR_NONE && slot.ready.size() + slot.creating < slot.target) {
+                    slot.ready.push_back(std::move(recycle));
+                    recycled++;
+                }
+                else {
+                    drop = std::move(recycle);  // 预热个数已够或重置失败，关闭session
+                }
+            }
+            if (sts != MFX_ERR_NONE)
+                LOG_WARN("reset pooled session failed %d", sts);
+            continue;
+        }
+
+        std::unique_ptr<EncoderSession> encoder;
+        auto start = std::chrono::steady_clock::now();
+        try {
+            encoder = EncoderSession::Open(key);
+        }
+        catch (std::exception&) {
+            LOG_ERROR("prewarm session %dx%d failed", key.width, key.height);
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            Slot& slot = slots[key];
+            slot.creating--;
+            if (encoder) {
+                slot.ready.push_back(std::move(encoder));
+                created++;
+                totalCreateMs += ms;
+            }
+            else {
+                slot.failed = true;     // 配置不被支持，避免反复重试，Prepare后再试
+            }
+        }
+    }
+}
+
+bool SessionPool::FindShortSlot(SessionKey& key)
+{
+    for (auto& item : slots) {
+        const Slot& slot = item.second;
+        if (!slot.failed && slot.ready.size() + slot.creating < slot.target) {
+            key = item.first;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,83 @@
+#include "bench-util.hpp"
+#include "loader-cache.hpp"
+#include "session-pool.hpp"
+#include <stdio.h>
+
+// 等第一个编码包的最长时间
+#define FIRST_PACKET_TIMEOUT_MS     5000
+// 等第一个包期间送帧的间隔
+#define PUSH_INTERVAL_MS            1
+
+/**
+ * @brief 创建一路流并送帧，直到第一个编码包同步完成
+ *
+ * @param constructMs 构造函数耗时
+ * @param firstPacketMs 从第一次push到第一个包完成的耗时，超时为负数
+ */
+static void MeasureStream(const std::string& path, const cv::Mat& scene, int w, int h, double& constructMs,
+                          double& firstPacketMs, SessionPool *sessionPool = NULL)
+{
+    auto start = Clock::now();
+    VplEncodeModule module(path, w, h, false, IMAGE_QUEUE_SIZE, QueueFullPolicy::BLOCK, PreprocessMode::NONE, NULL,
+                           sessionPool);
+    constructMs = ElapsedMs(start);
+
+    // 编码器可能攒几帧才出第一个包，持续送帧直到出包
+    start = Clock::now();
+    firstPacketMs = -1;
+    for (int i = 0; ElapsedMs(start) < FIRST_PACKET_TIMEOUT_MS; i++) {
+        module.push(BenchFrame(scene, w, h, i));
+        if (module.GetThroughput().encodedFrames > 0) {
+            firstPacketMs = ElapsedMs(start);
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(PUSH_INTERVAL_MS));
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int w = 1920, h = 1080, streams = 4;
+    if (argc > 1)
+        streams = atoi(argv[1]);
+    if (argc > 3) {
+        w = atoi(argv[2]);
+        h = atoi(argv[3]);
+    }
+    cv::Mat scene = MakeBenchScene(w, h);
+
+    // 第一次访问缓存：MFXLoad、设置过滤条件、枚举实现
+    LoaderFilter filter;
+    auto start = Clock::now();
+    mfxStatus sts = VplLoaderCache::Instance().Warmup(filter);
+    printf("loader warmup: %.2f ms, sts %d\n", ElapsedMs(start), sts);
+
+    // 之后每路流只剩创建session和初始化编码器
+    printf("%-8s %16s %20s %12s\n", "stream", "construct(ms)", "first packet(ms)", "total(ms)");
+    for (int i = 0; i < streams; i++) {
+        double constructMs, firstPacketMs;
+        MeasureStream("startup-bench-" + std::to_string(i) + ".h265", scene, w, h, constructMs, firstPacketMs);
+        printf("%-8d %16.2f %20.2f %12.2f\n", i, constructMs, firstPacketMs, constructMs + firstPacketMs);
+    }
+
+    // 预热好的session：构造只剩从池里取一个指针
+    SessionPool sessionPool;
+    SessionKey key;
+    key.width = w;
+    key.height = h;
+    sessionPool.Prepare(key, 1);
+    while (sessionPool.GetStatus().readySessions == 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    printf("prewarmed session: %.2f ms to create in background\n", sessionPool.GetStatus().avgCreateMs);
+    for (int i = 0; i < streams; i++) {
+        // 等上一路归还的session重置完再开始下一路
+        while (sessionPool.GetStatus().readySessions == 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        double constructMs, firstPacketMs;
+        MeasureStream("startup-bench-pool-" + std::to_string(i) + ".h265", scene, w, h, constructMs, firstPacketMs,
+                      &sessionPool);
+        printf("%-8s %16.2f %20.2f %12.2f\n", ("pool" + std::to_string(i)).c_str(), constructMs, firstPacketMs,
+               constructMs + firstPacketMs);
+    }
+    return 0;
+}
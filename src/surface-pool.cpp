@@ -0,0 +1,94 @@
+#include "surface-pool.hpp"
+#include <chrono>
+
+SurfacePool::SurfacePool(mfxFrameSurface1 *surfaces, size_t count)
+    : surfaces(surfaces), count(count)
+{
+    freeList.reserve(count);
+    busyList.reserve(count);
+    // 倒序放入，第一次按0,1,2...的顺序取出
+    for (size_t i = count; i-- > 0;)
+        freeList.push_back(i);
+    freeCount = count;
+}
+
+mfxFrameSurface1 *SurfacePool::TryAcquire()
+{
+    // 有新的释放通知，或者空闲链表已经空了，才扫描使用中的surface
+    if (freeList.empty() || reclaimedSeq != releaseSeq.load(std::memory_order_acquire))
+        Reclaim();
+    if (freeList.empty())
+        return NULL;
+
+    size_t index = freeList.back();
+    freeList.pop_back();
+    busyList.push_back(index);
+    freeCount = freeList.size();
+    acquires++;
+    return &surfaces[index];
+}
+
+bool SurfacePool::HasFree()
+{
+    if (freeList.empty() || reclaimedSeq != releaseSeq.load(std::memory_order_acquire))
+        Reclaim();
+    return !freeList.empty();
+}
+
+mfxFrameSurface1 *SurfacePool::Acquire()
+{
+    mfxFrameSurface1 *surface = TryAcquire();
+    if (surface)
+        return surface;
+
+    exhaustions++;
+    auto start = std::chrono::steady_clock::now();
+    while (!(surface = TryAcquire())) {
+        std::unique_lock<std::mutex> guard(lock);
+        uint64_t seq = reclaimedSeq;
+        releasedCond.wait_for(guard, std::chrono::milliseconds(SURFACE_WAIT_TIMEOUT_MS),
+                              [this, seq] { return releaseSeq.load() != seq; });
+    }
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    totalWaitUs += us;
+    if (us > maxWaitUs)
+        maxWaitUs = us;     // 只有编码线程写，不需要CAS
+    return surface;
+}
+
+void SurfacePool::NotifyReleased()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        releaseSeq++;
+    }
+    releasedCond.notify_all();
+}
+
+SurfacePoolStatus SurfacePool::GetStatus() const
+{
+    SurfacePoolStatus status;
+    status.size = count;
+    status.freeSurfaces = freeCount;
+    status.acquires = acquires;
+    status.exhaustions = exhaustions;
+    status.totalWaitMs = totalWaitUs / 1000.0;
+    status.maxWaitMs = maxWaitUs / 1000.0;
+    return status;
+}
+
+void SurfacePool::Reclaim()
+{
+    reclaimedSeq = releaseSeq.load(std::memory_order_acquire);
+    // busyList按取出先后排列，先取出的先放回，最后放回的是最近用过的
+    size_t kept = 0;
+    for (size_t i = 0; i < busyList.size(); i++) {
+        size_t index = busyList[i];
+        if (surfaces[index].Data.Locked == 0)
+            freeList.push_back(index);
+        else
+            busyList[kept++] = index;
+    }
+    busyList.resize(kept);
+    freeCount = freeList.size();
+}
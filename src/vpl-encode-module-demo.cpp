@@ -23,11 +23,16 @@ int main(int argc, char* argv[])
     {
         cv::Mat image;
         cap >> image;
-        v.push(image);
+        // 驱动给的采集时间（毫秒）转成90kHz，拿不到时由模块取push时刻
+        double captureMs = cap.get(cv::CAP_PROP_POS_MSEC);
+        v.push(image, captureMs > 0 ? (mfxU64)(captureMs * 90) : MFX_TIMESTAMP_UNKNOWN);
 
         cv::imshow("image", image);
         if(cv::waitKey(10) == 'q')
             break;
     }
+    LatencyStatus latency = v.GetLatencyStatus();
+    printf("%llu frames, capture to disk avg %.2f ms, max %.2f ms\n", (unsigned long long)latency.frames,
+           latency.total.avgMs, latency.total.maxMs);
     
 }
\ No newline at end of file
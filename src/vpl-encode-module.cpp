@@ -1,756 +1,955 @@
 #include "vpl-encode-module.hpp"
+#include "color-convert.hpp"
+#include "encoder-pool.hpp"
+#include "session-pool.hpp"
+#include "logger.hpp"
+#include "verify.hpp"
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <unistd.h>
 #include <thread>
-#include <queue>
-
-// #define USE_VPP
-
-// 错误检查
-#define VERIFY(x, y)       \
-    if (!(x)) {            \
-        printf("%s\n", y); \
-        throw std::exception();          \
-    }
+#include <chrono>
+#include <algorithm>
 
 // 计算VPL版本
 #define VPLVERSION(major, minor)    (major << 16 | minor)
-// 取整到16和32
-#define ALIGN16(value)              (((value + 15) >> 4) << 4)
-#define ALIGN32(X)                  (((mfxU32)((X) + 31)) & (~(mfxU32)31))
-// 设置输出流大小
-#define BITSTREAM_BUFFER_SIZE       2000000
-
-VplEncodeModule::VplEncodeModule(std::string file_path, int imageWight, int imageHeight)
-{
-    // 1.先load
-    loader = MFXLoad();
-    VERIFY(loader != NULL, "MFXLoad failed -- is implementation in path?");
-
-    // 2.设置vpl配置参数（每个config需要单独配置，用同一个mfxConfig配置多次参数会相互覆盖；config设置在后台实现，因此config不用传给后边）
-	// 2.1.设置编码方式：sw hw
-	mfxConfig implConfig = MFXCreateConfig(loader); // 创建配置文件
-	VERIFY(NULL != implConfig, "MFXCreateConfig failed");
-	mfxVariant implValue = {0};							// 创建参数
-	implValue.Type = MFX_VARIANT_TYPE_U32;			// 设置参数数据类型
-	implValue.Data.U32 = useHardware ? MFX_IMPL_TYPE_HARDWARE : MFX_IMPL_TYPE_SOFTWARE;	//设置参数值
-	sts = MFXSetConfigFilterProperty(implConfig, (mfxU8*)"mfxImplDescription.Impl", implValue);	// 设置参数，中间字符串怎么填看mfxImplDescription或 https://spec.oneapi.io/versions/latest/elements/oneVPL/source/programming_guide/VPL_prg_session.html#onevpl-dispatcher-configuration-properties
-	VERIFY(MFX_ERR_NONE == sts, "MFXSetConfigFilterProperty failed for Impl");
-
-	// 2.2.设置编码器
-	mfxConfig codecConfig = MFXCreateConfig(loader);
-	VERIFY(NULL != codecConfig, "MFXCreateConfig failed");
-	mfxVariant codecValue = {0};
-	codecValue.Type = MFX_VARIANT_TYPE_U32;
-	codecValue.Data.U32 = MFX_CODEC_HEVC;		// 设置CODEC类型：MFX_CODEC_*，具体可以看CodecFormatFourCC
-	sts = MFXSetConfigFilterProperty(codecConfig, (mfxU8*)"mfxImplDescription.mfxEncoderDescription.encoder.CodecID", codecValue);	// 设置参数
-	VERIFY(MFX_ERR_NONE == sts, "MFXSetConfigFilterProperty failed for encoder CodecID");
-
-    mfxConfig memHandleConfig = MFXCreateConfig(loader);
-	VERIFY(NULL != memHandleConfig, "MFXCreateConfig failed");
-	mfxVariant memHandleValue = {0};
-	memHandleValue.Type = MFX_VARIANT_TYPE_U32;
-	memHandleValue.Data.U32 = MFX_RESOURCE_SYSTEM_SURFACE;		// 设置MemHandleType类型：MFX_RESOURCE*，具体可以看mfxResourceType
-	sts = MFXSetConfigFilterProperty(memHandleConfig, (mfxU8*)"mfxImplDescription.mfxEncoderDescription.encoder.encprofile.Profile.encmemdesc.MemHandleType", memHandleValue);	// 设置参数
-	VERIFY(MFX_ERR_NONE == sts, "MFXSetConfigFilterProperty failed for encoder CodecID");
-
-    // mfxConfig codecConfig = MFXCreateConfig(loader);
-	// VERIFY(NULL != implConfig, "MFXCreateConfig failed");
-	// mfxVariant codecValue = {0};
-	// codecValue.Type = MFX_VARIANT_TYPE_U32;
-	// codecValue.Data.U32 = MFX_RESOURCE_SYSTEM_SURFACE;		// 设置MemHandleType类型：MFX_RESOURCE*，具体可以看mfxResourceType
-	// sts = MFXSetConfigFilterProperty(codecConfig, (mfxU8*)"mfxImplDescription.mfxEncoderDescription.encoder.encprofile.Profile.encmemdesc.ColorFormats", codecValue);	// 设置参数
-	// VERIFY(MFX_ERR_NONE == sts, "MFXSetConfigFilterProperty failed for encoder CodecID");
-	
-#ifdef USE_VPP
-    // 2.3.设置vpp Implementation must provide VPP scaling
-    mfxConfig vppCodecConfig = MFXCreateConfig(loader);
-    VERIFY(NULL != vppCodecConfig, "MFXCreateConfig failed");
-    mfxVariant vppCodecValue = {0};
-    vppCodecValue.Type     = MFX_VARIANT_TYPE_U32;
-    vppCodecValue.Data.U32 = MFX_EXTBUFF_VPP_COLOR_CONVERSION;//MFX_EXTBUFF_VPP_SCALING; // 含义查这里 https://spec.oneapi.io/versions/latest/elements/oneVPL/source/programming_guide/VPL_prg_session.html?highlight=mfx_extbuff_vpp_scaling#how-to-search-for-the-available-vpp-filter-implementation
-    sts = MFXSetConfigFilterProperty(vppCodecConfig, (mfxU8 *)"mfxImplDescription.mfxVPPDescription.filter.FilterFourCC", vppCodecValue);
-    VERIFY(MFX_ERR_NONE == sts, "MFXSetConfigFilterProperty failed");
-#endif // USE_VPP
-    // 2.4.设置API版本(可以不用)，关于vpl是如何搜索API版本的，https://spec.oneapi.io/versions/latest/elements/oneVPL/source/programming_guide/VPL_prg_session.html
-	//mfxConfig apiVersionConfig = MFXCreateConfig(loader);
-	//VERIFY(NULL != apiVersionConfig, "MFXCreateConfig failed")
-	//mfxVariant apiVersionValue;
-	//apiVersionValue.Type = MFX_VARIANT_TYPE_U32;
-	//apiVersionValue.Data.U32 = VPLVERSION(2, 7);	// API版本设为2.7
-	//sts = MFXSetConfigFilterProperty(apiVersionConfig, (mfxU8*)"mfxImplDescription.ApiVersion.Version", apiVersionValue);
-	//VERIFY(MFX_ERR_NONE == sts, "MFXSetConfigFilterProperty failed for API version");
-    // 2.5.打印一下最终设置结果
-    ShowImplementationInfo(loader, 0);
-
-    // 3.创建session
-    // 一个loader可以创建多个session，一个session可以具有多条处理流，一个程序可以创建多个loader
-    // 多loader和多处理流 https://spec.oneapi.io/versions/latest/elements/oneVPL/source/programming_guide/VPL_prg_session.html#examples-of-dispatcher-s-usage
-    // 多session https://spec.oneapi.io/versions/latest/elements/oneVPL/source/programming_guide/VPL_prg_session.html#multiple-sessions
-    sts = MFXCreateSession(loader, 0, &session);
-	VERIFY(MFX_ERR_NONE == sts, "Cannot create session -- no implementations meet selection criteria");
-    // 3.1 创建一下加速器 Convenience function to initialize available accelerator(s)
-    accelHandle = InitAcceleratorHandle(session, &accel_fd);
-    // 4.初始化编码器和VPP
-    // 4.1.设置参数 
-    // mfxVideoParam param{0};
-    // encodeParam = param;
-    encodeParam = SetEncodeParam(imageWight, imageHeight);
-    vppParam = SetVPPParam(imageWight, imageHeight);
-    // 4.2.填补和矫正不和里参数
-    // PrintParam(encodeParam);
-    sts = MFXVideoENCODE_Query(session, &encodeParam, &encodeParam);
-    PrintParam(encodeParam);
-    printf("encode sts %d\n", sts);
-    VERIFY(MFX_ERR_NONE == sts, "Encode query failed");
-    // 4.3.创建编码器
-    sts = MFXVideoENCODE_Init(session, &encodeParam);
-    printf("encode sts %d\n", sts);
-    VERIFY(MFX_ERR_NONE == sts, "Encode init failed");
-#ifdef USE_VPP
-    // 4.4.创建vpp
-    sts = MFXVideoVPP_Init(session, &vppParam);
-    VERIFY(MFX_ERR_NONE == sts, "VPP init failed");
-#endif // USE_VPP
-
-    // 5.申请内存
-#ifdef USE_VPP
-    // 5.1.申请VPP内存
-    // 5.1.1.创建IO队列 Query number of required surfaces for VPP
-    mfxFrameAllocRequest VPPRequest[2]  = {};
-    sts = MFXVideoVPP_QueryIOSurf(session, &vppParam, VPPRequest);
-    VERIFY(MFX_ERR_NONE == sts, "Error in QueryIOSurf");
-    // 5.1.2.获取IN和OUT的推荐数量
-    nSurfNumVPPIn  = VPPRequest[0].NumFrameSuggested; // vpp in
-    nSurfNumVPPOut = VPPRequest[1].NumFrameSuggested; // vpp out
-    // 5.1.3.申请In内存大小
-    vppInSurfacePool = (mfxFrameSurface1 *)calloc(sizeof(mfxFrameSurface1), nSurfNumVPPIn);
-
-    sts = AllocateExternalSystemMemorySurfacePool(&vppInBuf,
-                                                  vppInSurfacePool,
-                                                  vppParam.vpp.In,
-                                                  nSurfNumVPPIn);
-    VERIFY(MFX_ERR_NONE == sts, "Error in external surface allocation for VPP in\n");
-    // 5.1.4.申请Out内存大小
-    vppOutSurfacePool = (mfxFrameSurface1 *)calloc(sizeof(mfxFrameSurface1), nSurfNumVPPOut);
-    sts               = AllocateExternalSystemMemorySurfacePool(&vppOutBuf,
-                                                  vppOutSurfacePool,
-                                                  vppParam.vpp.Out,
-                                                  nSurfNumVPPOut);
-    VERIFY(MFX_ERR_NONE == sts, "Error in external surface allocation for VPP out\n");
-#endif // USE_VPP
-
-    // 5.2.申请Encode内存
-    // 5.2.1.申请队列  Query number required surfaces for decoder
-    mfxFrameAllocRequest encRequest = {0};
-    sts = MFXVideoENCODE_QueryIOSurf(session, &encodeParam, &encRequest);
-    VERIFY(MFX_ERR_NONE == sts, "QueryIOSurf failed");
-    nSurfNumEncIn = encRequest.NumFrameSuggested;
-    // 5.2.2.申请输出流大小 Prepare output bitstream
-    bitstream.MaxLength = BITSTREAM_BUFFER_SIZE;
-    bitstream.Data      = (mfxU8 *)malloc(bitstream.MaxLength * sizeof(mfxU8));
-    VERIFY(bitstream.Data != NULL, "calloc bitstream failed");
-    // // 5.2.3.申请输入surface pool，（用不上了，直接用VPP的输出代替）External (application) allocation of decode surfaces
-#ifndef USE_VPP
-    encSurfPool = (mfxFrameSurface1 *)calloc(sizeof(mfxFrameSurface1), nSurfNumEncIn);
-    sts = AllocateExternalSystemMemorySurfacePool(&encOutBuf,
-                                                  encSurfPool,
-                                                  encodeParam.mfx.FrameInfo,
-                                                  nSurfNumEncIn);
-    VERIFY(MFX_ERR_NONE == sts, "Error in external surface allocation\n");
-#endif // USE_VPP
+// 零拷贝时输入Mat首地址要求的对齐字节数
+#define ZERO_COPY_ALIGNMENT         64
+
+VplEncodeModule::VplEncodeModule(std::string file_path, int imageWight, int imageHeight, bool multiProducer,
+                                 size_t queueCapacity, QueueFullPolicy queuePolicy, PreprocessMode preprocess,
+                                 EncoderPool *pool, SessionPool *sessionPool, const EncoderConfig& config)
+    : queuePolicy(queuePolicy)
+{
+    // 自适应GOP和推流模式的IDR位置由场景切换和请求决定，push时推算不出哪些帧不被参考
+    if (queuePolicy == QueueFullPolicy::DROP_NON_REFERENCE && config.gopMode != GopMode::FIXED) {
+        LOG_WARN("DROP_NON_REFERENCE needs GopMode::FIXED, falls back to BLOCK");
+        this->queuePolicy = queuePolicy = QueueFullPolicy::BLOCK;
+    }
+    // 0.输入队列，单生产者时用SPSC队列，多个采集线程时用MPSC队列
+    // DROP_OLDEST需要在生产者线程出队，也要用MPSC队列（出队是CAS，可以和编码线程并发）
+    VERIFY(queueCapacity > 0, "queue capacity must be positive");
+    if (multiProducer || queuePolicy == QueueFullPolicy::DROP_OLDEST)
+        imageQueue.reset(new MpscRing<InputFrame>(queueCapacity));
+    else
+        imageQueue.reset(new SpscRing<InputFrame>(queueCapacity));
+
+    // 1.取编码session：有SessionPool时直接取预先初始化好的，否则当场创建，见EncoderSession::Init
+    SessionKey key;
+    key.width = imageWight;
+    key.height = imageHeight;
+    // NONE时编码器吃RGB4；SIMD时push直接生成YUV；VPP时输入surface为RGB4，由VPP转成编码器的YUV
+    VERIFY(preprocess == PreprocessMode::NONE || config.yuvFourCC == MFX_FOURCC_NV12
+           || config.yuvFourCC == MFX_FOURCC_I420, "yuvFourCC must be NV12 or I420");
+    key.fourCC = preprocess == PreprocessMode::NONE ? MFX_FOURCC_RGB4 : config.yuvFourCC;
+    key.useVpp = preprocess == PreprocessMode::VPP;
+    key.config = config;
+    this->sessionPool = sessionPool;
+    encoder = sessionPool ? sessionPool->Acquire(key) : EncoderSession::Open(key);
+
+    // 5.3.零拷贝用的surface，只有结构体，数据指针在编码时指向输入的Mat
+    if (encoder->inputFrameInfo.FourCC == MFX_FOURCC_RGB4 || encoder->inputFrameInfo.FourCC == MFX_FOURCC_NV12
+        || encoder->inputFrameInfo.FourCC == MFX_FOURCC_I420) {
+        wrapSurfPool.resize(encoder->inputSurfNum);
+        wrapSurfHold.resize(encoder->inputSurfNum);
+        for (mfxU16 i = 0; i < encoder->inputSurfNum; i++) {
+            wrapSurfPool[i]      = { 0 };
+            wrapSurfPool[i].Info = encoder->inputFrameInfo;
+        }
+        wrapSurfaces.reset(new SurfacePool(wrapSurfPool.data(), wrapSurfPool.size()));
+    }
+    if (encoder->key.useVpp) {
+        inputSurfaces.reset(new SurfacePool(encoder->vppInSurfacePool, encoder->nSurfNumVPPIn));
+        vppOutSurfaces.reset(new SurfacePool(encoder->vppOutSurfacePool, encoder->nSurfNumVPPOut));
+    }
+    else {
+        inputSurfaces.reset(new SurfacePool(encoder->encSurfPool, encoder->nSurfNumEncIn));
+    }
+    neutralSurfaces.assign(inputSurfaces->Size(), false);
+    skipCtrl.SkipFrame = 1;
+    idrCtrl.FrameType = MFX_FRAMETYPE_I | MFX_FRAMETYPE_IDR | MFX_FRAMETYPE_REF;
+    // 5.4.输入帧缓冲区，和ConvertFrame的输出布局相同：RGB4为BGRA，NV12/I420为Y加色度平面的单通道整块。
+    // 同时被引用的缓冲区最多是队列里的、零拷贝surface持有的和正在push、正在编码的，按这个数申请，稳态下不临时申请
+    const mfxFrameInfo& info = encoder->inputFrameInfo;
+    size_t bufferCount = imageQueue->Capacity() + wrapSurfPool.size() + FRAME_BUFFER_POOL_EXTRA;
+    if (info.FourCC == MFX_FOURCC_RGB4)
+        frameBuffers.reset(new FrameBufferPool(info.Height, info.Width, CV_8UC4, bufferCount, &frameAllocator));
+    else
+        frameBuffers.reset(new FrameBufferPool(info.Height * 3 / 2, info.Width, CV_8UC1, bufferCount,
+                                               &frameAllocator));
 
     // 6.创建并打开输出文件
     sink = fopen(file_path.c_str(), "wb");
     VERIFY(sink != NULL, "open output file failed");
+    // 6.1.写线程接管文件写入，编码和同步线程不碰磁盘
+    writer.reset(new BitstreamWriter(sink));
+    writer->SetWrittenCallback([this](size_t frames) { TrackWrittenFrames(frames); });
+    // 6.2.每个在途任务一个bit流，最多同时有AsyncDepth帧在编码，见EncodePipeline
+    pipeline.reset(new EncodePipeline(*encoder, *writer));
+    pipeline->SetAcceptedCallback([this] { TrackSubmittedFrame(); });
+    pipeline->SetSyncedCallback([this](const mfxBitstream& bitstream) { TrackSyncedFrame(bitstream); });
+    pipeline->SetReleasedCallback([this] { NotifySurfaceReleased(); });
+
+    // 7.启动同步线程和编码线程，没有帧时阻塞，不占CPU；使用EncoderPool时由pool的工作线程编码
+    pipeline->Start();
+    this->pool = pool;
+    if (pool)
+        pool->Register(this);
+    else
+        encodeThread = std::thread(&VplEncodeModule::EncodeLoop, this);
+}
+
+void VplEncodeModule::push(const cv::Mat& image, mfxU64 timeStamp)
+{
+    if (DropNewestEarly())
+        return;
+
+    InputFrame input;
+    input.pushTime = std::chrono::steady_clock::now();
+    input.timeStamp = timeStamp;
+    if (IsMonoFrame(image)) {
+        // 单色：只保留Y平面，色度在上传到surface时补
+        input.mono = true;
+        if (zeroCopyInput && CanWrapFrame(image, encoder->inputFrameInfo, true)) {
+            input.image = image;
+        }
+        else {
+            input.image = frameBuffers->Acquire()(cv::Rect(0, 0, image.cols, image.rows));
+            CopyPlane(image.data, image.step, input.image.data, input.image.step, image.cols, image.rows);
+        }
+    }
+    else if (zeroCopyInput && CanWrapFrame(image, encoder->inputFrameInfo))
+        input.image = image;    // 零拷贝，只增加引用计数
+    else
+        ConvertFrame(image, input.image);
+    if (!EnqueueFrame(input))
+        return;
+    NotifyFrameArrived();
+}
+
+void VplEncodeModule::push(cv::Mat&& image, mfxU64 timeStamp)
+{
+    bool mono = IsMonoFrame(image);
+    if (!mono && !MatchesSurfaceLayout(image)) {
+        push(static_cast<const cv::Mat&>(image), timeStamp);
+        image.release();
+        return;
+    }
+    if (DropNewestEarly()) {
+        image.release();
+        return;
+    }
+
+    InputFrame input;
+    input.pushTime = std::chrono::steady_clock::now();
+    input.timeStamp = timeStamp;
+    input.image = std::move(image);     // 调用者已放弃这块内存，不转换也不拷贝
+    input.mono = mono;
+    if (!EnqueueFrame(input))
+        return;
+    movedFrames++;
+    NotifyFrameArrived();
+}
+
+void VplEncodeModule::push(const FrameDescriptor& frame)
+{
+    if (DropNewestEarly())
+        return;
+
+    InputFrame input;
+    input.pushTime = std::chrono::steady_clock::now();
+    input.timeStamp = frame.timeStamp;
+    ConvertDescriptor(frame, input.image);
+    if (!EnqueueFrame(input))
+        return;
+    NotifyFrameArrived();
+}
+
+bool VplEncodeModule::DropNewestEarly()
+{
+    // 队列已满且策略为丢新帧时，不用再做颜色转换
+    if (queuePolicy == QueueFullPolicy::DROP_NEWEST && imageQueue->Size() >= imageQueue->Capacity()) {
+        droppedNewest++;
+        return true;
+    }
+    return false;
+}
+
+bool VplEncodeModule::IsMonoFrame(const cv::Mat& image)
+{
+    const mfxFrameInfo& info = encoder->inputFrameInfo;
+    return monoInput && image.type() == CV_8UC1 && image.cols <= info.Width && image.rows <= info.Height
+           && (info.FourCC == MFX_FOURCC_NV12 || info.FourCC == MFX_FOURCC_I420);
+}
+
+bool VplEncodeModule::MatchesSurfaceLayout(const cv::Mat& image)
+{
+    const mfxFrameInfo& info = encoder->inputFrameInfo;
+    if (info.FourCC == MFX_FOURCC_RGB4)   // ReadFrame按行拷贝，行跨度可以不同
+        return image.type() == CV_8UC4 && image.cols <= info.Width && image.rows <= info.Height;
+    // NV12/I420由ReadFrame整块拷贝，必须和surface布局完全相同
+    return image.type() == CV_8UC1 && image.cols == info.Width && image.rows == info.Height * 3 / 2
+           && image.isContinuous();
 }
 
-mfxVideoParam VplEncodeModule::SetEncodeParam(int w, int h)
-{
-    // 参数约束 https://spec.oneapi.io/versions/latest/elements/oneVPL/source/appendix/VPL_apnds_a.html#encode-constraint-table
-    // mfxVideoParam encodeParam = {0}; // 参数解释 https://spec.oneapi.io/versions/latest/elements/oneVPL/source/API_ref/VPL_structs_cross_component.html?highlight=mfxvideoparam#mfxvideoparam
-    // encodeParam.mfx.CodecId = MFX_CODEC_HEVC;  // 编码器
-    // // encodeParam.mfx.CodecProfile = MFX_PROFILE_AVC_CONSTRAINED_BASELINE;   // 使用默认配置参数
-    // // encodeParam.mfx.CodecLevel = MFX_LEVEL_AVC_5;  // 使用的编码器级别
-    // encodeParam.mfx.TargetUsage = MFX_TARGETUSAGE_BALANCED; // 速度和质量的平衡度
-    // encodeParam.mfx.RateControlMethod = MFX_RATECONTROL_VBR; // 可变比特率控制算法
-    // encodeParam.mfx.TargetKbps = 4000; // kbps
-    // encodeParam.mfx.FrameInfo.FrameRateExtN = 30; // 帧率设置 帧率 = FrameRateExtN / FrameRateExtD
-    // encodeParam.mfx.FrameInfo.FrameRateExtD = 1;
-    // encodeParam.mfx.FrameInfo.FourCC = MFX_FOURCC_I420; 
-    // encodeParam.mfx.FrameInfo.ChromaFormat = FourCCToChromaFormat(encodeParam.mfx.FrameInfo.FourCC); // 颜色采样方法
-    // encodeParam.mfx.FrameInfo.CropW = w;  // 原图宽（是ROI，可以比原图小，指定方法{X，Y，W，H})
-    // encodeParam.mfx.FrameInfo.CropH = h; // 原图高
-    // encodeParam.mfx.FrameInfo.Width = ALIGN16(w); // 目标宽 必须为16的倍数
-    // encodeParam.mfx.FrameInfo.Height = ALIGN16(h);   // 目标高 对逐行帧，必须为16的倍数，否则为32的倍数
-    // encodeParam.IOPattern = MFX_IOPATTERN_IN_SYSTEM_MEMORY; // 函数的输入和输出存储器访问类型
-
-    mfxVideoParam encodeParam = {0}; // 参数解释 https://spec.oneapi.io/versions/latest/elements/oneVPL/source/API_ref/VPL_structs_cross_component.html?highlight=mfxvideoparam#mfxvideoparam
-    encodeParam.mfx.CodecId = MFX_CODEC_HEVC;  // 编码器
-    encodeParam.mfx.CodecProfile = MFX_PROFILE_HEVC_MAIN;   // 使用默认配置参数
-    encodeParam.mfx.CodecLevel = MFX_LEVEL_HEVC_4;  // 使用的编码器级别
-    encodeParam.mfx.TargetUsage = MFX_TARGETUSAGE_BALANCED; // 速度和质量的平衡度
-    encodeParam.mfx.RateControlMethod = MFX_RATECONTROL_VBR; //MFX_RATECONTROL_CQP; // 可变比特率控制算法
-    encodeParam.mfx.TargetKbps = 4000; //4000; // kbps
-    encodeParam.mfx.MaxKbps = 0; //30000;
-    encodeParam.mfx.BufferSizeInKB = 20000;
-    encodeParam.mfx.GopPicSize = 3;
-    encodeParam.mfx.GopRefDist = 1;
-    encodeParam.mfx.GopOptFlag = MFX_GOP_CLOSED;
-    encodeParam.mfx.IdrInterval= 0;
-    encodeParam.mfx.ICQQuality = 1; // 使用MFX_RATECONTROL_ICQ算法时有用,范围1-51,1为最佳
-    encodeParam.mfx.InitialDelayInKB = 5;
-    encodeParam.mfx.Accuracy = 5;
-    encodeParam.mfx.FrameInfo.FrameRateExtN = 10; // 帧率设置 帧率 = FrameRateExtN / FrameRateExtD
-    encodeParam.mfx.FrameInfo.FrameRateExtD = 1;
-    encodeParam.mfx.FrameInfo.FourCC = MFX_FOURCC_RGB4; //MFX_FOURCC_I010; //MFX_FOURCC_P010; //MFX_FOURCC_NV16;//MFX_FOURCC_I422; //MFX_FOURCC_I420; //MFX_FOURCC_IYUV; //MFX_FOURCC_NV12; //MFX_FOURCC_RGB4; 
-    encodeParam.mfx.FrameInfo.ChromaFormat = FourCCToChromaFormat(encodeParam.mfx.FrameInfo.FourCC); // 颜色采样方法
-    encodeParam.mfx.FrameInfo.CropX = 0;
-    encodeParam.mfx.FrameInfo.CropY = 0;
-    encodeParam.mfx.FrameInfo.CropW = w;  // 原图宽（是ROI，可以比原图小，指定方法{X，Y，W，H})
-    encodeParam.mfx.FrameInfo.CropH = h; // 原图高
-    encodeParam.mfx.FrameInfo.Width = ALIGN32(w); // 目标宽 必须为16的倍数
-    encodeParam.mfx.FrameInfo.Height = ALIGN32(h);   // 目标高 对逐行帧，必须为16的倍数，否则为32的倍数
-    encodeParam.mfx.FrameInfo.PicStruct = MFX_PICSTRUCT_PROGRESSIVE; // 像素格式 MFX_PICSTRUCT_PROGRESSIVE逐行扫描
-    encodeParam.mfx.FrameInfo.AspectRatioW = 0;
-    encodeParam.mfx.FrameInfo.AspectRatioH = 0;
-    // encodeParam.mfx.FrameInfo.BitDepthLuma = 8; // 使用多少位表示亮度
-    // encodeParam.mfx.FrameInfo.BitDepthChroma = 24; // 使用多少位表示色度
-    encodeParam.AsyncDepth = 3;
-    encodeParam.IOPattern = MFX_IOPATTERN_IN_SYSTEM_MEMORY; // 函数的输入和输出存储器访问类型
-
-    return encodeParam;
-}
-
-mfxVideoParam VplEncodeModule::SetVPPParam(int w, int h)
-{
-    mfxVideoParam vppParam = {0}; // 必须用0初始化，防止有些参数出现未知值
-    vppParam.IOPattern = MFX_IOPATTERN_IN_SYSTEM_MEMORY | MFX_IOPATTERN_OUT_SYSTEM_MEMORY;
-    vppParam.vpp.In.FourCC = MFX_FOURCC_RGB4;
-    vppParam.vpp.In.ChromaFormat  = FourCCToChromaFormat(vppParam.vpp.In.FourCC);
-    vppParam.vpp.In.CropX         = 0;
-    vppParam.vpp.In.CropY         = 0;
-    vppParam.vpp.In.CropW         = w;
-    vppParam.vpp.In.CropH         = h;
-    vppParam.vpp.In.PicStruct     = MFX_PICSTRUCT_PROGRESSIVE;
-    vppParam.vpp.In.FrameRateExtN = 30;
-    vppParam.vpp.In.FrameRateExtD = 1;
-    vppParam.vpp.In.Width = vppParam.vpp.Out.Width = ALIGN16(w);
-    vppParam.vpp.In.Height = vppParam.vpp.Out.Height = ALIGN16(h);
-
-    vppParam.vpp.Out.FourCC = MFX_FOURCC_I420;
-    vppParam.vpp.Out.ChromaFormat  = FourCCToChromaFormat(vppParam.vpp.Out.FourCC);
-    vppParam.vpp.Out.CropX         = 0;
-    vppParam.vpp.Out.CropY         = 0;
-    vppParam.vpp.Out.CropW         = w;
-    vppParam.vpp.Out.CropH         = h;
-    vppParam.vpp.Out.PicStruct     = MFX_PICSTRUCT_PROGRESSIVE;
-    vppParam.vpp.Out.FrameRateExtN = 30;
-    vppParam.vpp.Out.FrameRateExtD = 1;
-    vppParam.vpp.Out.Width = vppParam.vpp.Out.Width = ALIGN16(w);
-    vppParam.vpp.Out.Height = vppParam.vpp.Out.Height = ALIGN16(h);
-
-    return vppParam;
-}
-
-void VplEncodeModule::PrintParam(mfxVideoParam param)
-{
-    printf("mfxVideoParam.AllocId: %d\n", param.AllocId);
-    printf("mfxVideoParam.AsyncDepth: %d\n", param.AsyncDepth);
-    printf("mfxVideoParam.Protected: %d\n", param.Protected);
-    printf("mfxVideoParam.NumExtParam: %d\n", param.NumExtParam);
-    printf("mfxVideoParam.IOPattern: %d\n\n", param.IOPattern);
-    
-    printf("mfxVideoParam.mfx.CodecId: %d\n", param.mfx.CodecId);
-    printf("mfxVideoParam.mfx.CodecProfile: %d\n", param.mfx.CodecProfile);
-    printf("mfxVideoParam.mfx.CodecLevel: %d\n", param.mfx.CodecLevel);
-    printf("mfxVideoParam.mfx.TargetUsage: %d\n", param.mfx.TargetUsage);
-    printf("mfxVideoParam.mfx.RateControlMethod: %d\n", param.mfx.RateControlMethod);
-    printf("mfxVideoParam.mfx.TargetKbps: %d\n\n", param.mfx.TargetKbps);
-    
-    printf("mfxVideoParam.mfx.LowPower: %d\n", param.mfx.LowPower);
-    printf("mfxVideoParam.mfx.BRCParamMultiplier: %d\n", param.mfx.BRCParamMultiplier);
-    printf("mfxVideoParam.mfx.GopPicSize: %d\n", param.mfx.GopPicSize);
-    printf("mfxVideoParam.mfx.GopRefDist: %d\n", param.mfx.GopRefDist);
-    printf("mfxVideoParam.mfx.GopOptFlag: %d\n", param.mfx.GopOptFlag);
-    printf("mfxVideoParam.mfx.IdrInterval: %d\n", param.mfx.IdrInterval);
-    printf("mfxVideoParam.mfx.InitialDelayInKB: %d\n", param.mfx.InitialDelayInKB);
-    printf("mfxVideoParam.mfx.QPI: %d\n", param.mfx.QPI);
-    printf("mfxVideoParam.mfx.Accuracy: %d\n", param.mfx.Accuracy);
-    printf("mfxVideoParam.mfx.BufferSizeInKB: %d\n", param.mfx.BufferSizeInKB);
-    printf("mfxVideoParam.mfx.QPP: %d\n", param.mfx.QPP);
-    printf("mfxVideoParam.mfx.ICQQuality: %d\n", param.mfx.ICQQuality);
-    printf("mfxVideoParam.mfx.MaxKbps: %d\n", param.mfx.MaxKbps);
-    printf("mfxVideoParam.mfx.QPB: %d\n", param.mfx.QPB);
-    printf("mfxVideoParam.mfx.Convergence: %d\n", param.mfx.Convergence);
-    printf("mfxVideoParam.mfx.NumSlice: %d\n", param.mfx.NumSlice);
-    printf("mfxVideoParam.mfx.NumRefFrame: %d\n", param.mfx.NumRefFrame);
-    printf("mfxVideoParam.mfx.EncodedOrder: %d\n", param.mfx.EncodedOrder);
-    printf("mfxVideoParam.mfx.DecodedOrder: %d\n", param.mfx.DecodedOrder);
-    printf("mfxVideoParam.mfx.ExtendedPicStruct: %d\n", param.mfx.ExtendedPicStruct);
-    printf("mfxVideoParam.mfx.TimeStampCalc: %d\n", param.mfx.TimeStampCalc);
-    printf("mfxVideoParam.mfx.SliceGroupsPresent: %d\n", param.mfx.SliceGroupsPresent);
-    printf("mfxVideoParam.mfx.MaxDecFrameBuffering: %d\n", param.mfx.MaxDecFrameBuffering);
-    printf("mfxVideoParam.mfx.EnableReallocRequest: %d\n", param.mfx.EnableReallocRequest);
-    printf("mfxVideoParam.mfx.FilmGrain: %d\n", param.mfx.FilmGrain);
-    printf("mfxVideoParam.mfx.IgnoreLevelConstrain: %d\n", param.mfx.IgnoreLevelConstrain);
-    printf("mfxVideoParam.mfx.SkipOutput: %d\n", param.mfx.SkipOutput);
-    printf("mfxVideoParam.mfx.Interleaved: %d\n", param.mfx.Interleaved);
-    printf("mfxVideoParam.mfx.Quality: %d\n", param.mfx.Quality);
-    printf("mfxVideoParam.mfx.RestartInterval: %d\n\n", param.mfx.RestartInterval);
-    
-    printf("mfxVideoParam.mfx.FrameInfo.FourCC: %d\n", param.mfx.FrameInfo.FourCC);
-    printf("mfxVideoParam.mfx.FrameInfo.ChromaFormat: %d\n", param.mfx.FrameInfo.ChromaFormat);
-    printf("mfxVideoParam.mfx.FrameInfo.CropX: %d\n", param.mfx.FrameInfo.CropX);
-    printf("mfxVideoParam.mfx.FrameInfo.CropY: %d\n", param.mfx.FrameInfo.CropY);
-    printf("mfxVideoParam.mfx.FrameInfo.CropW: %d\n", param.mfx.FrameInfo.CropW);
-    printf("mfxVideoParam.mfx.FrameInfo.CropH: %d\n", param.mfx.FrameInfo.CropH);
-    printf("mfxVideoParam.mfx.FrameInfo.Width: %d\n", param.mfx.FrameInfo.Width);
-    printf("mfxVideoParam.mfx.FrameInfo.Height: %d\n", param.mfx.FrameInfo.Height);
-    printf("mfxVideoParam.mfx.FrameInfo.FrameRateExtN: %d\n", param.mfx.FrameInfo.FrameRateExtN);
-    printf("mfxVideoParam.mfx.FrameInfo.FrameRateExtD: %d\n", param.mfx.FrameInfo.FrameRateExtD);
-    printf("mfxVideoParam.mfx.FrameInfo.AspectRatioW: %d\n", param.mfx.FrameInfo.AspectRatioW);
-    printf("mfxVideoParam.mfx.FrameInfo.AspectRatioH: %d\n", param.mfx.FrameInfo.AspectRatioH);
-    printf("mfxVideoParam.mfx.FrameInfo.ChannelId: %d\n", param.mfx.FrameInfo.ChannelId);
-    printf("mfxVideoParam.mfx.FrameInfo.BitDepthLuma: %d\n", param.mfx.FrameInfo.BitDepthLuma);
-    printf("mfxVideoParam.mfx.FrameInfo.BitDepthChroma: %d\n", param.mfx.FrameInfo.BitDepthChroma);
-    printf("mfxVideoParam.mfx.FrameInfo.Shift: %d\n", param.mfx.FrameInfo.Shift);
-    printf("mfxVideoParam.mfx.FrameInfo.FrameId: %d\n", param.mfx.FrameInfo.Shift);
-    printf("mfxVideoParam.mfx.FrameInfo.BufferSize: %d\n", param.mfx.FrameInfo.Shift);
-    printf("mfxVideoParam.mfx.FrameInfo.PicStruct: %d\n", param.mfx.FrameInfo.PicStruct);
-    
-}
-
-void VplEncodeModule::push(cv::Mat image)
-{
-    cv::Mat input;
-    if(image.elemSize() == 3)
+void VplEncodeModule::ConvertFrame(const cv::Mat& image, cv::Mat& input)
+{
+    const mfxFrameInfo& info = encoder->inputFrameInfo;
+    bool fits = image.cols <= info.Width && image.rows <= info.Height;
+    input.allocator = &frameAllocator;  // 比surface大的图走不了缓冲池，也从FrameArena申请
+
+    if (info.FourCC == MFX_FOURCC_NV12 || info.FourCC == MFX_FOURCC_I420) {
+        // Y平面之后紧跟UV（NV12）或U、V（I420）平面，行跨度为Width，和surface pool的布局相同
+        VERIFY(fits, "input image larger than surface");
+        input = frameBuffers->Acquire();
+        cv::Mat bgr = image;
+        if (image.channels() == 4)
+            cv::cvtColor(image, bgr, cv::COLOR_BGRA2BGR);
+        else if (image.channels() == 1)
+            cv::cvtColor(image, bgr, cv::COLOR_GRAY2BGR);
+        mfxU8 *y = input.data;
+        mfxU8 *u = y + (size_t)info.Width * info.Height;
+        if (info.FourCC == MFX_FOURCC_NV12)
+            ConvertBGRToNV12(bgr.data, bgr.step, y, info.Width, u, info.Width, bgr.cols, bgr.rows);
+        else
+            ConvertBGRToI420(bgr.data, bgr.step, y, info.Width, u, u + (size_t)(info.Width / 2) * (info.Height / 2),
+                             info.Width / 2, bgr.cols, bgr.rows);
+        return;
+    }
+
+    // RGB4：写进按surface对齐的缓冲区里，编码线程可以直接引用，不用再逐行拷贝
+    if (fits) {
+        input = frameBuffers->Acquire()(cv::Rect(0, 0, image.cols, image.rows));
+    }
+    if (image.elemSize() == 3 && fits)
+        ConvertBGRToRGB4(image.data, image.step, input.data, input.step, image.cols, image.rows);
+    else if (image.elemSize() == 3)
         cv::cvtColor(image, input, cv::COLOR_BGR2BGRA);
-    else if(image.elemSize() == 1)
+    else if (image.elemSize() == 1)
         cv::cvtColor(image, input, cv::COLOR_GRAY2BGRA);
     else
         image.copyTo(input);
-    std::lock_guard<std::mutex> lock(imageQueueLock);
-    imageQueue.push(input);
+}
 
-    if(!start){
-        std::thread t(&VplEncodeModule::EncodeLoop, this);
-        t.detach();
-        start = true;
+void VplEncodeModule::ConvertDescriptor(const FrameDescriptor& frame, cv::Mat& input)
+{
+    const mfxFrameInfo& info = encoder->inputFrameInfo;
+    VERIFY(frame.width <= info.Width && frame.height <= info.Height, "input frame larger than surface");
+    if (frame.fourCC == MFX_FOURCC_RGB4) {
+        // 只是不带Mat的BGRA图像，和push(const cv::Mat&)走同样的转换
+        cv::Mat bgra(frame.height, frame.width, CV_8UC4, const_cast<mfxU8*>(frame.planes[0]), frame.pitches[0]);
+        ConvertFrame(bgra, input);
+        return;
+    }
+    VERIFY(frame.fourCC == MFX_FOURCC_NV12 || frame.fourCC == MFX_FOURCC_I420, "unsupported input FourCC");
+    VERIFY(info.FourCC == MFX_FOURCC_NV12 || info.FourCC == MFX_FOURCC_I420,
+           "YUV input needs PreprocessMode::SIMD");
+
+    // 缓冲区布局同ConvertFrame：Y平面后紧跟UV（NV12）或U、V（I420），亮度行跨度为Width
+    input = frameBuffers->Acquire();
+    mfxU8 *y      = input.data;
+    mfxU8 *chroma = y + (size_t)info.Width * info.Height;
+    CopyPlane(frame.planes[0], frame.pitches[0], y, info.Width, frame.width, frame.height);
+    if (info.FourCC == MFX_FOURCC_NV12) {
+        if (frame.fourCC == MFX_FOURCC_NV12)
+            CopyPlane(frame.planes[1], frame.pitches[1], chroma, info.Width, frame.width, frame.height / 2);
+        else
+            ConvertI420ToNV12Chroma(frame.planes[1], frame.pitches[1], frame.planes[2], frame.pitches[2],
+                                    chroma, info.Width, frame.width, frame.height);
+        return;
+    }
+    mfxU8 *u = chroma;
+    mfxU8 *v = u + (size_t)(info.Width / 2) * (info.Height / 2);
+    if (frame.fourCC == MFX_FOURCC_I420) {
+        CopyPlane(frame.planes[1], frame.pitches[1], u, info.Width / 2, frame.width / 2, frame.height / 2);
+        CopyPlane(frame.planes[2], frame.pitches[2], v, info.Width / 2, frame.width / 2, frame.height / 2);
+    }
+    else {
+        ConvertNV12ToI420Chroma(frame.planes[1], frame.pitches[1], u, v, info.Width / 2, frame.width, frame.height);
     }
 }
 
-VplEncodeModule::~VplEncodeModule()
+bool VplEncodeModule::EnqueueFrame(InputFrame& input)
 {
-    isStillGoing = false;
-    while (start) usleep(1e2); // 等待进程结束
+    input.enqueueTime = std::chrono::steady_clock::now();
+    if (input.timeStamp == MFX_TIMESTAMP_UNKNOWN) {
+        // 没给采集时间时用push时刻，90kHz，保证每帧的时间戳不同，出bit流后还能对应回这一帧
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(input.pushTime - startTime).count();
+        input.timeStamp = (mfxU64)us * 9 / 100;
+    }
+    input.frameOrder = nextFrameOrder++;
+    input.pushIndex = pushedFrames;
+    switch (queuePolicy) {
+        case QueueFullPolicy::DROP_NEWEST:
+            if (!imageQueue->TryPush(input)) {
+                droppedNewest++;
+                return false;
+            }
+            break;
+        case QueueFullPolicy::DROP_OLDEST:
+            while (!imageQueue->TryPush(input)) {
+                InputFrame oldest;
+                if (imageQueue->TryPop(oldest))
+                    droppedOldest++;
+            }
+            break;
+        case QueueFullPolicy::DROP_NON_REFERENCE:
+            if (imageQueue->TryPush(input))
+                break;
+            if (IsDisposableFrame(input.pushIndex)) {
+                droppedNonReference++;
+                return false;
+            }
+            // 参考帧不能丢，和BLOCK一样等待
+            PushBlocking(input);
+            break;
+        case QueueFullPolicy::BLOCK:
+        default:
+            PushBlocking(input);
+            break;
+    }
+    pushedFrames++;
+    return true;
+}
+
+bool VplEncodeModule::IsDisposableFrame(uint64_t order)
+{
+    // 还没生效的IDR请求会在队列里的某一帧重启GOP；静止帧DROP不送编码器，会让编码器的帧数落后于入队序号
+    if (keyFrameRequested || staticMode == StaticSceneMode::DROP)
+        return false;
+    uint64_t gopStart = gopStartIndex;
+    if (order < gopStart)
+        return false;
+    order -= gopStart;
+    mfxU16 gopSize = encoder->encodeParam.mfx.GopPicSize;
+    mfxU16 refDist = encoder->encodeParam.mfx.GopRefDist;
+    uint64_t pos = gopSize ? order % gopSize : order;
+    if (pos == 0)
+        return false; // I帧
+    if (refDist > 1 && pos % refDist != 0)
+        return true;  // B帧（未开启B金字塔时不作参考）
+    // 封闭GOP里下一个I帧之前的最后一帧，后面没有帧会参考它
+    return gopSize && (encoder->encodeParam.mfx.GopOptFlag & MFX_GOP_CLOSED) && pos == (uint64_t)gopSize - 1;
+}
+
+void VplEncodeModule::PushBlocking(InputFrame& input)
+{
+    if (imageQueue->TryPush(input))
+        return;
+    std::unique_lock<std::mutex> lock(eventLock);
+    producersWaiting++;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    spaceCond.wait(lock, [this, &input] { return imageQueue->TryPush(input); });
+    producersWaiting--;
+}
 
-    if (session) {
-        MFXVideoENCODE_Close(session);
-#ifdef USE_VPP
-        MFXVideoVPP_Close(session);
-#endif // USE_VPP
-        MFXClose(session);
+// 生产者和编码线程各自“先写队列/标志，再读对方的标志/队列”，中间的seq_cst fence保证
+// 两边至少有一方能看到对方的写入，既不会丢唤醒，也不用在每次入队出队时加锁
+void VplEncodeModule::NotifyFrameArrived()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (pool) {
+        pool->Schedule(this);
+        return;
     }
+    if (encoderWaiting.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(eventLock);
+        eventCond.notify_one();
+    }
+}
 
-    if (vppInBuf || vppInSurfacePool) {
-        FreeExternalSystemMemorySurfacePool(vppInBuf, vppInSurfacePool);
+void VplEncodeModule::NotifySpaceAvailable()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (producersWaiting.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> lock(eventLock);
+        spaceCond.notify_all();
     }
+}
 
-    if (vppOutBuf || vppOutSurfacePool) {
-        FreeExternalSystemMemorySurfacePool(vppOutBuf, vppOutSurfacePool);
+bool VplEncodeModule::WaitForFrame()
+{
+    if (imageQueue->Size() > 0)
+        return true;
+    std::unique_lock<std::mutex> lock(eventLock);
+    encoderWaiting.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    eventCond.wait(lock, [this] { return imageQueue->Size() > 0 || !isStillGoing || surfaceReleased; });
+    encoderWaiting.store(false, std::memory_order_relaxed);
+    surfaceReleased = false;
+    return imageQueue->Size() > 0 || isStillGoing;
+}
+
+InputQueueStatus VplEncodeModule::GetInputQueueStatus() const
+{
+    InputQueueStatus status;
+    status.depth = imageQueue->Size();
+    status.capacity = imageQueue->Capacity();
+    status.pushedFrames = pushedFrames;
+    status.droppedOldest = droppedOldest;
+    status.droppedNewest = droppedNewest;
+    status.droppedNonReference = droppedNonReference;
+    status.movedFrames = movedFrames;
+    status.bufferMisses = frameBuffers->GetStatus().misses;
+    return status;
+}
+
+EncodeThroughput VplEncodeModule::GetThroughput() const
+{
+    EncodePipelineStatus status = pipeline->GetStatus();
+    EncodeThroughput throughput;
+    throughput.encodedFrames = status.encodedFrames;
+    throughput.encodedBytes = status.encodedBytes;
+    throughput.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    throughput.framesPerSecond = throughput.seconds > 0 ? throughput.encodedFrames / throughput.seconds : 0;
+    return throughput;
+}
+
+BitstreamWriterStatus VplEncodeModule::GetWriterStatus()
+{
+    return writer->GetStatus();
+}
+
+SurfacePoolStatus VplEncodeModule::GetSurfacePoolStatus() const
+{
+    SurfacePoolStatus total = {0};
+    for (const SurfacePool *pool : {inputSurfaces.get(), vppOutSurfaces.get(), wrapSurfaces.get()}) {
+        if (!pool)
+            continue;
+        SurfacePoolStatus status = pool->GetStatus();
+        total.size += status.size;
+        total.freeSurfaces += status.freeSurfaces;
+        total.acquires += status.acquires;
+        total.exhaustions += status.exhaustions;
+        total.totalWaitMs += status.totalWaitMs;
+        total.maxWaitMs = std::max(total.maxWaitMs, status.maxWaitMs);
+    }
+    return total;
+}
+
+VplEncodeModule::~VplEncodeModule()
+{
+    {
+        std::lock_guard<std::mutex> lock(eventLock);
+        isStillGoing = false;
+    }
+    eventCond.notify_all();
+    if (encodeThread.joinable())
+        encodeThread.join(); // 等待编码线程编完剩余帧后退出
+    if (pool) {
+        // 等工作线程放手后，在当前线程编完剩余帧
+        pool->Unregister(this);
+        ReleaseWrappedFrames();
+        while (imageQueue->Size() > 0)
+            EncodeOneFrame();
+        pipeline->Drain();
+        pipeline->Stop();
+    }
+
+    // 编码已经排空，bit流缓冲区还给session
+    pipeline.reset();
+    if (encoder) {
+        if (sessionPool)
+            sessionPool->Release(std::move(encoder));
+        else
+            encoder.reset();
     }
 
-    if (bitstream.Data)
-        free(bitstream.Data);
+    writer.reset(); // 写完剩余数据再关闭文件
 
     if(sink)
         fclose(sink);
+}
 
-    FreeAcceleratorHandle(accelHandle, accel_fd);
+void VplEncodeModule::EncodeLoop()
+{
+    while (WaitForFrame()) {
+        ReleaseWrappedFrames();
+        if (imageQueue->Size() == 0)
+            continue; // 只是同步线程通知有surface释放
+        EncodeOneFrame();
+    }
+    pipeline->Drain();
+    pipeline->Stop();
+}
 
-    if (loader)
-        MFXUnload(loader);
+size_t VplEncodeModule::EncodeStep(size_t maxFrames)
+{
+    ReleaseWrappedFrames();
+    size_t n = 0;
+    // 资源不够时不在工作线程上等，让给其他流
+    while (n < maxFrames && imageQueue->Size() > 0 && CanEncodeFrame()) {
+        EncodeOneFrame();
+        n++;
+    }
+    return n;
 }
 
-void VplEncodeModule::EncodeLoop()
+void VplEncodeModule::EncodeOneFrame()
 {
-    bool temp = true;
-    while (isStillGoing) {
-        timeval tv1;
-        gettimeofday(&tv1, nullptr);
-#ifdef USE_VPP
-        // Load a new frame if not draining
-        // 先把图读到vpp里，转I420
-        while( (nIndexVPPInSurf = GetFreeSurfaceIndex(vppInSurfacePool, nSurfNumVPPIn)) < 0 ) usleep(1e3); // Find free input frame surface
-        printf("get input free index %d\n", nIndexVPPInSurf);
-
-        sts = ReadFrame(&vppInSurfacePool[nIndexVPPInSurf]);
+    if (encoder->key.useVpp) {
+        sts = VppOneFrame();
+    }
+    else {
+        mfxFrameSurface1 *encInSurface = NULL;
+        sts = ReadFrame(*inputSurfaces, &encInSurface);
+        if (sts == MFX_ERR_MORE_DATA)
+            return; // 静止帧已丢掉
         if(sts != MFX_ERR_NONE) {
-            usleep(1e3);
-            continue;
-            printf("no image\n");
+            LOG_EVERY_MS(LOG_LEVEL_WARN, LOG_FRAME_INTERVAL_MS, "no image");
+            return;
         }
-        printf("have image %d\n", (int)!noImage);
-        // 先取得一个vpp out surface，存放vpp输出结果
-        while( (nIndexVPPOutSurf = GetFreeSurfaceIndex(vppOutSurfacePool, nSurfNumVPPOut)) < 0) usleep(1e3); // Find free output frame surface
-        printf("get output free index %d\n", nIndexVPPOutSurf);
-
-        sts = MFXVideoVPP_RunFrameVPPAsync( session,
-                                            (noImage == true) ? NULL : &vppInSurfacePool[nIndexVPPInSurf],
-                                            &vppOutSurfacePool[nIndexVPPOutSurf], //&vppOutSurfacePool[nIndexVPPOutSurf],
-                                            NULL,
-                                            &syncp);
-        printf("VPP OK, sts %d\n", sts);
-        switch (sts)
-        {
+        readTiming.uploadTime = std::chrono::steady_clock::now();
+        sts = pipeline->Encode(encInSurface, frameCtrl);
+    }
+    LOG_EVERY_MS(LOG_LEVEL_DEBUG, LOG_FRAME_INTERVAL_MS, "encode sts %d", sts);
+    switch (sts) {
         case MFX_ERR_NONE:
-            // printf("VPP: MFX_ERR_NONE\n");
+            // MFX_ERR_NONE and syncp indicate output is available
+            // 输出由同步线程等待完成后写入文件，这里直接提交下一帧
+            break;
+        case MFX_ERR_NOT_ENOUGH_BUFFER:
+            // EncodePipeline已经扩容重试过，到这里说明超过了BITSTREAM_MAX_BUFFER_SIZE
+            LOG_EVERY_MS(LOG_LEVEL_WARN, LOG_FRAME_INTERVAL_MS, "ENCODE : MFX_ERR_NOT_ENOUGH_BUFFER, frame dropped");
             break;
         case MFX_ERR_MORE_DATA:
-            // printf("VPP : MFX_ERR_MORE_DATA\n");
-            continue;
+            // printf("ENCODE : MFX_ERR_MORE_DATA\n");
             // The function requires more data to generate any output
             break;
+        case MFX_ERR_DEVICE_LOST:
+            // printf("ENCODE : MFX_ERR_DEVICE_LOST\n");
+            // For non-CPU implementations,
+            // Cleanup if device is lost
+            break;
+        case MFX_ERR_INCOMPATIBLE_VIDEO_PARAM:
+            // printf("ENCODE : MFX_ERR_INCOMPATIBLE_VIDEO_PARAM\n");
+            break;
         default:
             break;
-        }
-        sts = MFXVideoENCODE_EncodeFrameAsync(session,
-                                              NULL,
-                                              (noImage == true) ? NULL : &vppOutSurfacePool[nIndexVPPOutSurf],
-                                              &bitstream,
-                                              &syncp);
-
-        if(temp){
-            mfxVideoParam param;
-            MFXVideoENCODE_GetVideoParam(session, &param);
-            printf("************************************************");
-            PrintParam(param);
-            printf("************************************************");
-            temp = false;
-        }
-#else 
-        // Load a new frame if not draining
-        // 先把图读到vpp里，转I420
-        while( (nIndexEncInSurf = GetFreeSurfaceIndex(encSurfPool, nSurfNumEncIn)) < 0 ) usleep(1e3); // Find free input frame surface
-        printf("get input free index %d\n", nIndexEncInSurf);
-
-        sts = ReadFrame(&encSurfPool[nIndexEncInSurf]);
-        if(sts != MFX_ERR_NONE) {
-            usleep(1e3);
-            continue;
-            printf("no image\n");
-        }
-        printf("have image %d\n", (int)!noImage);
-        sts = MFXVideoENCODE_EncodeFrameAsync(session,
-                                              NULL,
-                                              (noImage == true) ? NULL : &encSurfPool[nIndexEncInSurf],
-                                              &bitstream,
-                                              &syncp);
-#endif // USE_VPP
-        printf("Encode OK, sts %d\n", sts);
-        switch (sts) {
-            case MFX_ERR_NONE:
-                // MFX_ERR_NONE and syncp indicate output is available
-                if (syncp) {
-                    // Encode output is not available on CPU until sync operation completes
-                    sts = MFXVideoCORE_SyncOperation(session, syncp, 100 * 1000);
-                    VERIFY(MFX_ERR_NONE == sts, "MFXVideoCORE_SyncOperation error");
-
-                    WriteEncodedStream(bitstream, sink);
-                    printf("write encode stream\n");
-                    timeval tv2;
-                    gettimeofday(&tv2, nullptr);
-                    printf("%lf ms\n", (tv2.tv_sec - tv1.tv_sec) * 1e3 + (tv2.tv_usec - tv1.tv_usec) * 1e-3);
-                }
-                break;
-            case MFX_ERR_NOT_ENOUGH_BUFFER:
-                // printf("ENCODE : MFX_ERR_NOT_ENOUGH_BUFFER\n");
-                // This example deliberatly uses a large output buffer with immediate write to disk
-                // for simplicity.
-                // Handle when frame size exceeds available buffer here
-                break;
-            case MFX_ERR_MORE_DATA:
-                // printf("ENCODE : MFX_ERR_MORE_DATA\n");
-                // The function requires more data to generate any output
-                break;
-            case MFX_ERR_DEVICE_LOST:
-                // printf("ENCODE : MFX_ERR_DEVICE_LOST\n");
-                // For non-CPU implementations,
-                // Cleanup if device is lost
-                break;
-            case MFX_WRN_DEVICE_BUSY:
-                // printf("ENCODE : MFX_WRN_DEVICE_BUSY\n");
-                // For non-CPU implementations,
-                // Wait a few milliseconds then try again
-                break;
-            case MFX_ERR_INCOMPATIBLE_VIDEO_PARAM:
-                // printf("ENCODE : MFX_ERR_INCOMPATIBLE_VIDEO_PARAM\n");
-                break;
-            default:
-                break;
-        }
-        printf("loop end\n");
-        usleep(1e3);
     }
-    start = false;
 }
 
-// 读一帧
-mfxStatus VplEncodeModule::ReadFrame(mfxFrameSurface1* surface) {
-
-    cv::Mat RGB4;
-    {
-        std::lock_guard<std::mutex> lock(imageQueueLock);
-        if(imageQueue.empty()) {
-            noImage = true;
-            return MFX_ERR_UNKNOWN;
-        }
-        RGB4 = imageQueue.front();
-        imageQueue.pop();
-        noImage = false;
-        printf("get one frame\n");
+mfxStatus VplEncodeModule::VppOneFrame()
+{
+    // 先把图读到vpp里，转NV12/I420
+    mfxFrameSurface1 *vppInSurface = NULL;
+    mfxStatus status = ReadFrame(*inputSurfaces, &vppInSurface);
+    if (status == MFX_ERR_MORE_DATA)
+        return status; // 静止帧已丢掉
+    if(status != MFX_ERR_NONE) {
+        LOG_EVERY_MS(LOG_LEVEL_WARN, LOG_FRAME_INTERVAL_MS, "no image");
+        return MFX_ERR_MORE_DATA;
     }
-
-    mfxU16 w, h, i, pitch;
-    size_t bytes_read;
-    mfxU8* ptr;
-    mfxFrameInfo* info = &surface->Info;
-    mfxFrameData* data = &surface->Data;
- 
-    w = info->Width;
-    h = info->Height;
-    switch (info->FourCC) {
-    case MFX_FOURCC_RGB4:
-        pitch = data->Pitch;
-        for (i = 0; i < h; i++) {
-            memcpy(data->B + i * pitch, RGB4.data + i * RGB4.step, 1 * pitch);
-        }
-        break;
-    default:
-        printf("Unsupported FourCC code, skip LoadRawFrame\n");
-        break;
+    readTiming.uploadTime = std::chrono::steady_clock::now();
+    // 先取得一个vpp out surface，存放vpp输出结果
+    mfxFrameSurface1 *vppOutSurface = vppOutSurfaces->Acquire(); // Find free output frame surface
+    if (frameCtrl == &skipCtrl) {
+        // 跳帧不读surface内容，不用VPP转换
+        vppOutSurface->Data.TimeStamp = vppInSurface->Data.TimeStamp;
+        vppOutSurface->Data.FrameOrder = vppInSurface->Data.FrameOrder;
+        return pipeline->Encode(vppOutSurface, &skipCtrl);
     }
 
-    return MFX_ERR_NONE;
+    // VPP和Encode在同一个session中，runtime会处理两者的依赖，VPP的输出不需要同步，
+    // 两个调用都立即返回，上一帧还在编码时这一帧的VPP已经可以开始
+    mfxSyncPoint vppSyncp = NULL;
+    for (;;) {
+        status = MFXVideoVPP_RunFrameVPPAsync(encoder->session, vppInSurface, vppOutSurface, NULL, &vppSyncp);
+        if (status != MFX_WRN_DEVICE_BUSY)
+            break;
+        pipeline->WaitDeviceBusy();
+    }
+    if (status != MFX_ERR_NONE) {
+        // MFX_ERR_MORE_DATA：VPP需要更多输入才能输出，这一帧没有交给编码器
+        LOG_EVERY_MS(LOG_LEVEL_DEBUG, LOG_FRAME_INTERVAL_MS, "VPP sts %d", status);
+        return status;
+    }
+    status = pipeline->Encode(vppOutSurface, frameCtrl);
+
+    if(!vppParamPrinted){
+        mfxVideoParam param;
+        MFXVideoENCODE_GetVideoParam(encoder->session, &param);
+        LOG_DEBUG("actual encode param after first frame:");
+        EncoderSession::PrintParam(param);
+        vppParamPrinted = true;
+    }
+    return status;
 }
 
-int VplEncodeModule::GetFreeSurfaceIndex(mfxFrameSurface1 *SurfacesPool, mfxU16 nPoolSize) {
-    for (mfxU16 i = 0; i < nPoolSize; i++) {
-        if (0 == SurfacesPool[i].Data.Locked)
-            return i;
+void VplEncodeModule::NotifySurfaceReleased()
+{
+    {
+        std::lock_guard<std::mutex> lock(eventLock);
+        surfaceReleased = true;
     }
-    return MFX_ERR_NOT_FOUND;
+    eventCond.notify_all();
+    inputSurfaces->NotifyReleased();
+    if (vppOutSurfaces)
+        vppOutSurfaces->NotifyReleased();
+    if (wrapSurfaces)
+        wrapSurfaces->NotifyReleased();
+    // EncodeStep可能因为没有空闲surface或任务提前返回
+    if (pool && imageQueue->Size() > 0)
+        pool->Schedule(this);
 }
 
-// Write encoded stream to file
-void VplEncodeModule::WriteEncodedStream(mfxBitstream& bs, FILE* f) {
-    fwrite(bs.Data + bs.DataOffset, 1, bs.DataLength, f);
-    bs.DataLength = 0;
-    return;
+bool VplEncodeModule::CanEncodeFrame()
+{
+    size_t pending = pipeline->PendingTasks();
+    if (pending == 0)
+        return true;
+    if (pending >= pipeline->TaskCount())
+        return false;
+    // 不知道这一帧会不会走零拷贝，可能用到的池都要有空闲
+    return inputSurfaces->HasFree() && (!vppOutSurfaces || vppOutSurfaces->HasFree())
+           && (!wrapSurfaces || wrapSurfaces->HasFree());
 }
 
-// 查看Impl最终配置
-void VplEncodeModule::ShowImplementationInfo(mfxLoader loader, mfxU32 implnum) {
-    mfxImplDescription* idesc = nullptr;
-    mfxStatus sts;
+void VplEncodeModule::TrackSubmittedFrame()
+{
+    readTiming.submitTime = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(latencyLock);
+    encodingTimings.push_back(readTiming);
+    // runtime没有把TimeStamp带到bit流时对应不上，只保留最近的一些
+    if (encodingTimings.size() > pipeline->TaskCount() * 4 + 16)
+        encodingTimings.pop_front();
+}
 
-    // Loads info about implementation at specified list location
-    sts = MFXEnumImplementations(loader, implnum, MFX_IMPLCAPS_IMPLDESCSTRUCTURE, (mfxHDL*)&idesc);
-    if (!idesc || (sts != MFX_ERR_NONE)) {
-        printf("cannot get mfxHDL, MFXEnumImplementations return %d\n", sts);
-        return;
+void VplEncodeModule::TrackSyncedFrame(const mfxBitstream& bitstream)
+{
+    if (bitstream.DataLength == 0)
+        return; // 写线程不会收下空的bit流
+    lastTimeStamp.store(bitstream.TimeStamp, std::memory_order_relaxed);
+    lastDecodeTimeStamp.store(bitstream.DecodeTimeStamp, std::memory_order_relaxed);
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(latencyLock);
+    // B帧重排后输出顺序和提交顺序不同，按TimeStamp找回这一帧
+    FrameTiming timing = {};
+    auto it = std::find_if(encodingTimings.begin(), encodingTimings.end(),
+                           [&bitstream](const FrameTiming& t) { return t.timeStamp == bitstream.TimeStamp; });
+    if (it != encodingTimings.end()) {
+        timing = *it;
+        encodingTimings.erase(it);
     }
+    timing.syncTime = now;
+    writingTimings.push_back(timing);
+}
 
-    printf("Implementation details:\n");
-    printf("  ApiVersion:           %hu.%hu  \n", idesc->ApiVersion.Major, idesc->ApiVersion.Minor);
-    printf("  Implementation type:  %s\n", (idesc->Impl == MFX_IMPL_TYPE_SOFTWARE) ? "SW" : "HW");
-    printf("  AccelerationMode via: ");
-    switch (idesc->AccelerationMode) {
-    case MFX_ACCEL_MODE_NA:
-        printf("NA \n");
-        break;
-    case MFX_ACCEL_MODE_VIA_D3D9:
-        printf("D3D9\n");
-        break;
-    case MFX_ACCEL_MODE_VIA_D3D11:
-        printf("D3D11\n");
-        break;
-    case MFX_ACCEL_MODE_VIA_VAAPI:
-        printf("VAAPI\n");
-        break;
-    case MFX_ACCEL_MODE_VIA_VAAPI_DRM_MODESET:
-        printf("VAAPI_DRM_MODESET\n");
-        break;
-    case MFX_ACCEL_MODE_VIA_VAAPI_GLX:
-        printf("VAAPI_GLX\n");
-        break;
-    case MFX_ACCEL_MODE_VIA_VAAPI_X11:
-        printf("VAAPI_X11\n");
-        break;
-    case MFX_ACCEL_MODE_VIA_VAAPI_WAYLAND:
-        printf("VAAPI_WAYLAND\n");
-        break;
-    case MFX_ACCEL_MODE_VIA_HDDLUNITE:
-        printf("HDDLUNITE\n");
-        break;
-    default:
-        printf("unknown\n");
-        break;
+static void RecordStage(LatencyHistogram& histogram, std::chrono::steady_clock::time_point from,
+                        std::chrono::steady_clock::time_point to)
+{
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(to - from).count();
+    histogram.Record(us > 0 ? (uint64_t)us : 0);
+}
+
+void VplEncodeModule::TrackWrittenFrames(size_t frames)
+{
+    auto now = std::chrono::steady_clock::now();
+    // 写线程按Submit顺序写盘，writingTimings也按同样的顺序排着；锁只管出队，记录在锁外
+    for (size_t i = 0; i < frames; i++) {
+        FrameTiming t;
+        {
+            std::lock_guard<std::mutex> lock(latencyLock);
+            if (writingTimings.empty())
+                return;
+            t = writingTimings.front();
+            writingTimings.pop_front();
+        }
+        if (!t.tracked)
+            continue;
+        RecordStage(convertLatency, t.pushTime, t.enqueueTime);
+        RecordStage(queueWaitLatency, t.enqueueTime, t.dequeueTime);
+        RecordStage(uploadLatency, t.dequeueTime, t.uploadTime);
+        RecordStage(encodeLatency, t.uploadTime, t.submitTime);
+        RecordStage(syncLatency, t.submitTime, t.syncTime);
+        RecordStage(writeLatency, t.syncTime, now);
+        RecordStage(totalLatency, t.pushTime, now);
     }
-    MFXDispReleaseImplDescription(loader, idesc);
+}
 
-    // Show implementation path, added in 2.4 API
-    mfxHDL implPath = nullptr;
-    sts = MFXEnumImplementations(loader, implnum, MFX_IMPLCAPS_IMPLPATH, &implPath);
-    if (!implPath || (sts != MFX_ERR_NONE))
-        return;
+LatencyStatus VplEncodeModule::GetLatencyStatus() const
+{
+    LatencyStatus status;
+    status.convert = convertLatency.Snapshot();
+    status.queueWait = queueWaitLatency.Snapshot();
+    status.upload = uploadLatency.Snapshot();
+    status.encode = encodeLatency.Snapshot();
+    status.sync = syncLatency.Snapshot();
+    status.write = writeLatency.Snapshot();
+    status.total = totalLatency.Snapshot();
+    status.frames = status.total.count;
+    status.lastTimeStamp = lastTimeStamp.load(std::memory_order_relaxed);
+    status.lastDecodeTimeStamp = lastDecodeTimeStamp.load(std::memory_order_relaxed);
+    return status;
+}
+
+EncoderStats VplEncodeModule::GetStats() const
+{
+    EncoderStats stats;
+    EncodeThroughput throughput = GetThroughput();
+    stats.seconds = throughput.seconds;
+    stats.encodedFrames = throughput.encodedFrames;
+    stats.framesPerSecond = throughput.framesPerSecond;
+    stats.bytesOut = throughput.encodedBytes;
+    stats.queueDepth = imageQueue->Size();
+    stats.queueCapacity = imageQueue->Capacity();
+    stats.droppedFrames = droppedOldest + droppedNewest + droppedNonReference;
+    stats.staticFrames = skippedStaticFrames + droppedStaticFrames;
+    stats.surfaceExhaustions = GetSurfacePoolStatus().exhaustions;
+    EncodePipelineStatus pipelineStatus = pipeline->GetStatus();
+    stats.deviceBusy = pipelineStatus.deviceBusy;
+    stats.lostFrames = pipelineStatus.lostFrames;
+    stats.latency = GetLatencyStatus();
+    return stats;
+}
 
-    printf("  Path: %s\n\n", reinterpret_cast<mfxChar*>(implPath));
-    MFXDispReleaseImplDescription(loader, implPath);
-}
-
-void* VplEncodeModule::InitAcceleratorHandle(mfxSession session, int *fd) {
-    mfxIMPL impl;
-    mfxStatus sts = MFXQueryIMPL(session, &impl);
-    if (sts != MFX_ERR_NONE)
-        return NULL;
-
-#ifdef LIBVA_SUPPORT
-    if ((impl & MFX_IMPL_VIA_VAAPI) == MFX_IMPL_VIA_VAAPI) {
-        if (!fd)
-            return NULL;
-        VADisplay va_dpy = NULL;
-        // initialize VAAPI context and set session handle (req in Linux)
-        *fd = open("/dev/dri/renderD128", O_RDWR);
-        if (*fd >= 0) {
-            va_dpy = vaGetDisplayDRM(*fd);
-            if (va_dpy) {
-                int major_version = 0, minor_version = 0;
-                if (VA_STATUS_SUCCESS == vaInitialize(va_dpy, &major_version, &minor_version)) {
-                    MFXVideoCORE_SetHandle(session,
-                                           static_cast<mfxHandleType>(MFX_HANDLE_VA_DISPLAY),
-                                           va_dpy);
-                }
+// 读一帧
+mfxStatus VplEncodeModule::ReadFrame(SurfacePool& pool, mfxFrameSurface1 **surface) {
+
+    InputFrame frame;
+    if (!imageQueue->TryPop(frame))
+        return MFX_ERR_UNKNOWN;
+    NotifySpaceAvailable();
+    LOG_EVERY_MS(LOG_LEVEL_TRACE, LOG_FRAME_INTERVAL_MS, "get one frame %llu", (unsigned long long)frame.frameOrder);
+    readTiming = {};
+    readTiming.tracked = true;
+    readTiming.timeStamp = frame.timeStamp;
+    readTiming.pushTime = frame.pushTime;
+    readTiming.enqueueTime = frame.enqueueTime;
+    readTiming.dequeueTime = std::chrono::steady_clock::now();
+
+    frameCtrl = NULL;
+    uint64_t order = readFrames++;
+    StaticSceneMode mode = staticMode;
+    bool adaptiveGop = encoder->key.config.gopMode == GopMode::ADAPTIVE;
+    bool keyFrame = keyFrameRequested.exchange(false);
+    if (keyFrame)
+        requestedKeyFrames++;
+    if (mode != StaticSceneMode::OFF || adaptiveGop) {
+        SceneDiff diff = AnalyzeFrame(frame);
+        // 要求关键帧时不能跳过
+        if (mode != StaticSceneMode::OFF && !keyFrame && diff.maxBlockDiff < staticThreshold) {
+            if (mode == StaticSceneMode::DROP) {
+                droppedStaticFrames++;
+                *surface = NULL;
+                return MFX_ERR_MORE_DATA;
             }
+            // dummy跳帧不读surface内容，取一个surface带上时间戳即可，不用上传
+            *surface = pool.Acquire();
+            StampSurface(*surface, frame);
+            frameCtrl = &skipCtrl;
+            skippedStaticFrames++;
+            return MFX_ERR_NONE;
+        }
+        // 这一帧会完整编码，作为之后比较的参考
+        sceneDetector.UpdateReference();
+        // 第一帧本来就是IDR
+        if (adaptiveGop && order > 0 && diff.meanDiff >= SCENE_CUT_DIFF_THRESHOLD
+            && diff.histogramDiff >= SCENE_CUT_HISTOGRAM_THRESHOLD) {
+            sceneCuts++;
+            keyFrame = true;
         }
-        return va_dpy;
     }
-#endif
+    if (keyFrame) {
+        frameCtrl = &idrCtrl;
+        forcedKeyFrames++;
+        gopStartIndex = frame.pushIndex;   // 编码器从这一帧重新开始GOP
+    }
 
-    return NULL;
-}
+    if (frame.mono) {
+        mfxStatus sts = ReadMonoFrame(pool, frame.image, surface);
+        StampSurface(*surface, frame);
+        return sts;
+    }
+
+    // 内存布局和surface一致时直接让surface指向Mat，不再拷贝
+    if (CanWrapFrame(frame.image, encoder->inputFrameInfo)) {
+        *surface = WrapFrame(frame.image);
+        StampSurface(*surface, frame);
+        return MFX_ERR_NONE;
+    }
 
-mfxStatus VplEncodeModule::AllocateExternalSystemMemorySurfacePool(mfxU8 **buf,
-                                                  mfxFrameSurface1 *surfpool,
-                                                  mfxFrameInfo frame_info,
-                                                  mfxU16 surfnum) {
-    // initialize surface pool (I420, RGB4 format)
-    mfxU32 surfaceSize = GetSurfaceSize(frame_info.FourCC, frame_info.Width, frame_info.Height);
-    if (!surfaceSize)
-        return MFX_ERR_MEMORY_ALLOC;
+    *surface = pool.Acquire();
+    StampSurface(*surface, frame);
+    neutralSurfaces[pool.Index(*surface)] = false;  // 色度会被整帧覆盖
+    const cv::Mat& RGB4 = frame.image;
 
-    size_t framePoolBufSize = static_cast<size_t>(surfaceSize) * surfnum;
-    *buf                    = reinterpret_cast<mfxU8 *>(calloc(framePoolBufSize, 1));
+    mfxU16 h, i, pitch;
+    mfxFrameInfo* info = &(*surface)->Info;
+    mfxFrameData* data = &(*surface)->Data;
+ 
+    h = std::min<int>(info->Height, RGB4.rows);
+    switch (info->FourCC) {
+    case MFX_FOURCC_RGB4:
+        pitch = data->Pitch;
+        for (i = 0; i < h; i++) {
+            memcpy(data->B + i * pitch, RGB4.ptr(i), std::min<size_t>(pitch, RGB4.cols * RGB4.elemSize()));
+        }
+        break;
+    case MFX_FOURCC_NV12:
+    case MFX_FOURCC_I420:
+        // ConvertFrame输出的Mat和surface布局一样，整块拷贝
+        memcpy(data->Y, RGB4.data, std::min<size_t>(RGB4.total(), (size_t)info->Width * info->Height * 3 / 2));
+        break;
+    default:
+        LOG_EVERY_MS(LOG_LEVEL_WARN, LOG_FRAME_INTERVAL_MS, "Unsupported FourCC code, skip LoadRawFrame");
+        break;
+    }
 
-    mfxU16 surfW;
-    mfxU16 surfH = frame_info.Height;
+    return MFX_ERR_NONE;
+}
 
-    if (frame_info.FourCC == MFX_FOURCC_RGB4) {
-        surfW = frame_info.Width * 4;
+void VplEncodeModule::StampSurface(mfxFrameSurface1 *surface, const InputFrame& frame)
+{
+    surface->Data.TimeStamp = frame.timeStamp;
+    surface->Data.FrameOrder = (mfxU32)frame.frameOrder;
+}
 
-        for (mfxU32 i = 0; i < surfnum; i++) {
-            surfpool[i]            = { 0 };
-            surfpool[i].Info       = frame_info;
-            size_t buf_offset      = static_cast<size_t>(i) * surfaceSize;
-            surfpool[i].Data.B     = *buf + buf_offset;
-            surfpool[i].Data.G     = surfpool[i].Data.B + 1;
-            surfpool[i].Data.R     = surfpool[i].Data.B + 2;
-            surfpool[i].Data.A     = surfpool[i].Data.B + 3;
-            surfpool[i].Data.Pitch = surfW;
+mfxStatus VplEncodeModule::ReadMonoFrame(SurfacePool& pool, cv::Mat& image, mfxFrameSurface1 **surface)
+{
+    const mfxFrameInfo& info = encoder->inputFrameInfo;
+    size_t chromaSize = (size_t)info.Width * info.Height / 2;
+
+    if (CanWrapFrame(image, info, true)) {
+        if (neutralChroma.empty()) {
+            neutralChroma.allocator = &frameAllocator;
+            neutralChroma.create(1, (int)chromaSize, CV_8UC1);
+            memset(neutralChroma.data, 128, chromaSize);
         }
-    }
-    else {
-        surfW = (frame_info.FourCC == MFX_FOURCC_P010) ? frame_info.Width * 2 : frame_info.Width;
-
-        for (mfxU32 i = 0; i < surfnum; i++) {
-            surfpool[i]            = { 0 };
-            surfpool[i].Info       = frame_info;
-            size_t buf_offset      = static_cast<size_t>(i) * surfaceSize;
-            surfpool[i].Data.Y     = *buf + buf_offset;
-            surfpool[i].Data.U     = *buf + buf_offset + (surfW * surfH);
-            surfpool[i].Data.V     = surfpool[i].Data.U + ((surfW / 2) * (surfH / 2));
-            surfpool[i].Data.Pitch = surfW;
+        *surface = WrapFrame(image);
+        // WrapFrame按整块布局算出的色度指针在image之外，改指向共用的色度平面
+        mfxFrameData& data = (*surface)->Data;
+        if (info.FourCC == MFX_FOURCC_NV12) {
+            data.UV = neutralChroma.data;
+            data.U  = data.UV;
+            data.V  = data.UV + 1;
         }
+        else {
+            data.U = neutralChroma.data;
+            data.V = data.U + (info.Width / 2) * (info.Height / 2);
+        }
+        return MFX_ERR_NONE;
     }
 
+    *surface = pool.Acquire();
+    mfxFrameData& data = (*surface)->Data;
+    CopyPlane(image.data, image.step, data.Y, data.Pitch, image.cols, std::min<int>(image.rows, info.Height));
+    // 拷贝输入的surface色度平面紧跟Y平面，填过一次之后只要不被彩色帧覆盖就不用再填
+    size_t index = pool.Index(*surface);
+    if (!neutralSurfaces[index]) {
+        memset(data.Y + (size_t)data.Pitch * info.Height, 128, chromaSize);
+        neutralSurfaces[index] = true;
+    }
     return MFX_ERR_NONE;
 }
 
-mfxU32 VplEncodeModule::GetSurfaceSize(mfxU32 FourCC, mfxU32 width, mfxU32 height) {
-    mfxU32 nbytes = 0;
+SceneDiff VplEncodeModule::AnalyzeFrame(const InputFrame& frame)
+{
+    const cv::Mat& image = frame.image;
+    // 只比较亮度（Y平面）或BGRA，NV12/I420整块的后1/3是色度
+    int rows = image.rows;
+    if (!frame.mono && image.type() == CV_8UC1)
+        rows = std::min<int>(image.rows, encoder->inputFrameInfo.Height);
+    auto start = std::chrono::steady_clock::now();
+    SceneDiff diff = sceneDetector.Analyze(image.data, image.step, image.cols, rows, (int)image.elemSize());
+    analyzeUs += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    analyzedFrames++;
+    lastSceneDiff = diff.maxBlockDiff;
+    lastMeanDiff = diff.meanDiff;
+    lastHistogramDiff = diff.histogramDiff;
+    return diff;
+}
 
-    switch (FourCC) {
-        case MFX_FOURCC_I420:
-        case MFX_FOURCC_NV12:
-            nbytes = width * height + (width >> 1) * (height >> 1) + (width >> 1) * (height >> 1);
-            break;
-        case MFX_FOURCC_I010:
-        case MFX_FOURCC_P010:
-            nbytes = width * height + (width >> 1) * (height >> 1) + (width >> 1) * (height >> 1);
-            nbytes *= 2;
-            break;
-        case MFX_FOURCC_RGB4:
-            nbytes = width * height * 4;
-            break;
-        default:
-            break;
-    }
+bool VplEncodeModule::CanWrapFrame(const cv::Mat& image, const mfxFrameInfo& info, bool mono)
+{
+    if (wrapSurfPool.empty())
+        return false;
+    size_t rows;
+    if (mono)
+        rows = info.Height;         // 只有Y平面
+    else if (info.FourCC == MFX_FOURCC_RGB4 && image.type() == CV_8UC4)
+        rows = info.Height;
+    else if ((info.FourCC == MFX_FOURCC_NV12 || info.FourCC == MFX_FOURCC_I420) && image.type() == CV_8UC1)
+        rows = info.Height * 3 / 2; // ConvertFrame输出的Y+UV整块
+    else
+        return false;
+    // 行跨度必须等于surface的Pitch
+    if (image.step[0] != (size_t)info.Width * image.elemSize())
+        return false;
+    if (reinterpret_cast<uintptr_t>(image.data) % ZERO_COPY_ALIGNMENT != 0)
+        return false;
+    // 编码器按对齐后的Height读取，Mat背后的内存要覆盖到这里
+    return image.datalimit - image.data >= (ptrdiff_t)(image.step[0] * rows);
+}
 
-    return nbytes;
+mfxFrameSurface1 *VplEncodeModule::WrapFrame(cv::Mat& image)
+{
+    mfxFrameSurface1 *surface = wrapSurfaces->Acquire();
+    size_t index = wrapSurfaces->Index(surface);
+    wrapSurfHold[index] = image;    // 上一帧Data.Locked已经归零，在这里释放
+    EncoderSession::MapSurfaceData(surface, image.data);
+    return surface;
 }
 
-void VplEncodeModule::FreeExternalSystemMemorySurfacePool(mfxU8 *buf, mfxFrameSurface1 *surfpool) {
-    if (buf)
-        free(buf);
+void VplEncodeModule::ReleaseWrappedFrames()
+{
+    for (size_t i = 0; i < wrapSurfPool.size(); i++) {
+        if (wrapSurfPool[i].Data.Locked == 0 && !wrapSurfHold[i].empty())
+            wrapSurfHold[i].release();
+    }
+}
 
-    if (surfpool)
-        free(surfpool);
+void VplEncodeModule::SetZeroCopyInput(bool enable)
+{
+    zeroCopyInput = enable;
 }
 
-void VplEncodeModule::FreeAcceleratorHandle(void *accelHandle, int fd) {
-#ifdef LIBVA_SUPPORT
-    if (accelHandle) {
-        vaTerminate((VADisplay)accelHandle);
-    }
-    if (fd) {
-        close(fd);
+void VplEncodeModule::SetStaticSceneSkip(StaticSceneMode mode, double threshold)
+{
+    // 丢帧会缩短裸码流的播放时长，不能替使用者决定，不支持跳帧时不检测
+    if (mode == StaticSceneMode::SKIP && !encoder->skipFrameSupported) {
+        LOG_WARN("encoder does not support skip frames, static frames are encoded normally");
+        mode = StaticSceneMode::OFF;
     }
-#endif
+    staticThreshold = threshold;
+    staticMode = mode;
 }
 
-mfxU16 VplEncodeModule::FourCCToChromaFormat(mfxU32 fourCC)
+StaticSceneStatus VplEncodeModule::GetStaticSceneStatus() const
 {
-    switch(fourCC)
-    {
-    case MFX_FOURCC_NV12:
-    case MFX_FOURCC_P010:
-    case MFX_FOURCC_P016:
-        return MFX_CHROMAFORMAT_YUV420;
-    case MFX_FOURCC_NV16:
-    case MFX_FOURCC_P210:
-    case MFX_FOURCC_Y210:
-    case MFX_FOURCC_Y216:
-    case MFX_FOURCC_YUY2:
-    case MFX_FOURCC_UYVY:
-        return MFX_CHROMAFORMAT_YUV422;
-    case MFX_FOURCC_Y410:
-    case MFX_FOURCC_A2RGB10:
-    case MFX_FOURCC_AYUV:
-    case MFX_FOURCC_RGB4:
-        return MFX_CHROMAFORMAT_YUV444;
-    }
+    StaticSceneStatus status;
+    status.analyzedFrames = analyzedFrames;
+    status.skippedFrames = skippedStaticFrames;
+    status.droppedFrames = droppedStaticFrames;
+    status.staticFrames = status.skippedFrames + status.droppedFrames;
+    status.lastDiff = lastSceneDiff;
+    status.analyzeMs = analyzeUs / 1000.0;
+    return status;
+}
 
-    return MFX_CHROMAFORMAT_YUV420;
+void VplEncodeModule::RequestKeyFrame()
+{
+    keyFrameRequested = true;
 }
+
+GopStatus VplEncodeModule::GetGopStatus() const
+{
+    GopStatus status;
+    status.sceneCuts = sceneCuts;
+    status.requestedKeyFrames = requestedKeyFrames;
+    status.forcedKeyFrames = forcedKeyFrames;
+    status.lastMeanDiff = lastMeanDiff;
+    status.lastHistogramDiff = lastHistogramDiff;
+    EncodePipelineStatus pipelineStatus = pipeline->GetStatus();
+    status.maxKeyFrameBytes = pipelineStatus.maxKeyFrameBytes;
+    status.maxInterFrameBytes = pipelineStatus.maxInterFrameBytes;
+    return status;
+}
+
+void VplEncodeModule::SetMonoInput(bool enable)
+{
+    if (enable && encoder->inputFrameInfo.FourCC != MFX_FOURCC_NV12 && encoder->inputFrameInfo.FourCC != MFX_FOURCC_I420)
+        LOG_WARN("mono input needs PreprocessMode::SIMD, gray frames are still converted");
+    monoInput = enable;
+}
+
@@ -0,0 +1,257 @@
+#include "vpl-ladder-encode-module.hpp"
+#include "color-convert.hpp"
+#include "session-pool.hpp"
+#include "logger.hpp"
+#include "verify.hpp"
+#include <string.h>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+VplLadderEncodeModule::VplLadderEncodeModule(const std::vector<Rendition>& renditions, int imageWidth,
+                                             int imageHeight, bool multiProducer, size_t queueCapacity,
+                                             SessionPool *sessionPool)
+    : sessionPool(sessionPool)
+{
+    VERIFY(!renditions.empty(), "ladder needs at least one rendition");
+    VERIFY(queueCapacity > 0, "queue capacity must be positive");
+
+    // 0.输入队列，满时push阻塞
+    if (multiProducer)
+        imageQueue.reset(new MpscRing<InputFrame>(queueCapacity));
+    else
+        imageQueue.reset(new SpscRing<InputFrame>(queueCapacity));
+
+    // 1.每路输出一个session：VPP从共用的RGB4输入缩放成自己的大小，再交给同一session里的编码器
+    size_t inputSurfNum = 0;
+    for (const Rendition& rendition : renditions) {
+        VERIFY(rendition.config.yuvFourCC == MFX_FOURCC_NV12 || rendition.config.yuvFourCC == MFX_FOURCC_I420,
+               "yuvFourCC must be NV12 or I420");
+        SessionKey key;
+        key.width = imageWidth;
+        key.height = imageHeight;
+        key.fourCC = rendition.config.yuvFourCC;
+        key.useVpp = true;
+        key.outWidth = rendition.width;
+        key.outHeight = rendition.height;
+        key.sharedInput = true;
+        key.config = rendition.config;
+
+        std::unique_ptr<Output> output(new Output());
+        output->encoder = sessionPool ? sessionPool->Acquire(key) : EncoderSession::Open(key);
+        EncoderSession& encoder = *output->encoder;
+        output->vppOutSurfaces.reset(new SurfacePool(encoder.vppOutSurfacePool, encoder.nSurfNumVPPOut));
+        // 各路VPP的输入格式相同，共用输入surface要够最贪心的一路持有
+        inputFrameInfo = encoder.inputFrameInfo;
+        inputSurfNum = std::max<size_t>(inputSurfNum, encoder.inputSurfNum);
+        outputs.push_back(std::move(output));
+    }
+
+    // 2.共用输入surface，每帧只上传一次，所有VPP都从这里读
+    inputSurfPool = (mfxFrameSurface1 *)calloc(sizeof(mfxFrameSurface1), inputSurfNum);
+    mfxStatus sts = EncoderSession::AllocateExternalSystemMemorySurfacePool(&inputBuf, inputSurfPool,
+                                                                            inputFrameInfo, inputSurfNum);
+    VERIFY(MFX_ERR_NONE == sts, "Error in external surface allocation for ladder input\n");
+    inputSurfaces.reset(new SurfacePool(inputSurfPool, inputSurfNum));
+    // 输入帧上传时拷贝进surface，缓冲区只被队列和正在push、正在上传的帧引用
+    frameBuffers.reset(new FrameBufferPool(inputFrameInfo.Height, inputFrameInfo.Width, CV_8UC4,
+                                           imageQueue->Capacity() + FRAME_BUFFER_POOL_EXTRA, &frameAllocator));
+
+    // 3.打开各路输出文件，写线程接管文件写入，提交和同步交给各自的EncodePipeline
+    for (size_t i = 0; i < outputs.size(); i++) {
+        Output& output = *outputs[i];
+        output.sink = fopen(renditions[i].filePath.c_str(), "wb");
+        VERIFY(output.sink != NULL, "open output file failed");
+        output.writer.reset(new BitstreamWriter(output.sink));
+        output.pipeline.reset(new EncodePipeline(*output.encoder, *output.writer));
+        SurfacePool *vppOutSurfaces = output.vppOutSurfaces.get();
+        output.pipeline->SetReleasedCallback([this, vppOutSurfaces] {
+            // 这一帧的VPP输出和共用输入都可能已经解锁
+            vppOutSurfaces->NotifyReleased();
+            inputSurfaces->NotifyReleased();
+        });
+    }
+
+    // 4.全部准备好之后再启动各路同步线程和编码线程
+    for (std::unique_ptr<Output>& output : outputs)
+        output->pipeline->Start();
+    encodeThread = std::thread(&VplLadderEncodeModule::EncodeLoop, this);
+}
+
+VplLadderEncodeModule::~VplLadderEncodeModule()
+{
+    {
+        std::lock_guard<std::mutex> lock(eventLock);
+        isStillGoing = false;
+    }
+    eventCond.notify_all();
+    spaceCond.notify_all();
+    if (encodeThread.joinable())
+        encodeThread.join(); // 编完剩余帧、排空编码器、停掉同步线程后退出
+
+    for (std::unique_ptr<Output>& output : outputs) {
+        output->pipeline.reset();   // bit流缓冲区还给session
+        if (output->encoder) {
+            if (sessionPool)
+                sessionPool->Release(std::move(output->encoder));
+            else
+                output->encoder.reset();
+        }
+        output->writer.reset(); // 写完剩余数据再关闭文件
+        if (output->sink)
+            fclose(output->sink);
+    }
+
+    // 所有VPP都已关闭或排空，不再读共用输入surface
+    if (inputBuf || inputSurfPool)
+        EncoderSession::FreeExternalSystemMemorySurfacePool(inputBuf, inputSurfPool);
+}
+
+void VplLadderEncodeModule::push(const cv::Mat& image, mfxU64 timeStamp)
+{
+    InputFrame input;
+    if (timeStamp == MFX_TIMESTAMP_UNKNOWN) {
+        // 同VplEncodeModule：没给采集时间时用push时刻，90kHz
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime);
+        timeStamp = (mfxU64)us.count() * 9 / 100;
+    }
+    input.timeStamp = timeStamp;
+    input.frameOrder = nextFrameOrder++;
+    ConvertFrame(image, input.image);
+    PushBlocking(input);
+    NotifyFrameArrived();
+}
+
+void VplLadderEncodeModule::PushBlocking(InputFrame& input)
+{
+    if (imageQueue->TryPush(input))
+        return;
+    std::unique_lock<std::mutex> lock(eventLock);
+    producersWaiting++;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    spaceCond.wait(lock, [this, &input] { return imageQueue->TryPush(input) || !isStillGoing; });
+    producersWaiting--;
+}
+
+// 同VplEncodeModule：两边各自“先写队列/标志，再读对方的标志/队列”，中间的seq_cst fence保证不丢唤醒，
+// 只有对方真的在等待时才加锁
+void VplLadderEncodeModule::NotifyFrameArrived()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (encoderWaiting.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(eventLock);
+        eventCond.notify_one();
+    }
+}
+
+void VplLadderEncodeModule::NotifySpaceAvailable()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (producersWaiting.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> lock(eventLock);
+        spaceCond.notify_all();
+    }
+}
+
+bool VplLadderEncodeModule::WaitForFrame()
+{
+    if (imageQueue->Size() > 0)
+        return true;
+    std::unique_lock<std::mutex> lock(eventLock);
+    encoderWaiting.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    eventCond.wait(lock, [this] { return imageQueue->Size() > 0 || !isStillGoing; });
+    encoderWaiting.store(false, std::memory_order_relaxed);
+    return imageQueue->Size() > 0;
+}
+
+void VplLadderEncodeModule::ConvertFrame(const cv::Mat& image, cv::Mat& input)
+{
+    VERIFY(image.cols <= inputFrameInfo.Width && image.rows <= inputFrameInfo.Height, "input image larger than surface");
+    // 写进按surface对齐的缓冲区，编码线程按行拷进surface
+    input = frameBuffers->Acquire()(cv::Rect(0, 0, image.cols, image.rows));
+    if (image.elemSize() == 3)
+        ConvertBGRToRGB4(image.data, image.step, input.data, input.step, image.cols, image.rows);
+    else if (image.elemSize() == 1)
+        cv::cvtColor(image, input, cv::COLOR_GRAY2BGRA);
+    else
+        image.copyTo(input);
+}
+
+void VplLadderEncodeModule::EncodeLoop()
+{
+    // 要求退出且队列已空时返回false
+    while (WaitForFrame()) {
+        InputFrame frame;
+        if (!imageQueue->TryPop(frame))
+            continue;
+        NotifySpaceAvailable();
+        EncodeOneFrame(frame);
+    }
+    for (std::unique_ptr<Output>& output : outputs) {
+        output->pipeline->Drain();  // VPP没有缓存帧，只需排空编码器
+        output->pipeline->Stop();
+    }
+}
+
+void VplLadderEncodeModule::EncodeOneFrame(InputFrame& frame)
+{
+    // 1.上传一次：拷进一个所有VPP都释放了的共用输入surface
+    mfxFrameSurface1 *surface = inputSurfaces->Acquire();
+    mfxFrameData& data = surface->Data;
+    CopyPlane(frame.image.data, frame.image.step, data.B, data.Pitch, frame.image.cols * 4,
+              std::min<int>(frame.image.rows, inputFrameInfo.Height));
+    data.TimeStamp = frame.timeStamp;
+    data.FrameOrder = (mfxU32)frame.frameOrder;
+    frame.image.release();  // 缓冲区回到FrameBufferPool
+
+    // 2.每一路各自缩放和编码，runtime在各个VPP读完之前一直锁着这个surface
+    for (size_t i = 0; i < outputs.size(); i++) {
+        mfxStatus sts = ScaleAndEncode(*outputs[i], surface);
+        if (sts != MFX_ERR_NONE && sts != MFX_ERR_MORE_DATA)
+            LOG_EVERY_MS(LOG_LEVEL_WARN, LOG_FRAME_INTERVAL_MS, "ladder output %zu sts %d", i, sts);
+    }
+}
+
+mfxStatus VplLadderEncodeModule::ScaleAndEncode(Output& output, mfxFrameSurface1 *inputSurface)
+{
+    mfxFrameSurface1 *vppOutSurface = output.vppOutSurfaces->Acquire();
+    // VPP和Encode在同一个session中，VPP的输出不需要同步，直接交给编码器
+    mfxSyncPoint vppSyncp = NULL;
+    mfxStatus status;
+    for (;;) {
+        status = MFXVideoVPP_RunFrameVPPAsync(output.encoder->session, inputSurface, vppOutSurface, NULL, &vppSyncp);
+        if (status != MFX_WRN_DEVICE_BUSY)
+            break;
+        output.pipeline->WaitDeviceBusy();
+    }
+    if (status != MFX_ERR_NONE)
+        return status;
+    return output.pipeline->Encode(vppOutSurface);
+}
+
+EncodeThroughput VplLadderEncodeModule::GetThroughput(size_t index) const
+{
+    EncodePipelineStatus status = outputs.at(index)->pipeline->GetStatus();
+    EncodeThroughput throughput;
+    throughput.encodedFrames = status.encodedFrames;
+    throughput.encodedBytes = status.encodedBytes;
+    throughput.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    throughput.framesPerSecond = throughput.seconds > 0 ? throughput.encodedFrames / throughput.seconds : 0;
+    return throughput;
+}
+
+EncodePipelineStatus VplLadderEncodeModule::GetEncodeStatus(size_t index) const
+{
+    return outputs.at(index)->pipeline->GetStatus();
+}
+
+BitstreamWriterStatus VplLadderEncodeModule::GetWriterStatus(size_t index)
+{
+    return outputs.at(index)->writer->GetStatus();
+}
+
+SurfacePoolStatus VplLadderEncodeModule::GetSurfacePoolStatus() const
+{
+    return inputSurfaces->GetStatus();
+}